@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+
+import json
+import os
+import sys
+
+# Functions
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} BASELINE.json CANDIDATE.json
+    Compare two bench_spidey.sh reports (e.g. two commits).
+
+Usage: {progname} -m MODE_A MODE_B REPORT.json
+    Compare two server modes within one report.
+    ''')
+    sys.exit(status)
+
+def load(path):
+    ''' Load report and index its results by (mode, target, concurrency) '''
+    with open(path) as stream:
+        report = json.load(stream)
+
+    return report, {
+        (r['mode'], r['target'], r['concurrency']): r['result'] for r in report['results']
+    }
+
+def delta(old, new):
+    ''' Return relative change as a percentage string '''
+    if not old:
+        return '     n/a'
+    return f'{(new - old) / old * 100:+7.1f}%'
+
+def compare(pairs):
+    ''' Print throughput and tail latency for each pair of matching results '''
+    print(f'{"benchmark":<36} {"req/s":>12} {"req/s":>12} {"":>8} {"p99 us":>10} {"p99 us":>10} {"":>8}')
+    for name, old, new in pairs:
+        if 'error' in old or 'error' in new:
+            print(f'{name:<36} error')
+            continue
+
+        old_rps = old['requests_per_sec']
+        new_rps = new['requests_per_sec']
+        old_p99 = old['latency_usec']['corrected']['p99']
+        new_p99 = new['latency_usec']['corrected']['p99']
+        print(f'{name:<36} {old_rps:12.1f} {new_rps:12.1f} {delta(old_rps, new_rps)} '
+              f'{old_p99:10d} {new_p99:10d} {delta(old_p99, new_p99)}')
+
+def main():
+    arguments = sys.argv[1:]
+
+    if len(arguments) == 4 and arguments[0] == '-m':
+        mode_a, mode_b = arguments[1:3]
+        _, results = load(arguments[3])
+        pairs = [
+            (f'{target} c={level}', result, results[(mode_b, target, level)])
+            for (mode, target, level), result in results.items()
+            if mode == mode_a and (mode_b, target, level) in results
+        ]
+        print(f'{mode_a} vs {mode_b}')
+    elif len(arguments) == 2 and not arguments[0].startswith('-'):
+        old_report, old_results = load(arguments[0])
+        new_report, new_results = load(arguments[1])
+        pairs = [
+            (f'{mode} {target} c={level}', result, new_results[(mode, target, level)])
+            for (mode, target, level), result in old_results.items()
+            if (mode, target, level) in new_results
+        ]
+        print(f'{old_report["commit"]} vs {new_report["commit"]}')
+    else:
+        usage(1)
+
+    compare(pairs)
+
+# Main execution
+
+if __name__ == '__main__':
+    main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,162 @@
+#!/bin/bash
+
+# bench_spidey.sh: Local benchmark matrix for spidey server modes
+#
+# Generates its own document root, starts bin/spidey on loopback in each
+# concurrency mode, and sweeps file sizes, directory listings and CGI at
+# several concurrency levels with bin/thor.  Results are written as a single
+# JSON document so runs can be compared across modes and commits (see
+# bin/bench_compare.py).
+
+SPIDEY=bin/spidey
+THOR=bin/thor
+WORKSPACE=/tmp/spidey-bench.$(id -u)
+MODES="single forking prefork event"
+CONCURRENCY="1 4 16"
+SIZES="1K 64K 1M 16M"
+DURATION=5
+OUTPUT=-
+PORT=$((20000 + RANDOM % 10000))
+
+# Functions
+
+usage() {
+    cat <<EOF
+Usage: $(basename $0) [options]
+    -m MODES        Server modes to benchmark ($MODES)
+    -c LEVELS       Concurrency levels ($CONCURRENCY)
+    -s SIZES        Static file sizes ($SIZES)
+    -d SECONDS      Duration of each run ($DURATION)
+    -t TARGETS      Only run targets whose name matches this pattern
+    -o PATH         Write JSON results to PATH instead of stdout
+EOF
+    exit $1
+}
+
+cleanup() {
+    [ -n "$SERVER" ] && kill $SERVER 2> /dev/null && wait $SERVER 2> /dev/null
+    rm -fr $WORKSPACE
+    exit ${1:-0}
+}
+
+generate_fixtures() {
+    mkdir -p $WORKSPACE/www/files $WORKSPACE/www/listing
+    cp -r www/scripts $WORKSPACE/www/scripts
+
+    for size in $SIZES; do
+	head -c $size /dev/urandom > $WORKSPACE/www/files/$size.bin
+    done
+
+    for i in $(seq 1 500); do
+	touch $WORKSPACE/www/listing/entry-$i.txt
+    done
+}
+
+start_server() {
+    $SPIDEY -r $WORKSPACE/www -p $PORT -c $1 2> $WORKSPACE/spidey.$1.log &
+    SERVER=$!
+
+    for i in $(seq 1 50); do
+	curl -s -o /dev/null http://127.0.0.1:$PORT/ && return 0
+	sleep 0.1
+    done
+
+    echo "Unable to start $SPIDEY in $1 mode (see $WORKSPACE/spidey.$1.log)" 1>&2
+    return 1
+}
+
+stop_server() {
+    kill $SERVER 2> /dev/null
+    wait $SERVER 2> /dev/null
+    SERVER=
+}
+
+# Parse command line options
+
+while getopts "m:c:s:d:t:o:h" option; do
+    case $option in
+	m) MODES="$OPTARG" ;;
+	c) CONCURRENCY="$OPTARG" ;;
+	s) SIZES="$OPTARG" ;;
+	d) DURATION="$OPTARG" ;;
+	t) FILTER="$OPTARG" ;;
+	o) OUTPUT="$OPTARG" ;;
+	h) usage 0 ;;
+	*) usage 1 ;;
+    esac
+done
+
+if [ ! -x $SPIDEY ] || [ ! -x $THOR ]; then
+    echo "Missing $SPIDEY or $THOR: run make first" 1>&2
+    exit 1
+fi
+
+# Setup
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+rm -fr $WORKSPACE
+mkdir -p $WORKSPACE
+generate_fixtures
+
+TARGETS=""
+for size in $SIZES; do
+    TARGETS="$TARGETS file-$size:/files/$size.bin"
+done
+TARGETS="$TARGETS listing:/listing cgi-env:/scripts/env.sh"
+
+# Benchmark
+
+RESULTS=$WORKSPACE/results
+: > $RESULTS
+
+for mode in $MODES; do
+    PORT=$((PORT + 1))  # Avoid TIME_WAIT from the previous mode's socket
+    start_server $mode || exit 1
+
+    for target in $TARGETS; do
+	name=${target%%:*}
+	uri=${target#*:}
+	if [ -n "$FILTER" ] && ! [[ $name =~ $FILTER ]]; then
+	    continue
+	fi
+
+	for level in $CONCURRENCY; do
+	    echo "$mode $name c=$level ..." 1>&2
+	    result=$($THOR -j -h $level -d $DURATION http://127.0.0.1:$PORT$uri)
+	    if [ -z "$result" ]; then
+		result='{"error": "thor produced no output"}'
+	    fi
+	    if ! kill -0 $SERVER 2> /dev/null; then
+		result='{"error": "server exited"}'
+		PORT=$((PORT + 1))
+		start_server $mode || exit 1
+	    fi
+	    echo "{\"mode\": \"$mode\", \"target\": \"$name\", \"uri\": \"$uri\", \"concurrency\": $level, \"result\": $result}" >> $RESULTS
+	done
+    done
+
+    stop_server
+done
+
+# Report
+
+{
+    echo "{"
+    echo "  \"commit\": \"$(git rev-parse --short HEAD 2> /dev/null || echo unknown)\","
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"host\": \"$(uname -n)\","
+    echo "  \"cpus\": $(nproc),"
+    echo "  \"duration\": $DURATION,"
+    echo "  \"results\": ["
+    sed '$!s/$/,/; s/^/    /' $RESULTS
+    echo "  ]"
+    echo "}"
+} > $WORKSPACE/report.json
+
+if [ "$OUTPUT" = "-" ]; then
+    cat $WORKSPACE/report.json
+else
+    cp $WORKSPACE/report.json $OUTPUT
+fi
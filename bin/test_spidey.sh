@@ -14,6 +14,7 @@ error() {
 
 cleanup() {
     STATUS=${1:-$FAILURES}
+    stop_servers
     rm -fr $WORKSPACE
     exit $STATUS
 }
@@ -37,7 +38,7 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -73,6 +74,19 @@ check_hrefs() {
     fi
 }
 
+start_server() {
+    ./bin/spidey "$@" > $WORKSPACE/server.$2.log 2>&1 &
+    SERVERS="$SERVERS $!"
+    sleep 1
+}
+
+stop_servers() {
+    for server in $SERVERS; do
+    	kill $server 2> /dev/null && wait $server 2> /dev/null
+    done
+    SERVERS=""
+}
+
 # Setup
 
 mkdir $WORKSPACE
@@ -84,6 +98,11 @@ trap "cleanup 1" INT TERM
 
 # ------------------------------------------------------------------------------
 
+HOST="$1"
+PORT="$2"
+MODE="$3"
+
+if [ -z "$MODE" ]; then
 echo
 cowsay -W 72 <<EOF
 On another machine, please run:
@@ -92,22 +111,27 @@ On another machine, please run:
 
 - Where PORT is a number between 9000 - 9999
 
-- Where MODE is either single or forking
+- Where MODE is single, forking, prefork or event
+
+Or pass MODE as a third argument to start ./bin/spidey -r www here.
 EOF
 echo
+fi
 
-HOST="$1"
 while [ -z "$HOST" ]; do
     read -p "Server Host: " HOST
 done
 
-PORT="$2"
 while [ -z "$PORT" ]; do
     read -p "Server Port: " PORT
 done
 
+if [ -n "$MODE" ]; then
+    start_server -p $PORT -r www -c $MODE
+fi
+
 echo
-echo "Testing spidey server on $HOST:$PORT ..."
+echo "Testing spidey server on $HOST:$PORT${MODE:+ in $MODE mode} ..."
 
 # ------------------------------------------------------------------------------
 
@@ -400,3 +424,205 @@ if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$S
 else
     echo "Success"
 fi
+
+# ------------------------------------------------------------------------------
+
+# The remaining checks start servers of their own with the options they test
+if [ -z "$MODE" ]; then
+    exit
+fi
+
+printf "\n %-64s ... \n" "Handle Proxy Requests"
+
+start_server -p $((PORT + 1)) -r www -c $MODE
+start_server -p $((PORT + 2)) -r www/html -c $MODE -P /images=$HOST:$((PORT + 1)) -P /text=$HOST:$((PORT + 3))
+
+printf "     %-60s ... " "/images/b.jpg"
+MD5SUM=7552baf02d08fb11a5f76677a9de6bb1
+STATUS="HTTP/1.0 200 OK"
+CONTENT="image/jpeg"
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 2))/images/b.jpg > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/text/hackers.txt (upstream down)"
+STATUS="HTTP/1.0 502 Bad Gateway"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 2))/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "502" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_servers
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle HTTP/2 Requests"
+
+start_server -p $((PORT + 1)) -r www -c $MODE
+
+printf "     %-60s ... " "/html/index.html (prior knowledge)"
+MD5SUM=36fcc1da4afe58242350ee3940bb4220
+STATUS="HTTP/2 200 "
+CONTENT="text/html"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$((PORT + 1))/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/images/a.png (prior knowledge)"
+MD5SUM=648cb635b64492a5d78041a8094a9df0
+CONTENT="image/png"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$((PORT + 1))/images/a.png > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_servers
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Cached CGI Requests"
+
+start_server -p $((PORT + 1)) -r www -c $MODE -C 30
+
+printf "     %-60s ... " "/scripts/env.sh (twice)"
+STATUS="HTTP/1.0 200 OK"
+CONTENT="text/plain"
+curl -s $HOST:$((PORT + 1))/scripts/env.sh > $WORKSPACE/first
+MD5SUM=$(md5sum $WORKSPACE/first | awk '{print $1}')
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 1))/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "REMOTE_PORT" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/scripts/env.sh?other (not cached)"
+curl -s -D $WORKSPACE/header "$HOST:$((PORT + 1))/scripts/env.sh?other" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "QUERY_STRING=other" $WORKSPACE/test || cmp -s $WORKSPACE/first $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/scripts/env.sh?head (GET after HEAD)"
+curl -s -I $HOST:$((PORT + 1))/scripts/env.sh?head > /dev/null
+curl -s -D $WORKSPACE/header "$HOST:$((PORT + 1))/scripts/env.sh?head" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "REQUEST_METHOD=GET" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_servers
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Archive Requests"
+
+./bin/spidey-pack www $WORKSPACE/www.pack > /dev/null
+start_server -p $((PORT + 1)) -r $WORKSPACE/www.pack -c $MODE
+
+printf "     %-60s ... " "/html"
+HREFS="/html/..,/html/index.html"
+STATUS="HTTP/1.0 200 OK"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 1))/html > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all ".. index.html" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/images/b.jpg"
+MD5SUM=7552baf02d08fb11a5f76677a9de6bb1
+CONTENT="image/jpeg"
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 1))/images/b.jpg > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/asdf"
+STATUS="HTTP/1.0 404 Not Found"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 1))/asdf > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_servers
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Limited Requests"
+
+start_server -p $((PORT + 1)) -r www -c $MODE -R 0.1,2
+
+printf "     %-60s ... " "/html/index.html (within burst)"
+MD5SUM=36fcc1da4afe58242350ee3940bb4220
+STATUS="HTTP/1.0 200 OK"
+CONTENT="text/html"
+curl -s $HOST:$((PORT + 1))/html/index.html > /dev/null
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 1))/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/html/index.html (past burst)"
+STATUS="HTTP/1.0 429 Too Many Requests"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 1))/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "Too.Many" $WORKSPACE/test || ! grep -q -i "^Retry-After: [0-9]" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_servers
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Filtered Requests"
+
+cp -r www $WORKSPACE/www
+start_server -p $((PORT + 1)) -r $WORKSPACE/www -c $MODE -N 1000
+
+printf "     %-60s ... " "/asdf"
+STATUS="HTTP/1.0 404 Not Found"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 1))/asdf > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/text/new/new.txt (created after start)"
+STATUS="HTTP/1.0 200 OK"
+CONTENT="text/plain"
+mkdir $WORKSPACE/www/text/new
+echo "spidey" > $WORKSPACE/www/text/new/new.txt
+curl -s -D $WORKSPACE/header $HOST:$((PORT + 1))/text/new/new.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "spidey" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_servers
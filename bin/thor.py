@@ -82,7 +82,7 @@ def main():
     # Create pool of workers and perform throws
     args = [(url, throws, verbose, hid) for hid in range(hammers)]
 
-    with concurrent.futures.ProcessPoolExecutor(throws) as executor:
+    with concurrent.futures.ProcessPoolExecutor(hammers) as executor:
         result = list(executor.map(do_hammer, args))
 
     total = 0
@@ -3,10 +3,15 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Constants */
@@ -19,15 +24,45 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    PREFORK,                            /**< Worker process pinned per core */
+    EVENT,                              /**< Coroutine per connection on epoll */
     UNKNOWN
 } ServerMode;
 
+/* Socket Configuration */
+
+#define MAX_LISTENERS   16
+#define MAX_WORKERS     64
+#define CACHE_LINE      64              /**< Padding for per-worker counters */
+
+typedef struct {
+    bool    nodelay;                    /**< Disable Nagle on accepted sockets */
+    int     defer_accept;               /**< TCP_DEFER_ACCEPT seconds (0 = off) */
+    int     fastopen;                   /**< TCP_FASTOPEN queue length (0 = off) */
+    int     sndbuf;                     /**< SO_SNDBUF bytes (0 = kernel default) */
+    int     rcvbuf;                     /**< SO_RCVBUF bytes (0 = kernel default) */
+    int     backlog;                    /**< listen(2) backlog */
+    bool    reuseport;                  /**< SO_REUSEPORT (one socket per worker) */
+} SocketOptions;
+
+typedef struct {
+    int     fds[MAX_LISTENERS];         /**< Listening socket file descriptors */
+    bool    secure[MAX_LISTENERS];      /**< Whether connections speak TLS */
+    size_t  count;                      /**< Number of listening sockets */
+    size_t  next;                       /**< Where socket_wait resumes scanning */
+} Listeners;
+
 /* Global Variables */
 
 extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern SocketOptions ListenOptions;     /**< Listening socket tuning */
+extern size_t Workers;                  /**< Worker processes (1 unless prefork) */
+extern size_t WorkerId;                 /**< Index of this worker process */
+extern volatile sig_atomic_t Draining;  /**< Stop accepting, finish in-flight requests */
+extern volatile sig_atomic_t Terminating;   /**< Stop without finishing them (SIGTERM, SIGINT) */
 
 /* Logging Macros */
 
@@ -40,15 +75,92 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Request Tracing */
+
+typedef enum {
+    TRACE_REQUEST,                      /**< handle_request, handshake to response */
+    TRACE_ACCEPT,                       /**< accept4 */
+    TRACE_LOOKUP,                       /**< getnameinfo */
+    TRACE_HANDSHAKE,                    /**< TLS handshake */
+    TRACE_PARSE,                        /**< parse_request */
+    TRACE_CONTENT,                      /**< content_serve */
+    TRACE_FILTER,                       /**< filter_missing */
+    TRACE_PATH,                         /**< determine_request_path (realpath) */
+    TRACE_RESOURCE,                     /**< resource_lookup (stat, mimetype on a miss) */
+    TRACE_SEND,                         /**< Writing a file's headers and body */
+    TRACE_FILE,                         /**< handle_file_request */
+    TRACE_BROWSE,                       /**< handle_browse_request */
+    TRACE_CGI,                          /**< handle_cgi_request */
+    TRACE_POPEN,                        /**< Starting a CGI script */
+    TRACE_PROXY,                        /**< handle_proxy_request */
+    TRACE_MODULE,                       /**< handle_module_request */
+    TRACE_ARCHIVE,                      /**< handle_archive_request */
+    TRACE_HTTP2,                        /**< handle_http2 */
+    TRACE_PHASES
+} TracePhase;
+
+int         trace_init(const char *path);
+uint32_t    trace_request(void);
+uint64_t    trace_begin(void);
+void        trace_end(uint32_t request, TracePhase phase, uint64_t start);
+int         trace_dump(void);
+void        trace_poll(void);
+
+/* Evaluate call, recording it as a phase of request r when tracing */
+#define trace(r, phase, call)   ({ uint64_t trace_start_ = trace_begin(); __typeof__(call) trace_result_ = (call); trace_end((r)->trace, (phase), trace_start_); trace_result_; })
+
 /* HTTP Request */
 
+typedef enum {
+    HEADER_HOST = 0,
+    HEADER_CONNECTION,
+    HEADER_KEEP_ALIVE,
+    HEADER_UPGRADE,
+    HEADER_HTTP2_SETTINGS,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_TE,
+    HEADER_TRAILER,
+    HEADER_USER_AGENT,
+    HEADER_REFERER,
+    HEADER_COOKIE,
+    HEADER_AUTHORIZATION,
+    HEADER_PROXY_AUTHORIZATION,
+    HEADER_PROXY_CONNECTION,
+    HEADER_X_FORWARDED_FOR,
+    HEADER_CACHE_CONTROL,
+    HEADER_KNOWN,                       /* Number of well-known headers */
+    HEADER_OTHER = HEADER_KNOWN,        /* Any other header */
+} HeaderId;
+
+#define HEADER_BUCKETS  16              /* Hash buckets for other headers */
+
 typedef struct header Header;
 struct header {
     char    *name;                      /*< Name of header entry */
     char    *data;                      /*< Data of header entry */
     Header  *next;                      /*< Next header entry */
+    HeaderId id;                        /*< Well-known header ID (or HEADER_OTHER) */
+    Header  *chain;                     /*< Next header in same slot or bucket */
 };
 
+typedef struct {
+    Header  *known[HEADER_KNOWN];       /*< Headers indexed by well-known ID */
+    Header  *other[HEADER_BUCKETS];     /*< Remaining headers by case-insensitive hash */
+} HeaderTable;
+
+HeaderId    header_id(const char *name, size_t length);
+const char *header_name(HeaderId id);
+size_t      header_bucket(const char *name);
+
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
     FILE    *stream;                    /*< Client socket file stream */
@@ -61,11 +173,34 @@ typedef struct {
     char     port[NI_MAXSERV];          /*< Port number of client */
 
     Header  *headers;                   /*< List of name, data Header pairs */
+    HeaderTable table;                  /*< Index of headers for lookups */
+
+    bool     secure;                    /*< Connection accepted on a TLS listener */
+    struct ssl_st *ssl;                 /*< TLS session (NULL for plain connections) */
+    bool     ktls;                      /*< Kernel encrypts writes to fd */
+    struct limit_slot *limit;           /*< Client slot counting this connection (NULL if none) */
+    uint32_t trace;                     /*< Trace ID of request (0 = not traced) */
+    struct capture *capture;            /*< Bytes received, when capturing (NULL if none) */
+
+    char     input[BUFSIZ];             /*< Bytes read from client socket */
+    size_t   input_offset;              /*< Offset of next unconsumed byte in input */
+    size_t   input_length;              /*< Number of valid bytes in input */
 } Request;
 
-Request *   accept_request(int sfd);
+Request *   accept_request(int sfd, bool secure);
 void	    free_request(Request *request);
 int	    parse_request(Request *request);
+char *	    request_gets(Request *request, char *s, size_t size);
+ssize_t	    request_read(Request *request, void *data, size_t length);
+bool	    request_wait(Request *request, int timeout);
+int	    request_add_header(Request *request, const char *name, const char *data);
+const char *request_header(Request *request, const char *name);
+const char *request_known_header(Request *request, HeaderId id);
+void	    request_free_headers(Request *request);
+FILE *	    request_stream(Request *request);
+ssize_t	    request_write(Request *request, const void *data, size_t length, int flags);
+ssize_t	    request_writev(Request *request, struct iovec *iov, int iovcnt);
+ssize_t	    request_sendfile(Request *request, int fd, off_t offset, size_t length);
 
 /* HTTP Request Handlers */
 
@@ -74,28 +209,275 @@ typedef enum {
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
 } Status;
 
+extern size_t LargeFileSize;            /**< Files streamed past the page cache (0 = none) */
+
+bool        large_file_configure(const char *spec);
 Status      handle_request(Request *request);
+Status      dispatch_request(Request *request);
+Status      handle_error(Request *request, Status status);
+
+/* HTTP/2 */
+
+typedef struct {
+    char    *name;                      /*< Header field name */
+    char    *value;                     /*< Header field value */
+} HpackEntry;
+
+typedef struct {
+    HpackEntry *entries;                /*< Ring of dynamic table entries */
+    size_t   capacity;                  /*< Number of slots in entries */
+    size_t   head;                      /*< Slot of newest entry */
+    size_t   count;                     /*< Number of entries */
+    size_t   size;                      /*< Size per RFC 7541 4.1 */
+    size_t   max_size;                  /*< Current maximum size */
+    size_t   settings_size;             /*< Limit advertised in SETTINGS */
+} HpackTable;
+
+void        hpack_init(HpackTable *table, size_t max_size);
+void        hpack_free(HpackTable *table);
+int         hpack_decode(HpackTable *table, const uint8_t *data, size_t length,
+                         int (*emit)(void *ctx, const char *name, const char *value), void *ctx);
+size_t      hpack_encode(uint8_t *out, size_t size, const char *name, const char *value);
+
+bool        http2_requested(Request *request);
+Status      handle_http2(Request *request);
+
+/* CGI Response Cache */
+
+bool        cgi_cache_configure(const char *spec);
+int         cgi_cache_init(void);
+void        cgi_cache_cleanup(void);
+bool        cgi_cache_enabled(Request *request);
+bool        cgi_cache_serve(Request *request);
+int         cgi_cache_lock(Request *request);
+void        cgi_cache_unlock(int lock);
+void        cgi_cache_store(Request *request, const char *data, size_t length);
+
+/* Reverse Proxy */
+
+typedef enum {
+    ROUND_ROBIN,                        /**< Rotate through upstreams */
+    LEAST_CONNECTIONS,                  /**< Upstream with fewest requests in flight */
+} ProxyBalance;
+
+extern ProxyBalance ProxyPolicy;        /**< Upstream balancing policy */
+extern bool ProxyPooling;               /**< Keep idle upstream connections for reuse */
+
+bool        proxy_add_route(const char *spec);
+bool        proxy_set_balance(const char *policy);
+int         proxy_init(void);
+bool        proxy_requested(Request *request);
+Status      handle_proxy_request(Request *request);
+
+/* Handler Modules */
+
+#define MAX_MODULES     16
+#define MODULE_INIT     "spidey_module_init"    /* bool spidey_module_init(void), exported by each module */
+
+typedef struct response Response;
+
+/**
+ * Module request handler: writes a response with the response_ functions,
+ * or returns an error Status to have handle_error answer instead.
+ **/
+typedef Status (*ModuleHandler)(Request *request, Response *response);
+
+bool        module_load(const char *path);
+bool        module_register(const char *prefix, ModuleHandler handler);
+bool        module_requested(Request *request);
+Status      handle_module_request(Request *request);
+
+void        response_status(Response *response, int code, const char *reason);
+void        response_header(Response *response, const char *name, const char *value);
+size_t      response_write(Response *response, const void *data, size_t length);
+int         response_printf(Response *response, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/* Client Limits */
+
+typedef struct limit_slot LimitSlot;
+
+bool        limit_configure(const char *spec);
+int         limit_init(void);
+bool        limit_admit(Request *request);
+void        limit_release(Request *request);
+void        limit_release_slot(LimitSlot *slot);
+void        limit_reclaim(size_t worker);
+
+/* Traffic Capture
+ *
+ * A capture is a CaptureHeader followed by a record per connection: the
+ * nanoseconds from epoch to its first bytes and the number of bytes (each an
+ * unsigned LEB128 varint), then the bytes the client sent.  Records are
+ * appended as connections finish, so they are only roughly in time order.
+ */
+
+#define CAPTURE_MAGIC   "SPIDEYC1"
+
+typedef struct {
+    char     magic[8];                  /*< CAPTURE_MAGIC (not NUL-terminated) */
+    uint64_t epoch;                     /*< CLOCK_MONOTONIC nanoseconds records are relative to */
+} CaptureHeader;
+
+int         capture_init(const char *path);
+void        capture_append(Request *request, const void *data, size_t length);
+void        capture_end(Request *request);
+
+/* TLS */
+
+int         tls_init(const char *certificate, const char *key);
+int         tls_accept(Request *request);
+ssize_t     tls_read(Request *request, void *data, size_t length);
+ssize_t     tls_write(Request *request, const void *data, size_t length);
+ssize_t     tls_writev(Request *request, const struct iovec *iov, int iovcnt);
+bool        tls_pending(Request *request);
+void        tls_shutdown(Request *request);
+
+/* Response Header Cache */
+
+typedef struct {
+    char    *path;                      /*< Real path of cached resource */
+    char    *mimetype;                  /*< Mimetype determined from path */
+    dev_t    dev;                       /*< Device of resource when rendered */
+    ino_t    ino;                       /*< Inode of resource when rendered */
+    off_t    size;                      /*< Size of resource when rendered */
+    struct timespec mtime;              /*< Modification time when rendered */
+
+    char    *headers;                   /*< Status line and headers */
+    size_t   headers_length;            /*< Length of headers */
+    size_t   date_offset;               /*< Offset of Date value in headers */
+    time_t   date_stamp;                /*< Second the Date value was patched */
+} Resource;
+
+Resource *  resource_lookup(const char *path, const struct stat *s);
+const char *resource_headers(Resource *resource, size_t *length);
+int         resource_init(void);
+int         resource_save(const char *manifest);
+int         resource_prewarm(const char *manifest);
+
+/* Shared Content Cache */
+
+bool        content_configure(const char *spec);
+int         content_init(void);
+bool        content_enabled(void);
+bool        content_serve(Request *request);
+void        content_store(Request *request, Resource *resource, int fd, const struct stat *s);
+
+/* Negative Lookup Filter */
+
+bool        filter_configure(const char *spec);
+int         filter_init(void);
+bool        filter_enabled(void);
+bool        filter_missing(const char *uri);
 
 /* HTTP Server */
 
-int         single_server(int sfd);
-int         forking_server(int sfd);
+int         single_server(Listeners *listeners);
+int         forking_server(Listeners *listeners);
+int         prefork_server(Listeners *listeners);
+int         event_server(Listeners *listeners);
+
+/* Coroutines */
+
+typedef struct coroutine Coroutine;
+
+Coroutine * coroutine_spawn(void (*function)(void *arg), void *arg);
+bool        coroutine_active(void);
+size_t      coroutine_count(void);
+int         coroutine_wait(int fd, short events, int timeout);
+void        coroutine_cancel(Coroutine *coroutine);
+int         coroutine_dispatch(void);
 
 /* Socket */
 
-int	    socket_listen(const char *port);
+int	    socket_listen(const char *address, Listeners *listeners);
+int	    socket_wait(Listeners *listeners);
+bool	    socket_secure(Listeners *listeners, int fd);
+int	    socket_clone(Listeners *listeners, Listeners *clone);
+int	    socket_steer(Listeners *listeners, const int *cpus, size_t count);
+void	    socket_close(Listeners *listeners);
+bool	    socket_option(const char *option);
+
+/* Packed Asset Archive */
+
+#define PACK_MAGIC      "SPDYPAK1"
+
+typedef enum {
+    PACK_FILE,                          /**< Static file */
+    PACK_DIRECTORY,                     /**< Rendered directory listing */
+    PACK_CGI,                           /**< Script run from its path on disk */
+} PackType;
+
+/**
+ * Archive layout: header, entries sorted by path, then strings and bodies.
+ * Offsets are from the start of the archive.
+ **/
+typedef struct {
+    char        magic[8];               /**< PACK_MAGIC */
+    uint64_t    count;                  /**< Number of entries */
+    uint64_t    entries;                /**< Offset of entry index */
+    uint64_t    root;                   /**< Offset of root directory packed */
+} PackHeader;
+
+typedef struct {
+    uint64_t    path;                   /**< Offset of URI path ("/html/index.html") */
+    uint32_t    type;                   /**< PackType */
+    uint32_t    path_length;
+    uint64_t    headers;                /**< Offset of headers following Date */
+    uint64_t    headers_length;
+    uint64_t    body;                   /**< Offset of body (script path for PACK_CGI) */
+    uint64_t    body_length;
+    uint64_t    gzip_headers;           /**< Headers of gzip variant */
+    uint64_t    gzip_headers_length;
+    uint64_t    gzip;                   /**< Offset of gzip variant (length 0 = none) */
+    uint64_t    gzip_length;
+} PackEntry;
+
+int         archive_open(const char *path);
+bool        archive_enabled(void);
+Status      handle_archive_request(Request *request);
+
+/* Graceful Upgrade */
+
+void        upgrade_init(char *argv[], const char *manifest);
+int         upgrade_inherit(Listeners *listeners);
+bool        upgrade_listeners(size_t worker, Listeners *listeners);
+void        upgrade_ready(void);
+bool        upgrade_poll(Listeners *sets, size_t count);
+
+/* Character Class Scanning */
+
+typedef enum {
+    SCAN_TOKEN,                         /**< HTTP token characters (tchar) */
+    SCAN_WHITESPACE,                    /**< isspace(3) characters */
+    SCAN_DELIMITER,                     /**< Space and control characters */
+    SCAN_CONTROL,                       /**< Control characters other than tab */
+    SCAN_CLASSES
+} ScanClass;
+
+size_t      scan_span(const char *s, size_t length, ScanClass class);
+size_t      scan_until(const char *s, size_t length, ScanClass class);
+bool        scan_select(const char *name);
+const char *scan_kernel(void);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
+#define FNV1A_BASIS 0xcbf29ce484222325ULL   /**< FNV-1a hash of no bytes */
+#define SPIN_LIMIT  1000                    /**< Attempts spin_lock makes before giving up */
+
 char *	    determine_mimetype(const char *path);
 char *	    determine_request_path(const char *uri);
+const char *http_date(time_t *now);
 const char *http_status_string(Status status);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
+uint64_t    fnv1a(uint64_t hash, const void *data, size_t length);
+bool        spin_lock(uint32_t *lock);
+void        spin_unlock(uint32_t *lock);
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
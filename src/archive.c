@@ -0,0 +1,187 @@
+/* archive.c: Packed Asset Archive */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Internal handler entry points (see handler.c) */
+
+Status handle_cgi_request(Request *request);
+
+/* Global Variables */
+
+static const char      *Archive = NULL;         /**< Mapped archive */
+static size_t           ArchiveSize = 0;
+static const PackEntry *Entries = NULL;         /**< Entries sorted by path */
+static size_t           EntriesCount = 0;
+
+/**
+ * Determine whether a region lies within the archive.
+ **/
+static bool archive_contains(uint64_t offset, uint64_t length) {
+    return offset <= ArchiveSize && length <= ArchiveSize - offset;
+}
+
+/**
+ * Map an archive written by spidey-pack and serve requests from it.
+ *
+ * @param   path        Path of archive.
+ * @return  0 on success, -1 on error.
+ *
+ * Every offset is checked once here, so lookups can trust the index.  The
+ * packed root directory becomes RootPath (CGI scripts still run from it).
+ **/
+int archive_open(const char *path) {
+    struct stat s;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &s) < 0) {
+        fprintf(stderr, "Unable to open archive %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    Archive = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (Archive == MAP_FAILED) {
+        fprintf(stderr, "Unable to map archive %s: %s\n", path, strerror(errno));
+        Archive = NULL;
+        goto fail;
+    }
+    close(fd);
+    ArchiveSize = s.st_size;
+
+    const PackHeader *header = (const PackHeader *)Archive;
+    if (ArchiveSize < sizeof(PackHeader) || memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 ||
+        header->count > ArchiveSize / sizeof(PackEntry) ||
+        !archive_contains(header->entries, header->count * sizeof(PackEntry)) ||
+        !archive_contains(header->root, 1) || !memchr(Archive + header->root, '\0', ArchiveSize - header->root)) {
+        fprintf(stderr, "Invalid archive %s\n", path);
+        goto unmap;
+    }
+
+    Entries      = (const PackEntry *)(Archive + header->entries);
+    EntriesCount = header->count;
+
+    for (size_t i = 0; i < EntriesCount; i++) {
+        const PackEntry *e = &Entries[i];
+        if (!archive_contains(e->path, e->path_length + 1) || Archive[e->path + e->path_length] != '\0' ||
+            !archive_contains(e->headers, e->headers_length) ||
+            !archive_contains(e->body, e->body_length + (e->type == PACK_CGI)) ||
+            !archive_contains(e->gzip_headers, e->gzip_headers_length) ||
+            !archive_contains(e->gzip, e->gzip_length) ||
+            (e->type == PACK_CGI && Archive[e->body + e->body_length] != '\0') ||
+            (i > 0 && strcmp(Archive + Entries[i - 1].path, Archive + e->path) >= 0)) {
+            fprintf(stderr, "Invalid archive %s: corrupt entry %zu\n", path, i);
+            goto unmap;
+        }
+    }
+
+    RootPath = (char *)Archive + header->root;
+    log("Serving %zu entries from archive %s (%zu bytes)", EntriesCount, path, ArchiveSize);
+    return 0;
+
+unmap:
+    munmap((void *)Archive, ArchiveSize);
+    Archive = NULL;
+    return -1;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    return -1;
+}
+
+/**
+ * Determine whether requests are served from an archive.
+ **/
+bool archive_enabled(void) {
+    return Archive != NULL;
+}
+
+/**
+ * Find the entry for a URI path with a binary search of the index.
+ *
+ * Trailing slashes are ignored, so "/html/" finds "/html".
+ **/
+static const PackEntry *archive_lookup(const char *uri) {
+    size_t length = strlen(uri);
+    while (length > 1 && uri[length - 1] == '/') {
+        length--;
+    }
+
+    size_t low = 0, high = EntriesCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const PackEntry *e = &Entries[middle];
+        int compare = strncmp(Archive + e->path, uri, length);
+        if (compare == 0) {
+            compare = e->path_length > length;
+        }
+        if (compare == 0) {
+            return e;
+        }
+        if (compare < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Determine whether the client accepts a gzip content coding.
+ **/
+static bool archive_accepts_gzip(Request *r) {
+    const char *encoding = request_known_header(r, HEADER_ACCEPT_ENCODING);
+    return encoding && strstr(encoding, "gzip") && !strstr(encoding, "gzip;q=0");
+}
+
+/**
+ * Handle request from the archive.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP request.
+ *
+ * Files and directory listings are sent straight from the mapping with the
+ * headers packed alongside them (only the Date is rendered per request),
+ * using the gzip variant when there is one and the client accepts it.
+ * Scripts are handed to handle_cgi_request with their path on disk.
+ **/
+Status handle_archive_request(Request *r) {
+    const PackEntry *e = r->uri ? archive_lookup(r->uri) : NULL;
+    if (!e) {
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
+
+    if (e->type == PACK_CGI) {
+        r->path = strdup(Archive + e->body);
+        return r->path ? handle_cgi_request(r) : handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    bool gzip = e->gzip_length && archive_accepts_gzip(r);
+    char status[64];
+    int  status_length = snprintf(status, sizeof(status), "HTTP/1.0 %s\r\nDate: %s\r\n",
+                                  http_status_string(HTTP_STATUS_OK), http_date(NULL));
+
+    struct iovec iov[] = {
+        {status, status_length},
+        {(void *)(Archive + (gzip ? e->gzip_headers : e->headers)), gzip ? e->gzip_headers_length : e->headers_length},
+        {(void *)(Archive + (gzip ? e->gzip : e->body)), gzip ? e->gzip_length : e->body_length},
+    };
+
+    if (request_writev(r, iov, 3) < 0) {
+        debug("Unable to write archive entry: %s", strerror(errno));
+    }
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,416 @@
+/* bench.c: Spidey Hot Path Microbenchmarks */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/* Global Variables (normally defined by spidey.c) */
+
+char *Port	      = "9898";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath	      = "www";
+
+size_t Workers  = 1;
+size_t WorkerId = 0;
+
+/* Internal handler entry points (see handler.c) */
+
+Status handle_browse_request(Request *request);
+Status handle_file_request(Request *request);
+Status handle_cgi_request(Request *request);
+Status handle_error(Request *request, Status status);
+
+/* Constants */
+
+#define MIN_RUNTIME_NS  200000000ULL    /**< Grow iterations until a run takes 200ms */
+#define NSEC_PER_SEC    1000000000ULL
+
+/* Allocation Counting */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t Allocations = 0;
+static uint64_t AllocatedBytes = 0;
+
+/**
+ * Interpose on the allocator so that every allocation made by libspidey
+ * (including those made on its behalf inside libc, e.g. strdup or fopen) is
+ * counted before being forwarded to glibc.
+ **/
+void *malloc(size_t size) {
+    Allocations++;
+    AllocatedBytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    Allocations++;
+    AllocatedBytes += nmemb * size;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    Allocations++;
+    AllocatedBytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+/* Canned Requests */
+
+static const char SimpleRequest[] =
+    "GET / HTTP/1.0\r\n"
+    "\r\n";
+
+static const char QueryRequest[] =
+    "GET /scripts/cowsay.sh?message=hi&template=vader HTTP/1.1\r\n"
+    "Host: localhost:9898\r\n"
+    "\r\n";
+
+static const char BrowserRequest[] =
+    "GET /html/index.html HTTP/1.1\r\n"
+    "Host: localhost:8888\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:29.0) Gecko/20100101 Firefox/29.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+/* Benchmark Fixtures */
+
+typedef struct {
+    const char *name;
+    void      (*run)(void *arg);
+    void       *arg;
+    const char *kernel;                 /**< Scan kernel to select (NULL = default) */
+} Benchmark;
+
+typedef struct {
+    Request     request;
+    const char *text;
+} ParseFixture;
+
+static FILE *Sink = NULL;               /**< Response output (/dev/null) */
+
+/**
+ * Release everything parse_request or a handler attached to the request so
+ * the same struct can be reused for the next iteration.
+ **/
+static void reset_request(Request *r) {
+    free(r->method);
+    free(r->uri);
+    free(r->path);
+    free(r->query);
+    r->method = r->uri = r->path = r->query = NULL;
+    request_free_headers(r);
+}
+
+static void bench_parse_request(void *arg) {
+    ParseFixture *f = arg;
+    f->request.input_offset = 0;
+    if (parse_request(&f->request) < 0) {
+        fatal("parse_request failed on canned request");
+    }
+    reset_request(&f->request);
+}
+
+static void bench_request_header(void *arg) {
+    ParseFixture *f = arg;
+
+    /* Parse once, on the warm-up run */
+    if (!f->request.method && parse_request(&f->request) < 0) {
+        fatal("parse_request failed on canned request");
+    }
+
+    /* Headers a handler typically checks: present, absent, not well-known */
+    if (!request_header(&f->request, "Accept-Encoding") ||
+        request_header(&f->request, "If-None-Match") ||
+        request_header(&f->request, "X-Requested-With")) {
+        fatal("request_header returned the wrong headers");
+    }
+}
+
+static void bench_scan_lines(void *arg) {
+    const char *text   = arg;
+    size_t      length = strlen(text);
+
+    /* Walk the request line by line, the way parse_request_headers does */
+    for (size_t i = 0; i < length; i += 2) {
+        i += scan_until(text + i, length - i, SCAN_CONTROL);
+    }
+}
+
+static void bench_determine_mimetype(void *arg) {
+    free(determine_mimetype(arg));
+}
+
+static void bench_determine_request_path(void *arg) {
+    free(determine_request_path(arg));
+}
+
+static void bench_http_status_string(void *arg) {
+    static volatile const char *result;
+    for (Status status = HTTP_STATUS_OK; status <= HTTP_STATUS_INTERNAL_SERVER_ERROR; status++) {
+        result = http_status_string(status);
+    }
+    (void)result;
+}
+
+static Request *query_request(const char *uri, const char *query) {
+    Request *r = calloc(1, sizeof(Request));
+    if (!r) {
+        fatal("Unable to allocate request: %s", strerror(errno));
+    }
+    r->fd     = fileno(Sink);
+    r->stream = Sink;
+    r->method = strdup("GET");
+    r->uri    = strdup(uri);
+    r->query  = strdup(query);
+    return r;
+}
+
+static Request *handler_request(const char *uri) {
+    Request *r = query_request(uri, "");
+    r->path   = determine_request_path(uri);
+    if (!r->path) {
+        fatal("Unable to resolve %s under %s", uri, RootPath);
+    }
+    return r;
+}
+
+static Request *cgi_request(const char *uri, const char *query) {
+    Request *r = handler_request(uri);
+    free(r->query);
+    r->query = strdup(query);
+    return r;
+}
+
+static void bench_handle_file_request(void *arg) {
+    handle_file_request(arg);
+}
+
+static void bench_handle_large_file_request(void *arg) {
+    size_t size = LargeFileSize;
+    LargeFileSize = 1;
+    handle_file_request(arg);
+    LargeFileSize = size;
+}
+
+static void bench_handle_browse_request(void *arg) {
+    handle_browse_request(arg);
+}
+
+static void bench_handle_cgi_request(void *arg) {
+    handle_cgi_request(arg);
+}
+
+static void bench_handle_module_request(void *arg) {
+    handle_module_request(arg);
+}
+
+static void bench_limit_admit(void *arg) {
+    if (limit_admit(arg)) {
+        limit_release(arg);
+    }
+}
+
+static Request *client_request(const char *host) {
+    Request *r = query_request("/", "");
+    snprintf(r->host, sizeof(r->host), "%s", host);
+    return r;
+}
+
+/* Enables tracing for the rest of the run, so it comes last */
+static void bench_trace_span(void *arg) {
+    static bool traced = false;
+    if (!traced) {
+        traced = trace_init("/dev/null") == 0;
+    }
+    trace_end(1, TRACE_PARSE, trace_begin());
+}
+
+/* Enables the content cache for the rest of the run, so it comes last */
+static void bench_content_serve(void *arg) {
+    static bool shared = false;
+    if (!shared) {
+        shared = content_configure("1048576") && content_init() == 0;
+    }
+    if (!content_serve(arg)) {
+        handle_file_request(arg);
+    }
+}
+
+static void bench_handle_error(void *arg) {
+    handle_error(arg, HTTP_STATUS_NOT_FOUND);
+}
+
+static void bench_dispatch_request(void *arg) {
+    Request *r = arg;
+    dispatch_request(r);
+    free(r->path);
+    r->path = NULL;
+}
+
+/* Enables the negative lookup filter for the rest of the run, so it comes last */
+static void bench_filter_missing(void *arg) {
+    static bool filtered = false;
+    if (!filtered) {
+        filtered = filter_configure("4096") && filter_init() == 0;
+    }
+    bench_dispatch_request(arg);
+}
+
+/* Runner */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Run benchmark, doubling the iteration count until a run lasts at least
+ * MIN_RUNTIME_NS, then report per-operation time and allocations.
+ **/
+static void run_benchmark(const Benchmark *b) {
+    uint64_t iterations = 1;
+
+    /* Warm up caches and lazily initialized libc state */
+    b->run(b->arg);
+
+    while (true) {
+        uint64_t allocations = Allocations;
+        uint64_t bytes       = AllocatedBytes;
+        uint64_t start       = now_ns();
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            b->run(b->arg);
+        }
+
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= MIN_RUNTIME_NS || iterations >= (1ULL << 32)) {
+            printf("%-40s %12lu %12.1f ns/op %8.2f allocs/op %10.1f B/op\n",
+                b->name, (unsigned long)iterations,
+                (double)elapsed / iterations,
+                (double)(Allocations - allocations) / iterations,
+                (double)(AllocatedBytes - bytes) / iterations);
+            fflush(stdout);
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+static ParseFixture *parse_fixture(const char *text) {
+    ParseFixture *f = calloc(1, sizeof(ParseFixture));
+    if (!f) {
+        fatal("Unable to allocate fixture: %s", strerror(errno));
+    }
+    if (strlen(text) > sizeof(f->request.input)) {
+        fatal("Canned request does not fit in input buffer");
+    }
+
+    /* Preload the request's input buffer; with no socket, parsing stops at
+     * the end of the canned bytes */
+    f->text = text;
+    f->request.fd = -1;
+    f->request.input_length = strlen(text);
+    memcpy(f->request.input, text, f->request.input_length);
+    return f;
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = argc > 1 ? argv[1] : NULL;
+
+    if (argc > 2 || (filter && filter[0] == '-')) {
+        fprintf(stderr, "Usage: %s [FILTER]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    RootPath = realpath(RootPath, NULL);
+    if (!RootPath) {
+        fatal("Could not determine root path (run from the repository top): %s", strerror(errno));
+    }
+
+    Sink = fopen("/dev/null", "w");
+    if (!Sink) {
+        fatal("Unable to open /dev/null: %s", strerror(errno));
+    }
+
+    /* The sample module, to compare with the same page from a CGI script */
+    if (!module_load("lib/mod_hello.so")) {
+        fatal("Unable to load lib/mod_hello.so (run make first)");
+    }
+
+    /* Client limits high enough that every connection is admitted */
+    if (!limit_configure("1000000000,1000000000,1000000") || limit_init() < 0) {
+        fatal("Unable to set up client limits");
+    }
+
+    const char *kernel = scan_kernel();
+
+    Benchmark benchmarks[] = {
+        {"parse_request/simple",             bench_parse_request,           parse_fixture(SimpleRequest)},
+        {"parse_request/query",              bench_parse_request,           parse_fixture(QueryRequest)},
+        {"parse_request/browser",            bench_parse_request,           parse_fixture(BrowserRequest)},
+        {"parse_request/browser@scalar",     bench_parse_request,           parse_fixture(BrowserRequest), "scalar"},
+        {"parse_request/browser@sse4.2",     bench_parse_request,           parse_fixture(BrowserRequest), "sse4.2"},
+        {"parse_request/browser@avx2",       bench_parse_request,           parse_fixture(BrowserRequest), "avx2"},
+        {"request_header/browser",           bench_request_header,          parse_fixture(BrowserRequest)},
+        {"scan_lines/browser@scalar",        bench_scan_lines,              (void *)BrowserRequest,        "scalar"},
+        {"scan_lines/browser@sse4.2",        bench_scan_lines,              (void *)BrowserRequest,        "sse4.2"},
+        {"scan_lines/browser@avx2",          bench_scan_lines,              (void *)BrowserRequest,        "avx2"},
+        {"determine_mimetype/html",          bench_determine_mimetype,      "www/html/index.html"},
+        {"determine_mimetype/png",           bench_determine_mimetype,      "www/images/a.png"},
+        {"determine_mimetype/noext",         bench_determine_mimetype,      "www/text/pass/fail"},
+        {"determine_mimetype/unknown",       bench_determine_mimetype,      "www/song.unknownext"},
+        {"determine_request_path/root",      bench_determine_request_path,  "/"},
+        {"determine_request_path/file",      bench_determine_request_path,  "/html/index.html"},
+        {"determine_request_path/escape",    bench_determine_request_path,  "/../../etc/passwd"},
+        {"http_status_string/all",           bench_http_status_string,      NULL},
+        {"handle_file_request/index.html",   bench_handle_file_request,     handler_request("/html/index.html")},
+        {"handle_file_request/b.jpg",        bench_handle_file_request,     handler_request("/images/b.jpg")},
+        {"handle_file_request/a.png",        bench_handle_file_request,     handler_request("/images/a.png")},
+        {"handle_file_request/a.png@large",  bench_handle_large_file_request, handler_request("/images/a.png")},
+        {"handle_browse_request/images",     bench_handle_browse_request,   handler_request("/images")},
+        {"handle_error/404",                 bench_handle_error,            handler_request("/")},
+        {"dispatch_request/missing",         bench_dispatch_request,        query_request("/wp-admin/setup-config.php", "")},
+        {"handle_cgi_request/env.sh",        bench_handle_cgi_request,      handler_request("/scripts/env.sh")},
+        {"handle_cgi_request/hello.py",      bench_handle_cgi_request,      cgi_request("/scripts/hello.py", "user=spidey")},
+        {"handle_module_request/hello",      bench_handle_module_request,   query_request("/hello", "user=spidey")},
+        {"limit_admit/client",               bench_limit_admit,             client_request("192.0.2.1")},
+        {"content_serve/index.html",         bench_content_serve,           handler_request("/html/index.html")},
+        {"content_serve/c.jpg",              bench_content_serve,           handler_request("/images/c.jpg")},
+        {"filter_missing/missing",           bench_filter_missing,          query_request("/wp-admin/setup-config.php", "")},
+        {"trace/span",                       bench_trace_span,              NULL},
+    };
+
+    /* Keep debug and log output from the library out of the measurements */
+    if (!freopen("/dev/null", "w", stderr)) {
+        fatal("Unable to redirect stderr: %s", strerror(errno));
+    }
+
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(Benchmark); i++) {
+        if (filter && !strstr(benchmarks[i].name, filter)) {
+            continue;
+        }
+        /* Skip kernels this CPU cannot run */
+        if (!scan_select(benchmarks[i].kernel ? benchmarks[i].kernel : kernel)) {
+            continue;
+        }
+        run_benchmark(&benchmarks[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
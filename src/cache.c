@@ -0,0 +1,248 @@
+/* cache.c: Response Header Cache */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CACHE_SLOTS     256             /**< Direct-mapped resource slots */
+#define DATE_LENGTH     29              /**< strlen("Sun, 06 Nov 1994 08:49:37 GMT") */
+#define HOT_PATH_MAX    256             /**< Longest path kept in the hot list */
+
+/* Global Variables */
+
+static Resource ResourceCache[CACHE_SLOTS];
+
+/* Paths cached by any server process, slot for slot with ResourceCache, so
+ * the hot set survives forked children and can be handed to a new binary */
+static char (*HotPaths)[HOT_PATH_MAX] = NULL;
+
+/**
+ * Compute FNV-1a hash of string.
+ *
+ * @param   s           String to hash.
+ * @return  64-bit hash of s.
+ **/
+static uint64_t hash_string(const char *s) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Render the status line and static headers for a resource.
+ *
+ * @param   resource    Resource whose headers should be rendered.
+ * @param   s           Current stat information for the resource.
+ * @return  true if successful, false otherwise.
+ *
+ * The Date header is rendered as a placeholder at a known offset so that
+ * resource_headers can patch in the current time without re-rendering.
+ **/
+static bool resource_render(Resource *resource, const struct stat *s) {
+    char *headers = NULL;
+    int   length  = asprintf(&headers,
+        "HTTP/1.0 %s\r\n"
+        "Date: %-*s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %lld\r\n"
+        "ETag: \"%lx-%llx-%lx\"\r\n"
+        "\r\n",
+        http_status_string(HTTP_STATUS_OK),
+        DATE_LENGTH, "",
+        resource->mimetype,
+        (long long)s->st_size,
+        (unsigned long)s->st_ino, (long long)s->st_size, (unsigned long)s->st_mtim.tv_sec);
+    if (length < 0) {
+        return false;
+    }
+
+    free(resource->headers);
+    resource->headers        = headers;
+    resource->headers_length = length;
+    resource->date_offset    = strstr(headers, "Date: ") - headers + 6;
+    resource->date_stamp     = 0;
+    resource->dev            = s->st_dev;
+    resource->ino            = s->st_ino;
+    resource->size           = s->st_size;
+    resource->mtime          = s->st_mtim;
+    return true;
+}
+
+/**
+ * Lookup cached resource for path, rendering its headers if needed.
+ *
+ * @param   path        Real path of the resource.
+ * @param   s           Current stat information for the resource.
+ * @return  Cached resource (owned by the cache) or NULL on error.
+ *
+ * Entries are validated against the device, inode, size and modification
+ * time in s, so a file changed on disk is re-rendered on its next request.
+ * The mimetype is only determined the first time a path is seen.
+ **/
+Resource *resource_lookup(const char *path, const struct stat *s) {
+    Resource *resource = &ResourceCache[hash_string(path) % CACHE_SLOTS];
+
+    if (resource->path && streq(resource->path, path)) {
+        if (resource->dev   == s->st_dev &&
+            resource->ino   == s->st_ino &&
+            resource->size  == s->st_size &&
+            resource->mtime.tv_sec  == s->st_mtim.tv_sec &&
+            resource->mtime.tv_nsec == s->st_mtim.tv_nsec) {
+            return resource;
+        }
+        return resource_render(resource, s) ? resource : NULL;
+    }
+
+    /* Evict whatever occupied the slot */
+    free(resource->path);
+    free(resource->mimetype);
+    free(resource->headers);
+    memset(resource, 0, sizeof(Resource));
+
+    resource->path     = strdup(path);
+    resource->mimetype = determine_mimetype(path);
+    if (!resource->path || !resource->mimetype || !resource_render(resource, s)) {
+        debug("Unable to cache resource %s: %s", path, strerror(errno));
+        free(resource->path);
+        free(resource->mimetype);
+        memset(resource, 0, sizeof(Resource));
+        return NULL;
+    }
+
+    size_t length = strlen(path);
+    if (HotPaths && length < HOT_PATH_MAX) {
+        memcpy(HotPaths[resource - ResourceCache], path, length + 1);
+    }
+    return resource;
+}
+
+/**
+ * Return the rendered header block for a resource.
+ *
+ * @param   resource    Cached resource.
+ * @param   length      Set to the length of the header block.
+ * @return  Pointer to header block (owned by the cache).
+ **/
+const char *resource_headers(Resource *resource, size_t *length) {
+    time_t now = 0;
+    const char *date = http_date(&now);
+
+    if (resource->date_stamp != now) {
+        memcpy(resource->headers + resource->date_offset, date, DATE_LENGTH);
+        resource->date_stamp = now;
+    }
+
+    *length = resource->headers_length;
+    return resource->headers;
+}
+
+/**
+ * Allocate the hot list shared between server processes.
+ *
+ * @return  0 on success, -1 on error.
+ *
+ * Must be called before the server forks.
+ **/
+int resource_init(void) {
+    HotPaths = mmap(NULL, CACHE_SLOTS * HOT_PATH_MAX, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (HotPaths == MAP_FAILED) {
+        fprintf(stderr, "Unable to map hot list: %s\n", strerror(errno));
+        HotPaths = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write the paths of cached resources to a manifest, one per line.
+ *
+ * @param   manifest    Path of manifest file (replaced atomically).
+ * @return  Number of paths written or -1 on error.
+ **/
+int resource_save(const char *manifest) {
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d", manifest, getpid());
+
+    FILE *stream = fopen(temporary, "w");
+    if (!stream) {
+        log("Unable to write manifest %s: %s", manifest, strerror(errno));
+        return -1;
+    }
+
+    int count = 0;
+    for (size_t i = 0; i < CACHE_SLOTS; i++) {
+        const char *path = HotPaths ? HotPaths[i] : ResourceCache[i].path;
+        if (path && path[0]) {
+            fprintf(stream, "%s\n", path);
+            count++;
+        }
+    }
+
+    if (fclose(stream) != 0 || rename(temporary, manifest) < 0) {
+        log("Unable to write manifest %s: %s", manifest, strerror(errno));
+        unlink(temporary);
+        return -1;
+    }
+    return count;
+}
+
+/**
+ * Pre-warm the page cache and the resource cache from a manifest.
+ *
+ * @param   manifest    Path of manifest written by resource_save.
+ * @return  Number of resources loaded (0 if there is no manifest yet).
+ *
+ * Each file under RootPath is read ahead into the page cache and has its
+ * headers rendered, so the first requests after a restart are served warm.
+ * Called before the server forks, so every worker inherits the result.
+ **/
+int resource_prewarm(const char *manifest) {
+    FILE *stream = fopen(manifest, "r");
+    if (!stream) {
+        return 0;
+    }
+
+    char   path[PATH_MAX];
+    size_t root_length = RootPath ? strlen(RootPath) : 0;
+    int    count = 0;
+
+    while (fgets(path, sizeof(path), stream)) {
+        struct stat s;
+        path[strcspn(path, "\n")] = '\0';
+
+        /* Only ever touch files the server would serve itself */
+        if (!RootPath || strncmp(path, RootPath, root_length) != 0 || path[root_length] != '/') {
+            continue;
+        }
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &s) == 0 && S_ISREG(s.st_mode) && resource_lookup(path, &s)) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            count++;
+        }
+        close(fd);
+    }
+
+    fclose(stream);
+    return count;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
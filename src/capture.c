@@ -0,0 +1,161 @@
+/* capture.c: Traffic Capture */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/uio.h>
+
+/* Constants */
+
+#define CAPTURE_LIMIT   (64 * 1024)     /**< Bytes kept per connection */
+#define CAPTURE_CHUNK   1024            /**< Initial size of a connection's buffer */
+
+/* Structures */
+
+/**
+ * Bytes received on a connection so far.
+ **/
+struct capture {
+    uint64_t    arrival;                /**< CLOCK_MONOTONIC nanosecond of first bytes */
+    size_t      length;
+    size_t      capacity;
+    char        bytes[];
+};
+
+/* Global Variables */
+
+static int      CaptureFd = -1;         /**< Capture file given with -W (-1 = not capturing) */
+static uint64_t CaptureEpoch = 0;       /**< Time records are relative to */
+
+static uint64_t capture_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Open capture file, writing its header if it is new.
+ *
+ * @param   path        Capture file (appended to if it already is one).
+ * @return  0 on success, -1 on error.
+ *
+ * Must be called before the server forks: every process appends whole
+ * records to the same file (O_APPEND), each with a single write.  A server
+ * started by an upgrade continues the file, keeping its epoch.
+ **/
+int capture_init(const char *path) {
+    CaptureFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (CaptureFd < 0) {
+        fprintf(stderr, "Unable to open capture %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    CaptureHeader header;
+    ssize_t       nread = pread(CaptureFd, &header, sizeof(header), 0);
+    if (nread == 0) {
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.epoch = capture_now();
+        if (write(CaptureFd, &header, sizeof(header)) != sizeof(header)) {
+            fprintf(stderr, "Unable to write capture %s: %s\n", path, strerror(errno));
+            goto fail;
+        }
+    } else if (nread != sizeof(header) || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) || header.epoch > capture_now()) {
+        fprintf(stderr, "Unable to continue capture %s: not a capture, or made before a reboot\n", path);
+        goto fail;
+    }
+
+    CaptureEpoch = header.epoch;
+    log("Capturing requests to %s", path);
+    return 0;
+
+fail:
+    close(CaptureFd);
+    CaptureFd = -1;
+    return -1;
+}
+
+/**
+ * Record bytes received on a request's connection (the first CAPTURE_LIMIT
+ * of them).
+ **/
+void capture_append(Request *r, const void *data, size_t length) {
+    if (CaptureFd < 0 || length == 0) {
+        return;
+    }
+
+    struct capture *capture = r->capture;
+    if (!capture) {
+        capture = malloc(sizeof(struct capture) + CAPTURE_CHUNK);
+        if (!capture) {
+            return;
+        }
+        capture->arrival  = capture_now();
+        capture->length   = 0;
+        capture->capacity = CAPTURE_CHUNK;
+        r->capture = capture;
+    }
+
+    if (length > CAPTURE_LIMIT - capture->length) {
+        length = CAPTURE_LIMIT - capture->length;
+    }
+    if (capture->length + length > capture->capacity) {
+        size_t capacity = capture->capacity;
+        while (capacity < capture->length + length) {
+            capacity *= 2;
+        }
+        capture = realloc(capture, sizeof(struct capture) + capacity);
+        if (!capture) {
+            return;
+        }
+        capture->capacity = capacity;
+        r->capture = capture;
+    }
+
+    memcpy(capture->bytes + capture->length, data, length);
+    capture->length += length;
+}
+
+/**
+ * Encode value as an unsigned LEB128 varint.
+ *
+ * @return  Number of bytes written to buffer (at most 10).
+ **/
+static size_t capture_varint(uint8_t *buffer, uint64_t value) {
+    size_t n = 0;
+    do {
+        buffer[n++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+    return n;
+}
+
+/**
+ * Append the record of a finished connection to the capture file.
+ **/
+void capture_end(Request *r) {
+    struct capture *capture = r->capture;
+    if (!capture) {
+        return;
+    }
+    r->capture = NULL;
+
+    uint8_t head[20];
+    size_t  head_length = capture_varint(head, capture->arrival - CaptureEpoch);
+    head_length += capture_varint(head + head_length, capture->length);
+
+    struct iovec iov[] = {
+        {head, head_length},
+        {capture->bytes, capture->length},
+    };
+    if (writev(CaptureFd, iov, 2) != (ssize_t)(head_length + capture->length)) {
+        debug("Unable to write capture: %s", strerror(errno));
+    }
+    free(capture);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
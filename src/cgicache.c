@@ -0,0 +1,479 @@
+/* cgicache.c: CGI Response Micro-Cache */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CACHE_MAGIC         0x53434743  /**< "CGCS" */
+#define CACHE_DEFAULT_SIZE  (64 << 20)  /**< Default bound on total entry bytes */
+#define CACHE_LOW_WATERMARK 0.9         /**< Evict down to this fraction of the bound */
+#define CACHE_LOCK_POLL     5           /**< Milliseconds between fill lock attempts in coroutines */
+#define CACHE_LOCK_STRIPES  256         /**< Fill locks, one byte each of the lock file */
+#define CACHE_LOCK_EVICT    CACHE_LOCK_STRIPES  /**< Byte of the lock file held while evicting */
+#define CACHE_LOCKS         "locks"     /**< Lock file in the cache directory */
+
+/* Structures */
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    key_length;
+    uint64_t    body_length;
+    int64_t     expires;                /**< Unix time the entry goes stale */
+} CacheHeader;
+
+typedef struct {
+    char        name[PATH_MAX];
+    time_t      mtime;
+    off_t       size;
+    bool        expired;
+} CacheVictim;
+
+/* Global Variables */
+
+static long    CacheTTL = -1;           /**< Default TTL (-1 = cache disabled) */
+static size_t  CacheMaxBytes = CACHE_DEFAULT_SIZE;
+static char    CacheDirectory[PATH_MAX / 2];
+static long   *CacheBytes = NULL;       /**< Total entry bytes, shared across processes */
+
+/**
+ * Configure the cache.
+ *
+ * @param   spec        TTL[,MAXBYTES]: seconds to keep responses that do not
+ *                      carry Cache-Control max-age (0 = only those that do),
+ *                      and the bound on total cached bytes.
+ * @return  true if spec was valid.
+ **/
+bool cgi_cache_configure(const char *spec) {
+    char *end;
+
+    CacheTTL = strtol(spec, &end, 10);
+    if (end == spec || CacheTTL < 0) {
+        return false;
+    }
+    if (*end == ',') {
+        CacheMaxBytes = strtoull(end + 1, &end, 10);
+    }
+    return *end == '\0' && CacheMaxBytes > 0;
+}
+
+/**
+ * Create the cache directory, its lock file, and shared size counter.
+ *
+ * @return  0 on success (or if caching is disabled), -1 on error.
+ *
+ * Must be called before the server forks so every process shares them.
+ **/
+int cgi_cache_init(void) {
+    if (CacheTTL < 0) {
+        return 0;
+    }
+
+    const char *tmpdir = getenv("TMPDIR");
+    snprintf(CacheDirectory, sizeof(CacheDirectory), "%s/spidey-cgi.XXXXXX", tmpdir ? tmpdir : "/tmp");
+    if (!mkdtemp(CacheDirectory)) {
+        fprintf(stderr, "Unable to create CGI cache directory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", CacheDirectory, CACHE_LOCKS);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to create CGI cache lock file: %s\n", strerror(errno));
+        return -1;
+    }
+    close(fd);
+
+    CacheBytes = mmap(NULL, sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (CacheBytes == MAP_FAILED) {
+        fprintf(stderr, "Unable to map CGI cache counter: %s\n", strerror(errno));
+        CacheBytes = NULL;
+        return -1;
+    }
+
+    log("Caching CGI responses in %s (TTL %lds, %zu bytes)", CacheDirectory, CacheTTL, CacheMaxBytes);
+    return 0;
+}
+
+/**
+ * Remove the cache directory and everything in it.
+ *
+ * Called by the process that created it once the server stops.
+ **/
+void cgi_cache_cleanup(void) {
+    if (!CacheBytes) {
+        return;
+    }
+
+    DIR *dir = opendir(CacheDirectory);
+    if (dir) {
+        for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+            if (!streq(entry->d_name, ".") && !streq(entry->d_name, "..")) {
+                unlinkat(dirfd(dir), entry->d_name, 0);
+            }
+        }
+        closedir(dir);
+    }
+    if (rmdir(CacheDirectory) < 0) {
+        debug("Unable to remove CGI cache directory %s: %s", CacheDirectory, strerror(errno));
+    }
+}
+
+/**
+ * Determine whether request's response may come from (or go to) the cache.
+ **/
+bool cgi_cache_enabled(Request *r) {
+    return CacheBytes && (streq(r->method, "GET") || streq(r->method, "HEAD"));
+}
+
+/**
+ * Compute cache key and entry path for request.
+ *
+ * The key is the method, script path and query string (scripts may leave
+ * the body out of a HEAD response); entries live in files named after its
+ * FNV-1a hash, which also picks the key's fill lock.
+ **/
+static char *cgi_cache_key(Request *r, char *path, size_t size, const char *suffix, uint64_t *hashp) {
+    char *key = NULL;
+    if (asprintf(&key, "%s %s?%s", r->method, r->path, r->query ? r->query : "") < 0) {
+        return NULL;
+    }
+
+    uint64_t hash = fnv1a(FNV1A_BASIS, key, strlen(key));
+
+    snprintf(path, size, "%s/%016llx%s", CacheDirectory, (unsigned long long)hash, suffix);
+    if (hashp) {
+        *hashp = hash;
+    }
+    return key;
+}
+
+/**
+ * Serve request from the cache.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  true if a fresh entry was sent, false on a miss.
+ **/
+bool cgi_cache_serve(Request *r) {
+    char path[PATH_MAX];
+    char *key = cgi_cache_key(r, path, sizeof(path), "", NULL);
+    if (!key) {
+        return false;
+    }
+
+    CacheHeader header;
+    size_t key_length = strlen(key);
+    char  *stored = malloc(key_length);
+    bool   served = false;
+    int    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || !stored) {
+        goto done;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != CACHE_MAGIC ||
+        header.key_length != key_length ||
+        header.expires <= time(NULL) ||
+        pread(fd, stored, key_length, sizeof(header)) != (ssize_t)key_length ||
+        memcmp(stored, key, key_length) != 0) {
+        goto done;
+    }
+
+    /* Committed to the cached copy from here on */
+    served = true;
+    debug("CGI cache hit: %s", key);
+    request_sendfile(r, fd, sizeof(header) + key_length, header.body_length);
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(stored);
+    free(key);
+    return served;
+}
+
+/**
+ * Lock one byte of the cache's lock file.
+ *
+ * @param   stripe      Byte to lock.
+ * @param   wait        Whether to wait for the lock.
+ * @return  Lock file descriptor, or -1 if locking failed.
+ *
+ * Every lock opens the file afresh: open file description locks are owned
+ * by the description, so they exclude other processes and other coroutines
+ * of this process alike, and closing the descriptor releases the lock.
+ **/
+static int cgi_cache_lock_stripe(off_t stripe, bool wait) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", CacheDirectory, CACHE_LOCKS);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* A coroutine must not block here: the holder may be another coroutine
+     * in this process, so poll for the lock instead */
+    struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = stripe, .l_len = 1};
+    int command = wait && !coroutine_active() ? F_OFD_SETLKW : F_OFD_SETLK;
+    while (fcntl(fd, command, &lock) < 0) {
+        if (wait && (errno == EAGAIN || errno == EACCES)) {
+            coroutine_wait(-1, 0, CACHE_LOCK_POLL);
+        } else if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/**
+ * Take the fill lock of the request's key.
+ *
+ * @return  Lock file descriptor, or -1 if locking failed (the script is then
+ *          run without coalescing).
+ *
+ * Keys share CACHE_LOCK_STRIPES locks by hash, so no lock file is left
+ * behind per key.  Concurrent misses for the same key block here while the
+ * first one runs the script; they should check cgi_cache_serve again once
+ * they hold the lock.
+ **/
+int cgi_cache_lock(Request *r) {
+    char     path[PATH_MAX];
+    uint64_t hash;
+    char *key = cgi_cache_key(r, path, sizeof(path), "", &hash);
+    if (!key) {
+        return -1;
+    }
+    free(key);
+
+    return cgi_cache_lock_stripe(hash % CACHE_LOCK_STRIPES, true);
+}
+
+void cgi_cache_unlock(int lock) {
+    if (lock >= 0) {
+        close(lock);
+    }
+}
+
+/**
+ * Determine how long a CGI response may be cached.
+ *
+ * @return  TTL in seconds, or 0 if the response must not be cached.
+ *
+ * Only successful responses are cached.  Cache-Control no-store, no-cache or
+ * private disable caching, s-maxage or max-age override the configured TTL.
+ **/
+static long cgi_cache_ttl(const char *data, size_t length) {
+    char  *head_end = memmem(data, length, "\n\n", 2);
+    char  *crlf_end = memmem(data, length, "\r\n\r\n", 4);
+    size_t head_length = head_end ? (size_t)(head_end - data) : length;
+    if (crlf_end && (size_t)(crlf_end - data) < head_length) {
+        head_length = crlf_end - data;
+    }
+
+    char *head = strndup(data, head_length);
+    if (!head) {
+        return 0;
+    }
+
+    long ttl = CacheTTL;
+    long max_age = -1;
+    long s_maxage = -1;
+    char *saveptr = NULL;
+
+    for (char *line = strtok_r(head, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        if ((strncmp(line, "HTTP/", 5) == 0 && !strstr(line, " 200")) ||
+            (strncasecmp(line, "Status:", 7) == 0 && atoi(line + 7) != 200)) {
+            ttl = 0;
+            break;
+        }
+
+        if (strncasecmp(line, "Cache-Control:", 14) == 0) {
+            if (strcasestr(line, "no-store") || strcasestr(line, "no-cache") || strcasestr(line, "private")) {
+                ttl = 0;
+                break;
+            }
+
+            char *directive;
+            if ((directive = strcasestr(line, "s-maxage="))) {
+                s_maxage = atol(directive + 9);
+            }
+            for (directive = line; (directive = strcasestr(directive, "max-age=")); directive += 8) {
+                if (directive[-1] != '-') {
+                    max_age = atol(directive + 8);
+                }
+            }
+        }
+    }
+    free(head);
+
+    if (ttl == 0) {
+        return 0;
+    }
+    return s_maxage >= 0 ? s_maxage : max_age >= 0 ? max_age : ttl;
+}
+
+static int cgi_cache_victim_compare(const void *a, const void *b) {
+    const CacheVictim *va = a;
+    const CacheVictim *vb = b;
+
+    if (va->expired != vb->expired) {
+        return va->expired ? -1 : 1;
+    }
+    return (va->mtime > vb->mtime) - (va->mtime < vb->mtime);
+}
+
+/**
+ * Evict expired and then least recently written entries until the cache is
+ * back under its low watermark.
+ *
+ * Only one process evicts at a time; others carry on.
+ **/
+static void cgi_cache_evict(void) {
+    int lock = cgi_cache_lock_stripe(CACHE_LOCK_EVICT, false);
+    if (lock < 0) {
+        return;
+    }
+
+    DIR *dir = opendir(CacheDirectory);
+    if (!dir) {
+        goto done;
+    }
+
+    CacheVictim *victims = NULL;
+    size_t count = 0, capacity = 0;
+    time_t now = time(NULL);
+
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+        struct stat s;
+        CacheHeader header;
+
+        /* Entries are named by 16 hex digits and nothing else */
+        if (strlen(entry->d_name) != 16 || strchr(entry->d_name, '.')) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            CacheVictim *grown = realloc(victims, capacity * sizeof(CacheVictim));
+            if (!grown) {
+                break;
+            }
+            victims = grown;
+        }
+
+        CacheVictim *victim = &victims[count];
+        snprintf(victim->name, sizeof(victim->name), "%s/%s", CacheDirectory, entry->d_name);
+        int fd = open(victim->name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &s) == 0) {
+            victim->mtime   = s.st_mtime;
+            victim->size    = s.st_size;
+            victim->expired = pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.expires <= now;
+            count++;
+        }
+        close(fd);
+    }
+    closedir(dir);
+
+    qsort(victims, count, sizeof(CacheVictim), cgi_cache_victim_compare);
+
+    long target = CacheMaxBytes * CACHE_LOW_WATERMARK;
+    for (size_t i = 0; i < count; i++) {
+        if (!victims[i].expired && __atomic_load_n(CacheBytes, __ATOMIC_RELAXED) <= target) {
+            break;
+        }
+        if (unlink(victims[i].name) == 0) {
+            __atomic_sub_fetch(CacheBytes, victims[i].size, __ATOMIC_RELAXED);
+        }
+    }
+    debug("CGI cache evicted down to %ld bytes", __atomic_load_n(CacheBytes, __ATOMIC_RELAXED));
+    free(victims);
+
+done:
+    close(lock);
+}
+
+/**
+ * Store a CGI response in the cache (caller holds the key's fill lock).
+ *
+ * @param   r           HTTP Request structure.
+ * @param   data        Complete output of the script.
+ * @param   length      Length of output.
+ *
+ * Entries are written to a temporary file and renamed into place, so
+ * readers only ever see complete entries.
+ **/
+void cgi_cache_store(Request *r, const char *data, size_t length) {
+    long ttl = cgi_cache_ttl(data, length);
+    if (ttl <= 0 || length > CacheMaxBytes / 4) {
+        return;
+    }
+
+    char path[PATH_MAX];
+    char temporary[PATH_MAX + 32];
+    char *key = cgi_cache_key(r, path, sizeof(path), "", NULL);
+    if (!key) {
+        return;
+    }
+    snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, getpid());
+
+    CacheHeader header = {
+        .magic       = CACHE_MAGIC,
+        .key_length  = strlen(key),
+        .body_length = length,
+        .expires     = time(NULL) + ttl,
+    };
+    struct iovec iov[] = {
+        {&header, sizeof(header)},
+        {key, header.key_length},
+        {(void *)data, length},
+    };
+    size_t total = sizeof(header) + header.key_length + length;
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || writev(fd, iov, 3) != (ssize_t)total) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(temporary);
+        }
+        free(key);
+        return;
+    }
+    close(fd);
+
+    struct stat s;
+    off_t replaced = stat(path, &s) == 0 ? s.st_size : 0;
+    if (rename(temporary, path) < 0) {
+        unlink(temporary);
+        free(key);
+        return;
+    }
+
+    debug("CGI cache store: %s (%zu bytes, %lds)", key, length, ttl);
+    free(key);
+
+    if (__atomic_add_fetch(CacheBytes, (long)total - replaced, __ATOMIC_RELAXED) > (long)CacheMaxBytes) {
+        cgi_cache_evict();
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,359 @@
+/* content.c: Shared Content Cache */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* Constants */
+
+#define CONTENT_SLOTS   4096            /**< Direct-mapped index entries */
+#define CONTENT_SLAB    (256 * 1024)    /**< Storage is handed to size classes a slab at a time */
+#define CONTENT_GRAIN   512             /**< Smallest chunk (chunks are numbered in grains) */
+#define CONTENT_CLASSES 9               /**< Chunk sizes from 512 B to 128 KiB */
+#define DATE_LENGTH     29              /**< strlen("Sun, 06 Nov 1994 08:49:37 GMT") */
+
+/* Structures */
+
+/**
+ * Index entry, guarded by a seqlock: writers make sequence odd while they
+ * change the entry, and readers retry if it changed while they copied.
+ **/
+typedef struct {
+    uint32_t    sequence;               /**< Seqlock (odd while being written) */
+    uint32_t    chunk;                  /**< Grain + 1 of chunk holding the data (0 = empty) */
+    uint64_t    key;                    /**< Hash of URI */
+    dev_t       dev;                    /**< Identity of file when stored */
+    ino_t       ino;
+    off_t       size;
+    struct timespec mtime;
+    struct timespec ctime;              /**< Also catches chmod (e.g. a file made a CGI script) */
+    uint32_t    uri_length;
+    uint32_t    path_length;
+    uint32_t    headers_length;
+    uint32_t    date_offset;            /**< Offset of Date value in headers */
+    uint32_t    body_length;
+} ContentEntry;
+
+/**
+ * Chunk of storage, followed by the URI and path (each NUL-terminated),
+ * the headers and the body.
+ **/
+typedef struct {
+    uint32_t    owner;                  /**< Index of entry + 1 (0 = none) */
+    uint32_t    next;                   /**< Next free chunk of class (grain + 1) */
+} ContentChunk;
+
+typedef struct {
+    uint32_t    lock;                   /**< Allocator lock (odd while held) */
+    uint32_t    slabs;                  /**< Slabs handed to a class so far */
+    uint32_t    free[CONTENT_CLASSES];  /**< Free chunks of each class */
+    uint64_t    hand[CONTENT_CLASSES];  /**< Offset of next chunk of each class to evict */
+    uint8_t     classes[];              /**< Size class of each slab */
+} ContentHeader;
+
+/* Global Variables */
+
+static size_t         ContentBytes = 0; /**< Storage configured with -X (0 = no cache) */
+static size_t         Slabs = 0;
+static ContentHeader *Content = NULL;   /**< Shared by all server processes */
+static ContentEntry  *Entries = NULL;
+static char          *Storage = NULL;
+
+/**
+ * Configure the size of the content cache.
+ *
+ * @param   spec        Bytes of storage for headers and bodies.
+ * @return  true if spec is valid.
+ **/
+bool content_configure(const char *spec) {
+    char *end;
+    ContentBytes = strtoull(spec, &end, 10);
+    return end != spec && *end == '\0' && ContentBytes >= CONTENT_SLAB;
+}
+
+/**
+ * Map the index and storage.
+ *
+ * @return  0 on success (or if the cache is disabled), -1 on error.
+ *
+ * Must be called before the server forks, so every process shares them.
+ **/
+int content_init(void) {
+    if (!ContentBytes) {
+        return 0;
+    }
+
+    Slabs = ContentBytes / CONTENT_SLAB;
+    size_t header  = (sizeof(ContentHeader) + Slabs + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    size_t entries = (CONTENT_SLOTS * sizeof(ContentEntry) + 4095) / 4096 * 4096;
+    char  *shared  = mmap(NULL, header + entries + Slabs * CONTENT_SLAB, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Unable to map content cache: %s\n", strerror(errno));
+        return -1;
+    }
+
+    Content = (ContentHeader *)shared;
+    Entries = (ContentEntry *)(shared + header);
+    Storage = shared + header + entries;
+    log("Sharing a content cache of %zu bytes", Slabs * CONTENT_SLAB);
+    return 0;
+}
+
+/**
+ * Determine whether small files are served from the content cache.
+ **/
+bool content_enabled(void) {
+    return Content != NULL;
+}
+
+static ContentChunk *content_chunk(uint32_t grain) {
+    return (ContentChunk *)(Storage + (size_t)(grain - 1) * CONTENT_GRAIN);
+}
+
+/**
+ * Return chunk to the free list of its class (allocator lock held).
+ **/
+static void content_free(uint32_t grain) {
+    ContentChunk *chunk = content_chunk(grain);
+    size_t        class = Content->classes[(size_t)(grain - 1) * CONTENT_GRAIN / CONTENT_SLAB];
+
+    __atomic_store_n(&chunk->owner, 0, __ATOMIC_RELAXED);
+    chunk->next = Content->free[class];
+    Content->free[class] = grain;
+}
+
+/**
+ * Evict the next chunk of class in storage order (allocator lock held).
+ *
+ * @return  Grain + 1 of chunk, or 0 if none could be evicted.
+ *
+ * A chunk whose entry is being written is passed over.
+ **/
+static uint32_t content_evict(size_t class) {
+    size_t size   = CONTENT_GRAIN << class;
+    size_t offset = Content->hand[class];
+
+    for (size_t steps = 0; steps < Slabs * (CONTENT_SLAB / CONTENT_GRAIN); steps++) {
+        if (offset >= Slabs * CONTENT_SLAB) {
+            offset = 0;
+        }
+        if (offset / CONTENT_SLAB >= Content->slabs || Content->classes[offset / CONTENT_SLAB] != class) {
+            offset = (offset / CONTENT_SLAB + 1) * CONTENT_SLAB;
+            continue;
+        }
+
+        uint32_t      grain = offset / CONTENT_GRAIN + 1;
+        ContentChunk *chunk = content_chunk(grain);
+        uint32_t      owner = __atomic_load_n(&chunk->owner, __ATOMIC_RELAXED);
+        offset += size;
+
+        if (owner && spin_lock(&Entries[owner - 1].sequence)) {
+            ContentEntry *entry   = &Entries[owner - 1];
+            bool          evicted = entry->chunk == grain;
+            if (evicted) {
+                entry->chunk = 0;
+                entry->key   = 0;
+                __atomic_store_n(&chunk->owner, 0, __ATOMIC_RELAXED);
+            }
+            spin_unlock(&entry->sequence);
+            if (evicted) {
+                Content->hand[class] = offset;
+                return grain;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Allocate a chunk of class: a free one, one from a new slab, or else an
+ * evicted one.
+ *
+ * @return  Grain + 1 of chunk, or 0 if none is available.
+ **/
+static uint32_t content_alloc(size_t class) {
+    uint32_t grain = 0;
+
+    if (!spin_lock(&Content->lock)) {
+        return 0;
+    }
+
+    if (Content->free[class]) {
+        grain = Content->free[class];
+        Content->free[class] = content_chunk(grain)->next;
+    } else if (Content->slabs < Slabs) {
+        size_t slab = Content->slabs++;
+        Content->classes[slab] = class;
+        grain = slab * (CONTENT_SLAB / CONTENT_GRAIN) + 1;
+        for (size_t offset = CONTENT_GRAIN << class; offset < CONTENT_SLAB; offset += CONTENT_GRAIN << class) {
+            content_free(grain + offset / CONTENT_GRAIN);
+        }
+    } else {
+        grain = content_evict(class);
+    }
+
+    spin_unlock(&Content->lock);
+    return grain;
+}
+
+/**
+ * Determine whether entry still describes the file s describes.
+ **/
+static bool content_current(const ContentEntry *entry, const struct stat *s) {
+    return entry->dev == s->st_dev && entry->ino == s->st_ino && entry->size == s->st_size &&
+           entry->mtime.tv_sec == s->st_mtim.tv_sec && entry->mtime.tv_nsec == s->st_mtim.tv_nsec &&
+           entry->ctime.tv_sec == s->st_ctim.tv_sec && entry->ctime.tv_nsec == s->st_ctim.tv_nsec;
+}
+
+/**
+ * Serve a small file from the content cache.
+ *
+ * @param   r           Request structure (with URI).
+ * @return  true if the response was sent, false on a miss.
+ *
+ * A hit takes a single stat to check the file has not changed, instead of
+ * resolving the path, opening and reading the file.  The entry is copied
+ * out under its seqlock, so a process rewriting or evicting it meanwhile
+ * only makes the copy be retried.
+ **/
+bool content_serve(Request *r) {
+    if (!Content || !r->uri) {
+        return false;
+    }
+
+    uint64_t      key   = fnv1a(FNV1A_BASIS, r->uri, strlen(r->uri));
+    ContentEntry *slot  = &Entries[key & (CONTENT_SLOTS - 1)];
+    ContentEntry  entry;
+    char         *data  = NULL;
+
+    for (int attempt = 0; attempt < 3 && !data; attempt++) {
+        uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            return false;
+        }
+
+        memcpy(&entry, slot, sizeof(entry));
+        size_t length = (size_t)entry.uri_length + entry.path_length + 2 + entry.headers_length + entry.body_length;
+        if (entry.key != key || !entry.chunk ||
+            (size_t)(entry.chunk - 1) * CONTENT_GRAIN + sizeof(ContentChunk) + length > Slabs * CONTENT_SLAB) {
+            return false;               /* Not stored (or torn by a writer) */
+        }
+        if (!(data = malloc(length))) {
+            return false;
+        }
+        memcpy(data, content_chunk(entry.chunk) + 1, length);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+            free(data);
+            data = NULL;
+        }
+    }
+    if (!data) {
+        return false;
+    }
+
+    /* Check the URI (not just its hash) and that the file is unchanged */
+    char       *path    = data + entry.uri_length + 1;
+    char       *headers = path + entry.path_length + 1;
+    struct stat s;
+    if (strcmp(data, r->uri) != 0 || stat(path, &s) < 0 || !content_current(&entry, &s)) {
+        free(data);
+        return false;
+    }
+
+    memcpy(headers + entry.date_offset, http_date(NULL), DATE_LENGTH);
+    struct iovec iov[] = {
+        {headers, entry.headers_length},
+        {headers + entry.headers_length, entry.body_length},
+    };
+    if (request_writev(r, iov, 2) < 0) {
+        debug("Unable to writev: %s", strerror(errno));
+    }
+
+    free(data);
+    return true;
+}
+
+/**
+ * Store a small file's headers and body in the content cache.
+ *
+ * @param   r           Request structure (with URI and path).
+ * @param   resource    Cached headers of the file.
+ * @param   fd          Open file.
+ * @param   s           Stat information of fd.
+ *
+ * Files that do not fit the largest chunk, or are already stored, are
+ * skipped.
+ **/
+void content_store(Request *r, Resource *resource, int fd, const struct stat *s) {
+    if (!Content || !r->uri || !r->path || !S_ISREG(s->st_mode)) {
+        return;
+    }
+
+    size_t uri_length  = strlen(r->uri);
+    size_t path_length = strlen(r->path);
+    size_t length      = sizeof(ContentChunk) + uri_length + path_length + 2 + resource->headers_length + s->st_size;
+    size_t class       = 0;
+    while (class < CONTENT_CLASSES && (CONTENT_GRAIN << class) < length) {
+        class++;
+    }
+    if (class == CONTENT_CLASSES) {
+        return;
+    }
+
+    uint64_t      key   = fnv1a(FNV1A_BASIS, r->uri, strlen(r->uri));
+    size_t        index = key & (CONTENT_SLOTS - 1);
+    ContentEntry *entry = &Entries[index];
+    if (entry->key == key && entry->chunk && content_current(entry, s)) {
+        return;
+    }
+
+    /* Fill a chunk nobody can see yet */
+    uint32_t grain = content_alloc(class);
+    if (!grain) {
+        return;
+    }
+
+    char *data = (char *)(content_chunk(grain) + 1);
+    memcpy(data, r->uri, uri_length + 1);
+    memcpy(data + uri_length + 1, r->path, path_length + 1);
+    memcpy(data + uri_length + path_length + 2, resource->headers, resource->headers_length);
+    char *body = data + uri_length + path_length + 2 + resource->headers_length;
+
+    bool stored = pread(fd, body, s->st_size, 0) == s->st_size && spin_lock(&entry->sequence);
+    uint32_t old = 0;
+    if (stored) {
+        old                   = entry->chunk;
+        entry->chunk          = grain;
+        entry->key            = key;
+        entry->dev            = s->st_dev;
+        entry->ino            = s->st_ino;
+        entry->size           = s->st_size;
+        entry->mtime          = s->st_mtim;
+        entry->ctime          = s->st_ctim;
+        entry->uri_length     = uri_length;
+        entry->path_length    = path_length;
+        entry->headers_length = resource->headers_length;
+        entry->date_offset    = resource->date_offset;
+        entry->body_length    = s->st_size;
+        __atomic_store_n(&content_chunk(grain)->owner, index + 1, __ATOMIC_RELAXED);
+        spin_unlock(&entry->sequence);
+    }
+
+    /* Free the chunk replaced (or the one that could not be published) */
+    uint32_t unused = stored ? old : grain;
+    if (unused && spin_lock(&Content->lock)) {
+        content_free(unused);
+        spin_unlock(&Content->lock);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,350 @@
+/* coroutine.c: Stackful Coroutines on epoll */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define COROUTINE_STACK_SIZE    (256 * 1024)    /**< Reserved per coroutine; pages are touched lazily */
+#define COROUTINE_POOL_SIZE     1024            /**< Finished coroutines kept for reuse */
+#define COROUTINE_EVENTS        256             /**< Events collected per epoll_wait */
+
+/* Structures */
+
+struct coroutine {
+    ucontext_t  context;
+    void      (*function)(void *arg);
+    void       *arg;
+    char       *stack;                  /**< Stack mapping (lowest page is a guard) */
+    bool        waiting;                /**< Suspended in coroutine_wait */
+    bool        finished;               /**< Function returned */
+    int         result;                 /**< Events that ended the wait (0 = timeout, -1 = cancelled) */
+    uint64_t    deadline;               /**< Monotonic time the wait ends (ms) */
+    size_t      timer;                  /**< Index in Timers (SIZE_MAX = none) */
+    Coroutine  *next;                   /**< Next in run queue or pool */
+};
+
+/* Global Variables */
+
+static int        Epoll = -1;
+static ucontext_t Scheduler;            /**< Context of coroutine_dispatch */
+static Coroutine *Current = NULL;       /**< Running coroutine */
+static size_t     Count = 0;            /**< Coroutines not yet finished */
+
+static Coroutine *RunHead = NULL;       /**< Coroutines ready to run */
+static Coroutine *RunTail = NULL;
+
+static Coroutine *Pool = NULL;          /**< Finished coroutines (with stacks) */
+static size_t     PoolCount = 0;
+
+static Coroutine **Timers = NULL;       /**< Min-heap of waits by deadline */
+static size_t      TimersCount = 0;
+static size_t      TimersCapacity = 0;
+
+/* Timers */
+
+static uint64_t coroutine_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_place(size_t index, Coroutine *c) {
+    Timers[index] = c;
+    c->timer = index;
+}
+
+static void timer_sift(size_t index) {
+    Coroutine *c = Timers[index];
+
+    /* Up while earlier than the parent */
+    while (index > 0 && Timers[(index - 1) / 2]->deadline > c->deadline) {
+        timer_place(index, Timers[(index - 1) / 2]);
+        index = (index - 1) / 2;
+    }
+
+    /* Down while later than the earliest child */
+    while (2 * index + 1 < TimersCount) {
+        size_t child = 2 * index + 1;
+        if (child + 1 < TimersCount && Timers[child + 1]->deadline < Timers[child]->deadline) {
+            child++;
+        }
+        if (Timers[child]->deadline >= c->deadline) {
+            break;
+        }
+        timer_place(index, Timers[child]);
+        index = child;
+    }
+    timer_place(index, c);
+}
+
+static bool timer_push(Coroutine *c, uint64_t deadline) {
+    if (TimersCount == TimersCapacity) {
+        size_t      capacity = TimersCapacity ? TimersCapacity * 2 : 64;
+        Coroutine **timers   = realloc(Timers, capacity * sizeof(Coroutine *));
+        if (!timers) {
+            return false;
+        }
+        Timers = timers;
+        TimersCapacity = capacity;
+    }
+
+    c->deadline = deadline;
+    timer_place(TimersCount++, c);
+    timer_sift(c->timer);
+    return true;
+}
+
+static void timer_remove(Coroutine *c) {
+    size_t index = c->timer;
+    c->timer = SIZE_MAX;
+    if (--TimersCount != index) {
+        timer_place(index, Timers[TimersCount]);
+        timer_sift(index);
+    }
+}
+
+/* Scheduling */
+
+/**
+ * Make a suspended coroutine runnable.
+ *
+ * @param   c           Coroutine waiting in coroutine_wait.
+ * @param   result      Value coroutine_wait returns.
+ **/
+static void coroutine_wake(Coroutine *c, int result) {
+    if (!c->waiting) {
+        return;
+    }
+
+    c->waiting = false;
+    c->result  = result;
+    if (c->timer != SIZE_MAX) {
+        timer_remove(c);
+    }
+
+    c->next = NULL;
+    if (RunTail) {
+        RunTail->next = c;
+    } else {
+        RunHead = c;
+    }
+    RunTail = c;
+}
+
+/**
+ * Entry point of every coroutine (arguments travel through Current, since
+ * makecontext only passes ints).
+ **/
+static void coroutine_start(void) {
+    Current->function(Current->arg);
+    Current->finished = true;
+    /* Returning switches to uc_link, the scheduler */
+}
+
+/**
+ * Release a finished coroutine, keeping it (and its stack) for reuse.
+ **/
+static void coroutine_release(Coroutine *c) {
+    Count--;
+    if (PoolCount < COROUTINE_POOL_SIZE) {
+        c->next = Pool;
+        Pool = c;
+        PoolCount++;
+    } else {
+        munmap(c->stack, COROUTINE_STACK_SIZE);
+        free(c);
+    }
+}
+
+/**
+ * Run a coroutine until it waits or finishes.
+ **/
+static void coroutine_resume(Coroutine *c) {
+    Current = c;
+    swapcontext(&Scheduler, &c->context);
+    Current = NULL;
+
+    if (c->finished) {
+        coroutine_release(c);
+    }
+}
+
+/**
+ * Create a coroutine, to be started by the next coroutine_dispatch.
+ *
+ * @param   function    Function to run.
+ * @param   arg         Argument to pass to function.
+ * @return  New coroutine, or NULL on error.
+ *
+ * Stacks are mapped with a guard page below them, so an overflow faults
+ * instead of corrupting a neighbour, and are reused once their coroutine
+ * finishes.
+ **/
+Coroutine *coroutine_spawn(void (*function)(void *arg), void *arg) {
+    if (Epoll < 0 && (Epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return NULL;
+    }
+
+    Coroutine *c = Pool;
+    if (c) {
+        Pool = c->next;
+        PoolCount--;
+    } else {
+        if (!(c = calloc(1, sizeof(Coroutine)))) {
+            return NULL;
+        }
+        c->stack = mmap(NULL, COROUTINE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (c->stack == MAP_FAILED || mprotect(c->stack, getpagesize(), PROT_NONE) < 0) {
+            if (c->stack != MAP_FAILED) {
+                munmap(c->stack, COROUTINE_STACK_SIZE);
+            }
+            free(c);
+            return NULL;
+        }
+    }
+
+    getcontext(&c->context);
+    c->context.uc_stack.ss_sp   = c->stack;
+    c->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+    c->context.uc_link          = &Scheduler;
+    makecontext(&c->context, coroutine_start, 0);
+
+    c->function = function;
+    c->arg      = arg;
+    c->finished = false;
+    c->timer    = SIZE_MAX;
+    c->waiting  = true;
+    Count++;
+    coroutine_wake(c, 0);
+    return c;
+}
+
+/**
+ * Determine whether the caller is running in a coroutine.
+ **/
+bool coroutine_active(void) {
+    return Current != NULL;
+}
+
+/**
+ * Return the number of coroutines that have not finished.
+ **/
+size_t coroutine_count(void) {
+    return Count;
+}
+
+/**
+ * Wait until a descriptor is ready, or for a while.
+ *
+ * @param   fd          Descriptor to wait on (-1 = only sleep).
+ * @param   events      POLLIN and/or POLLOUT.
+ * @param   timeout     Milliseconds to wait (-1 = forever).
+ * @return  Ready events (> 0), 0 on timeout, or -1 on error (EINTR if the
+ *          wait was cancelled).
+ *
+ * In a coroutine, the descriptor is watched by the scheduler's epoll
+ * instance while other coroutines run; otherwise this is poll(2).  Either
+ * way, callers that get EAGAIN from a non-blocking descriptor can wait here
+ * and retry, and stay sequential.
+ **/
+int coroutine_wait(int fd, short events, int timeout) {
+    Coroutine *c = Current;
+
+    if (!c) {
+        struct pollfd pfd = {.fd = fd, .events = events};
+        int n = poll(&pfd, fd < 0 ? 0 : 1, timeout);
+        return n > 0 ? pfd.revents : n;
+    }
+
+    /* poll and epoll share event bits (POLLIN == EPOLLIN, ...) */
+    if (fd >= 0) {
+        struct epoll_event event = {.events = events, .data.ptr = c};
+        if (epoll_ctl(Epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+            return errno == EPERM ? events : -1;        /* Regular files are always ready */
+        }
+    }
+    if (timeout >= 0 && !timer_push(c, coroutine_now() + timeout)) {
+        if (fd >= 0) {
+            epoll_ctl(Epoll, EPOLL_CTL_DEL, fd, NULL);
+        }
+        return -1;
+    }
+
+    c->waiting = true;
+    swapcontext(&c->context, &Scheduler);
+
+    if (fd >= 0) {
+        epoll_ctl(Epoll, EPOLL_CTL_DEL, fd, NULL);
+    }
+    if (c->result < 0) {
+        errno = EINTR;
+    }
+    return c->result;
+}
+
+/**
+ * Cancel a coroutine's wait: coroutine_wait returns -1 with EINTR.
+ **/
+void coroutine_cancel(Coroutine *c) {
+    coroutine_wake(c, -1);
+}
+
+/**
+ * Run every runnable coroutine, then wait for descriptors or timers to make
+ * more of them runnable.
+ *
+ * @return  Number of coroutines woken, or -1 on error (EINTR when a signal
+ *          arrived, so callers can act on it).
+ **/
+int coroutine_dispatch(void) {
+    while (RunHead) {
+        Coroutine *c = RunHead;
+        RunHead = c->next;
+        if (!RunHead) {
+            RunTail = NULL;
+        }
+        coroutine_resume(c);
+    }
+
+    if (!Count) {
+        return 0;
+    }
+
+    int timeout = -1;
+    if (TimersCount) {
+        uint64_t now = coroutine_now();
+        timeout = Timers[0]->deadline > now ? (int)(Timers[0]->deadline - now) : 0;
+    }
+
+    struct epoll_event events[COROUTINE_EVENTS];
+    int n = epoll_wait(Epoll, events, COROUTINE_EVENTS, timeout);
+    if (n < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        coroutine_wake(events[i].data.ptr, events[i].events);
+    }
+
+    uint64_t now = coroutine_now();
+    int woken = n;
+    while (TimersCount && Timers[0]->deadline <= now) {
+        coroutine_wake(Timers[0], 0);
+        woken++;
+    }
+    return woken;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,111 @@
+/* event.c: Event-Driven HTTP Server */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define EVENT_ACCEPT_BACKOFF    100     /**< Milliseconds to pause accepting after an error (e.g. EMFILE) */
+
+/* Global Variables */
+
+static Listeners *Sockets = NULL;                       /**< Listening sockets */
+static Coroutine *Acceptors[MAX_LISTENERS];             /**< Accepting coroutine per socket */
+
+/**
+ * Handle one connection, sequentially, in its own coroutine.
+ **/
+static void event_connection(void *arg) {
+    Request *r = arg;
+    handle_request(r);
+    free_request(r);
+}
+
+/**
+ * Accept connections on one listening socket until the server drains.
+ **/
+static void event_accept(void *arg) {
+    size_t index = (Coroutine **)arg - Acceptors;
+    int    sfd   = Sockets->fds[index];
+
+    while (!Draining) {
+        if (coroutine_wait(sfd, POLLIN, -1) < 0) {
+            continue;
+        }
+
+        Request *r = accept_request(sfd, Sockets->secure[index]);
+        if (!r) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log("Cannot accept request: %s", strerror(errno));
+                coroutine_wait(-1, 0, EVENT_ACCEPT_BACKOFF);
+            }
+            continue;
+        }
+
+        if (!coroutine_spawn(event_connection, r)) {
+            log("Unable to start coroutine: %s", strerror(errno));
+            free_request(r);
+        }
+    }
+
+    Acceptors[index] = NULL;
+}
+
+/**
+ * Handle HTTP requests from coroutines in a single process.
+ *
+ * @param   listeners   Listening sockets.
+ * @return  Exit status of server.
+ *
+ * Each connection runs handle_request in a coroutine of its own, written
+ * as the same blocking code the other modes run: sockets are non-blocking,
+ * and wherever a read or write would block the coroutine waits (see
+ * coroutine_wait) while others run.  An idle or slow client therefore costs
+ * a small stack instead of a process.  Scripts run by the CGI handler are
+ * read the same way, but the rest of a handler (e.g. file system calls)
+ * still runs to completion.
+ **/
+int event_server(Listeners *listeners) {
+    Sockets = listeners;
+    for (size_t i = 0; i < listeners->count; i++) {
+        fcntl(listeners->fds[i], F_SETFL, fcntl(listeners->fds[i], F_GETFL) | O_NONBLOCK);
+        if (!(Acceptors[i] = coroutine_spawn(event_accept, &Acceptors[i]))) {
+            fprintf(stderr, "Unable to start coroutine: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Run until drained: stop accepting, then finish open connections
+     * (unless terminating, which leaves them) */
+    bool draining = false;
+    while (coroutine_count() && !Terminating) {
+        if (!draining && upgrade_poll(listeners, 1)) {
+            draining = true;
+            for (size_t i = 0; i < listeners->count; i++) {
+                if (Acceptors[i]) {
+                    coroutine_cancel(Acceptors[i]);
+                }
+            }
+        }
+
+        if (coroutine_dispatch() < 0 && errno != EINTR) {
+            fprintf(stderr, "Unable to wait for events: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Close server sockets */
+    socket_close(listeners);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
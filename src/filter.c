@@ -0,0 +1,354 @@
+/* filter.c: Negative Lookup Filter */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Constants */
+
+#define FILTER_BITS     16              /**< Filter bits per path (power of two) */
+#define FILTER_HASHES   8               /**< Bits set per path */
+#define FILTER_WATCHES  65536           /**< Watched directories */
+#define FILTER_NAMES    (4 * 1024 * 1024)   /**< Bytes of directory paths */
+#define FILTER_DEPTH    64              /**< Deepest URI checked */
+#define FILTER_SYMLINK  0x9e3779b97f4a7c15ULL   /**< Key of a path marked as a symlink */
+#define FILTER_EVENTS   (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/* Structures */
+
+/**
+ * Bloom filter of every path under RootPath, plus the relative path of each
+ * watched directory (so whichever process reads an event can tell where it
+ * happened).  Paths are only ever added: a removed file stays in the filter
+ * and is just not rejected early.
+ **/
+typedef struct {
+    uint32_t    lock;                   /**< Held while reading events (odd while held) */
+    uint32_t    complete;               /**< Filter holds every path (0 = reject nothing) */
+    uint32_t    used;                   /**< Bytes of names used */
+    uint32_t    directories[FILTER_WATCHES];    /**< Offset + 1 of each watch's path in names */
+    char        names[FILTER_NAMES];
+    uint64_t    bits[];
+} FilterHeader;
+
+/* Global Variables */
+
+static size_t        FilterPaths = 0;   /**< Paths the filter is sized for with -N (0 = no filter) */
+static uint64_t      Mask = 0;          /**< Bits in filter - 1 */
+static FilterHeader *Filter = NULL;     /**< Shared by all server processes */
+static int           Inotify = -1;      /**< Shared by all server processes */
+
+/**
+ * Configure the negative lookup filter.
+ *
+ * @param   spec        Number of paths to size the filter for (more still
+ *                      work, with more false positives).
+ * @return  true if spec is valid.
+ **/
+bool filter_configure(const char *spec) {
+    char *end;
+    FilterPaths = strtoull(spec, &end, 10);
+    return end != spec && *end == '\0' && FilterPaths > 0;
+}
+
+/**
+ * Extend FNV-1a hash of a path with "/" and a name (of length bytes).
+ **/
+static uint64_t filter_key(uint64_t hash, const char *name, size_t length) {
+    return fnv1a(fnv1a(hash, "/", 1), name, length);
+}
+
+/**
+ * Compute key of a relative path ("" is the root).
+ **/
+static uint64_t filter_path(const char *path) {
+    uint64_t hash = FNV1A_BASIS;
+    while (*path) {
+        size_t length = strchrnul(path, '/') - path;
+        hash = filter_key(hash, path, length);
+        path += length + (path[length] == '/');
+    }
+    return hash;
+}
+
+/**
+ * Mix key (FNV's low bits are weak) into two halves for double hashing.
+ **/
+static uint64_t filter_mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static void filter_add(uint64_t key) {
+    uint64_t hash = filter_mix(key);
+    uint64_t step = (hash >> 32) | 1;
+    for (size_t i = 0; i < FILTER_HASHES; i++, hash += step) {
+        __atomic_or_fetch(&Filter->bits[(hash & Mask) / 64], 1ULL << (hash % 64), __ATOMIC_RELAXED);
+    }
+}
+
+static bool filter_contains(uint64_t key) {
+    uint64_t hash = filter_mix(key);
+    uint64_t step = (hash >> 32) | 1;
+    for (size_t i = 0; i < FILTER_HASHES; i++, hash += step) {
+        if (!(__atomic_load_n(&Filter->bits[(hash & Mask) / 64], __ATOMIC_RELAXED) & (1ULL << (hash % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Stop rejecting requests, because the filter can no longer hold every path.
+ **/
+static void filter_give_up(const char *reason) {
+    if (__atomic_exchange_n(&Filter->complete, 0, __ATOMIC_RELAXED)) {
+        log("Negative lookup filter disabled: %s", reason);
+    }
+}
+
+/**
+ * Watch directory and add everything below it (lock held, or before fork).
+ *
+ * @param   relative    Path of directory relative to RootPath ("" is the root).
+ *
+ * The watch is added before the directory is read, so an entry created
+ * meanwhile is either read or reported.  Symlinks are added (and marked),
+ * but not followed.
+ **/
+static void filter_scan(const char *relative) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", RootPath, relative) >= (int)sizeof(path)) {
+        filter_give_up("path too long");
+        return;
+    }
+
+    int wd = inotify_add_watch(Inotify, path, FILTER_EVENTS);
+    if (wd < 0) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            filter_give_up(strerror(errno));
+        }
+        return;
+    }
+    if (wd >= FILTER_WATCHES) {
+        filter_give_up("too many directories");
+        return;
+    }
+
+    /* Remember where the watch is (a directory moved back gets its watch back) */
+    uint32_t offset = Filter->directories[wd];
+    if (!offset || !streq(Filter->names + offset - 1, relative)) {
+        size_t length = strlen(relative) + 1;
+        if (Filter->used + length > FILTER_NAMES) {
+            filter_give_up("too many directory names");
+            return;
+        }
+        memcpy(Filter->names + Filter->used, relative, length);
+        Filter->directories[wd] = Filter->used + 1;
+        Filter->used += length;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+
+    uint64_t       parent = filter_path(relative);
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (streq(entry->d_name, ".") || streq(entry->d_name, "..")) {
+            continue;
+        }
+
+        uint64_t key  = filter_key(parent, entry->d_name, strlen(entry->d_name));
+        int      type = entry->d_type;
+        filter_add(key);
+
+        if (type == DT_UNKNOWN) {
+            struct stat s;
+            if (fstatat(dirfd(dir), entry->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = S_ISDIR(s.st_mode) ? DT_DIR : S_ISLNK(s.st_mode) ? DT_LNK : DT_REG;
+            }
+        }
+        if (type == DT_LNK) {
+            filter_add(key ^ FILTER_SYMLINK);
+        } else if (type == DT_DIR) {
+            char child[PATH_MAX];
+            snprintf(child, sizeof(child), "%s%s%s", relative, *relative ? "/" : "", entry->d_name);
+            filter_scan(child);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Map the filter, watch RootPath and add every path below it.
+ *
+ * @return  0 on success (or if the filter is disabled), -1 on error.
+ *
+ * Must be called once RootPath is resolved and before the server forks, so
+ * every process shares the filter and reads the same inotify events.
+ **/
+int filter_init(void) {
+    if (!FilterPaths || !RootPath) {
+        return 0;
+    }
+
+    size_t bits = 64;
+    while (bits < FilterPaths * FILTER_BITS) {
+        bits *= 2;
+    }
+
+    Filter = mmap(NULL, sizeof(FilterHeader) + bits / 8, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Filter == MAP_FAILED) {
+        fprintf(stderr, "Unable to map negative lookup filter: %s\n", strerror(errno));
+        Filter = NULL;
+        return -1;
+    }
+
+    Inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (Inotify < 0) {
+        fprintf(stderr, "Unable to watch %s: %s\n", RootPath, strerror(errno));
+        munmap(Filter, sizeof(FilterHeader) + bits / 8);
+        Filter = NULL;
+        return -1;
+    }
+
+    Mask = bits - 1;
+    Filter->complete = 1;
+    filter_scan("");
+    log("Filtering requests for missing paths with %zu KiB (watching %u bytes of directories)",
+        bits / 8 / 1024, Filter->used);
+    return 0;
+}
+
+/**
+ * Determine whether requests are checked against the negative lookup filter.
+ **/
+bool filter_enabled(void) {
+    return Filter != NULL;
+}
+
+/**
+ * Add paths reported by inotify to the filter.
+ *
+ * @return  true if the filter is up to date, false if another process is
+ *          updating it (or the filter was given up on).
+ *
+ * Events are read only when a request would be rejected: creating a file
+ * queues its event before the creator returns, so draining the queue first
+ * never rejects a path that exists by the time it is requested.  If the
+ * queue overflowed, everything is scanned again.
+ **/
+static bool filter_update(void) {
+    int pending = 0;
+    if (ioctl(Inotify, FIONREAD, &pending) == 0 && pending == 0) {
+        return true;
+    }
+    if (!spin_lock(&Filter->lock)) {
+        return false;
+    }
+
+    char    buffer[BUFSIZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t nread;
+    bool    overflow = false;
+    while ((nread = read(Inotify, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + nread; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+            }
+            if (!event->len || event->wd < 0 || event->wd >= FILTER_WATCHES || !Filter->directories[event->wd]) {
+                continue;
+            }
+
+            const char *directory = Filter->names + Filter->directories[event->wd] - 1;
+            uint64_t    key       = filter_key(filter_path(directory), event->name, strlen(event->name));
+            filter_add(key);
+
+            /* Symlinks are marked even though they may point at files */
+            struct stat s;
+            char        relative[PATH_MAX];
+            char        path[PATH_MAX];
+            if (snprintf(relative, sizeof(relative), "%s%s%s", directory, *directory ? "/" : "", event->name) >= (int)sizeof(relative) ||
+                snprintf(path, sizeof(path), "%s/%s", RootPath, relative) >= (int)sizeof(path)) {
+                filter_give_up("path too long");
+            } else if (event->mask & IN_ISDIR) {
+                filter_scan(relative);
+            } else if (lstat(path, &s) < 0 || S_ISLNK(s.st_mode)) {
+                filter_add(key ^ FILTER_SYMLINK);
+            }
+        }
+    }
+    if (overflow) {
+        debug("inotify queue overflowed: scanning %s again", RootPath);
+        filter_scan("");
+    }
+
+    spin_unlock(&Filter->lock);
+    return __atomic_load_n(&Filter->complete, __ATOMIC_RELAXED);
+}
+
+/**
+ * Determine whether the path of a URI certainly does not exist.
+ *
+ * @param   uri         Request URI (as given to determine_request_path).
+ * @return  true if nothing under RootPath matches uri, so the request can be
+ *          rejected without touching the filesystem.
+ *
+ * URIs with "." or ".." segments, very deep ones and those below a symlink
+ * are never rejected (determine_request_path resolves those).
+ **/
+bool filter_missing(const char *uri) {
+    if (!Filter || !__atomic_load_n(&Filter->complete, __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    uint64_t prefixes[FILTER_DEPTH];
+    size_t   depth = 0;
+    uint64_t key   = FNV1A_BASIS;
+    for (const char *p = uri; *p; ) {
+        size_t length = strchrnul(p, '/') - p;
+        if (length == 0) {
+            p++;
+            continue;
+        }
+        if ((length == 1 && p[0] == '.') || (length == 2 && p[0] == '.' && p[1] == '.') || depth == FILTER_DEPTH) {
+            return false;
+        }
+        key = prefixes[depth++] = filter_key(key, p, length);
+        p  += length;
+    }
+
+    for (int attempt = 0; depth && attempt < 2; attempt++) {
+        if (filter_contains(key)) {
+            return false;
+        }
+        for (size_t i = 0; i + 1 < depth; i++) {
+            if (filter_contains(prefixes[i] ^ FILTER_SYMLINK)) {
+                return false;
+            }
+        }
+        if (attempt == 0 && !filter_update()) {
+            return false;
+        }
+    }
+    return depth > 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
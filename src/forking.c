@@ -6,51 +6,138 @@
 #include <signal.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Structures */
+
+/**
+ * Child handling a connection that counts against its client's limits.
+ **/
+typedef struct {
+    pid_t       pid;
+    LimitSlot  *limit;
+} Child;
+
+/* Global Variables */
+
+static Child   *Children = NULL;        /**< Children whose connections the parent releases */
+static size_t   ChildrenCount = 0;
+static size_t   ChildrenCapacity = 0;
+
+/**
+ * Make room to track one more child.
+ *
+ * @return  false if there is no memory (the child then releases its own
+ *          connection).
+ **/
+static bool forking_reserve(void) {
+    if (ChildrenCount == ChildrenCapacity) {
+        size_t capacity = ChildrenCapacity ? ChildrenCapacity * 2 : 64;
+        Child *children = realloc(Children, capacity * sizeof(Child));
+        if (!children) {
+            return false;
+        }
+        Children = children;
+        ChildrenCapacity = capacity;
+    }
+    return true;
+}
+
+/**
+ * Reap finished children and release the connections they counted.
+ *
+ * Releasing here rather than in the child means a child that is killed
+ * mid-request does not leave its client one connection short for good.
+ **/
+static void forking_reap(void) {
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (size_t i = 0; i < ChildrenCount; i++) {
+            if (Children[i].pid == pid) {
+                limit_release_slot(Children[i].limit);
+                Children[i] = Children[--ChildrenCount];
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Interrupt the wait for connections when a child exits, so the loop reaps
+ * it even while no client connects.
+ **/
+static void forking_signal(int signum) {
+}
+
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listeners   Listening sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
  * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * handle the request.  Children are reaped as they exit and again before
+ * each accept, so their connections stop counting against client limits
+ * before the next client is admitted, and an idle server keeps no zombies.
  **/
-int forking_server(int sfd) {
+int forking_server(Listeners *listeners) {
     Request *r;
+    struct sigaction action = {.sa_handler = forking_signal};
 
-    /* Accept and handle HTTP request */
-    while (true) {
+    /* Without SA_RESTART, so socket_wait returns when a child exits */
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+
+    /* Accept and handle HTTP request until asked to drain (children finish
+     * their requests on their own) */
+    while (!upgrade_poll(listeners, 1)) {
     	/* Accept request */
-        r = accept_request(sfd);
+        int sfd = socket_wait(listeners);
+        if (sfd < 0) {
+            forking_reap();
+            continue;
+        }
+        forking_reap();
+        r = accept_request(sfd, socket_secure(listeners, sfd));
         if(!r) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
             return EXIT_FAILURE;
         }
 
-	/* Ignore children */
-        signal(SIGCHLD, SIG_IGN);
-
 	/* Fork off child process to handle request */
+        bool  tracked = r->limit && forking_reserve();
         pid_t pid = fork();
 
         if(pid < 0) {
             fprintf(stderr, "Unable to fork %s\n", strerror(errno));
-            close(r->fd);
+            free_request(r);
         }
         else if(pid == 0) { // child
-            close(sfd);
+            signal(SIGCHLD, SIG_DFL);
+            socket_close(listeners);
+            if (tracked) {
+                r->limit = NULL;        /* The parent releases the connection */
+            }
             handle_request(r);
+            free_request(r);
             exit(EXIT_SUCCESS);
         }
         else {               
+            if (tracked) {
+                Children[ChildrenCount++] = (Child){pid, r->limit};
+            }
+            r->limit = NULL;
             free_request(r);
         }
 
     }
 
-    /* Close server socket */       
-        close(r->fd);
+    /* Close server sockets */
+    socket_close(listeners);
 
     return EXIT_SUCCESS;
 }
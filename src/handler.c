@@ -1,20 +1,52 @@
 /* handler.c: HTTP Request Handlers */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define LARGE_FILE_WINDOW   (2 * 1024 * 1024)   /**< Bytes read ahead of the socket */
+#define LARGE_FILE_RETRY    (32 * 1024 * 1024)  /**< Bytes behind the socket dropped again */
+
+/* Global Variables */
+
+size_t LargeFileSize = 64 * 1024 * 1024;
+
+static char   ErrorResponses[HTTP_STATUS_BAD_GATEWAY + 1][256];  /**< Rendered by handle_error_init */
+static size_t ErrorLengths[HTTP_STATUS_BAD_GATEWAY + 1];
+
 /* Internal Declarations */
 Status handle_browse_request(Request *request);
 Status handle_file_request(Request *request);
 Status handle_cgi_request(Request *request);
-Status handle_error(Request *request, Status status);
+
+/**
+ * Configure the size from which files are streamed past the page cache.
+ *
+ * @param   spec        Size in bytes (0 = never).
+ * @return  true if spec is valid.
+ **/
+bool large_file_configure(const char *spec) {
+    char *end;
+    errno = 0;
+    LargeFileSize = strtoull(spec, &end, 10);
+    return isdigit((unsigned char)*spec) && *end == '\0' && errno == 0;
+}
 
 /**
  * Handle HTTP Request.
@@ -22,24 +54,83 @@ Status handle_error(Request *request, Status status);
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This completes the TLS handshake for secure connections, parses a request
+ * and then either hands the connection over to HTTP/2 (prior knowledge, h2c
+ * Upgrade, or h2 negotiated with ALPN) or dispatches the request.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
+ *
+ * With tracing enabled, each phase is recorded as a span of the request.
  **/
 Status  handle_request(Request *r) {
+    uint64_t start = trace_begin();
+    Status   status;
+
+    /* Complete TLS handshake (there is no stream to report errors on yet) */
+    if (r->secure && trace(r, TRACE_HANDSHAKE, tls_accept(r)) < 0) {
+        status = HTTP_STATUS_BAD_REQUEST;
+    }
+
+    /* Parse request */
+    else if (trace(r, TRACE_PARSE, parse_request(r)) < 0) {
+        status = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    }
+
+    else if (http2_requested(r)) {
+        status = trace(r, TRACE_HTTP2, handle_http2(r));
+    }
+
+    else {
+        status = dispatch_request(r);
+    }
+
+    trace_end(r->trace, TRACE_REQUEST, start);
+    return status;
+}
+
+/**
+ * Dispatch parsed HTTP Request.
+ *
+ * @param   r           HTTP Request structure
+ * @return  Status of the HTTP request.
+ *
+ * This forwards proxied prefixes upstream, runs module prefixes in-process
+ * and serves from the archive if one is mapped, or from the content cache
+ * if the file is there.  Paths the negative lookup filter knows are missing
+ * are rejected; otherwise it determines the request path, determines the
+ * request type, and then dispatches to the appropriate handler type.
+ **/
+Status  dispatch_request(Request *r) {
     Status result = HTTP_STATUS_OK;
     struct stat s;
 
-    /* Parse request */
-    int request_stat = parse_request(r);
-    if (request_stat < 0) {
-        result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
-        return result;
+    /* Forward configured prefixes to upstream servers */
+    if (proxy_requested(r)) {
+        return trace(r, TRACE_PROXY, handle_proxy_request(r));
     }
-    
+
+    /* Run prefixes registered by handler modules in-process */
+    if (module_requested(r)) {
+        return trace(r, TRACE_MODULE, handle_module_request(r));
+    }
+
+    /* Serve everything else from the archive when there is one */
+    if (archive_enabled()) {
+        return trace(r, TRACE_ARCHIVE, handle_archive_request(r));
+    }
+
+    /* Serve small files straight from the shared content cache */
+    if (content_enabled() && trace(r, TRACE_CONTENT, content_serve(r))) {
+        return HTTP_STATUS_OK;
+    }
+
+    /* Reject paths that do not exist without touching the filesystem */
+    if (filter_enabled() && trace(r, TRACE_FILTER, filter_missing(r->uri))) {
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
+
     /* Determine request path */
-    char * path = determine_request_path(r->uri);
+    char * path = trace(r, TRACE_PATH, determine_request_path(r->uri));
     r->path = path;
 
     if (!r->path) {
@@ -59,17 +150,17 @@ Status  handle_request(Request *r) {
 
     else if (stat (r->path, &s) == 0) {   
          if (S_ISDIR(s.st_mode)) {
-                result = handle_browse_request(r);
+                result = trace(r, TRACE_BROWSE, handle_browse_request(r));
                 return result;
          }
     }
 
     if (access(r->path, X_OK) == 0) { 
-        result = handle_cgi_request(r);
+        result = trace(r, TRACE_CGI, handle_cgi_request(r));
     }
 
     else if (access(r->path, R_OK) == 0) {
-        result = handle_file_request(r);
+        result = trace(r, TRACE_FILE, handle_file_request(r));
     }
 
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
@@ -132,65 +223,159 @@ Status  handle_browse_request(Request *r) {
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Drop the part of a large file the client has received from the page
+ * cache.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          File being sent.
+ * @param   dropped     Offset up to which pages were dropped already.
+ * @param   sent        Offset up to which the file was sent.
+ * @return  Offset up to which pages are now dropped.
+ *
+ * sendfile leaves the socket referring to the pages until the client
+ * acknowledges them, and the kernel skips referenced pages, so only what
+ * has left the send queue (SIOCOUTQ) is dropped.  Over loopback the pages
+ * stay referenced until the client reads them, so the last
+ * LARGE_FILE_RETRY bytes are dropped again each time.
+ **/
+static off_t handle_large_file_drop(Request *r, int fd, off_t dropped, off_t sent) {
+    int queued = 0;
+    if (r->fd >= 0 && !(r->ssl && !r->ktls)) {
+        ioctl(r->fd, SIOCOUTQ, &queued);
+    }
+
+    off_t done  = sent - queued;
+    off_t retry = dropped > LARGE_FILE_RETRY ? dropped - LARGE_FILE_RETRY : 0;
+    if (done > dropped) {
+        posix_fadvise(fd, retry, done - retry, POSIX_FADV_DONTNEED);
+        dropped = done;
+    }
+    return dropped;
+}
+
+/**
+ * Stream a large file window by window: the kernel reads the next window
+ * ahead while the current one is sent, and what the client has received is
+ * dropped from the page cache.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          File to send.
+ * @param   size        Size of file.
+ * @return  Number of bytes sent, or -1 on error.
+ **/
+static ssize_t handle_large_file(Request *r, int fd, off_t size) {
+    off_t offset  = 0;
+    off_t dropped = 0;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    readahead(fd, 0, LARGE_FILE_WINDOW);
+
+    while (offset < size) {
+        size_t length = size - offset < LARGE_FILE_WINDOW ? size - offset : LARGE_FILE_WINDOW;
+        if (offset + length < size) {
+            readahead(fd, offset + length, LARGE_FILE_WINDOW);
+        }
+
+        ssize_t n = request_sendfile(r, fd, offset, length);
+        if (n <= 0) {
+            return n < 0 ? -1 : offset;
+        }
+        offset += n;
+        dropped = handle_large_file_drop(r, fd, dropped, offset);
+    }
+
+    return offset;
+}
+
 /**
  * Handle file request.
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * This sends the cached status line and headers for the file together with
+ * its contents.  Small files go out with the headers in a single writev;
+ * larger files have the headers corked onto the socket with MSG_MORE and
+ * the body sent with sendfile.  Files of LargeFileSize or more are streamed
+ * with handle_large_file, so they do not push the small, hot files out of
+ * the page cache.
  *
  * If the path cannot be opened for reading, then handle error with
  * HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_file_request(Request *r) {
-
-    debug("handle_file_request");
-
-    FILE *fs;               
-    char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
-    Status status;
+    struct stat s;
+    Resource *resource;
+    const char *headers;
+    size_t headers_length;
 
     /* Open file for reading */
-    debug("about to open file");
-    fs = fopen(r->path, "r");
-    if(!fs) {
+    int fd = open(r->path, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "error opening file: %s\n", strerror(errno));
-        status = handle_error(r, HTTP_STATUS_NOT_FOUND);
-        return status;
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
-    /* Determine mimetype */
-    mimetype = determine_mimetype( r->path );
-    debug("mimetype: %s", mimetype);
-
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->stream, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_OK));
-    fprintf(r->stream, "Content-Type: %s\r\n", mimetype);
-    fprintf(r->stream, "\r\n");
-
-    /* Read from file and write to socket in chunks */
-    nread = fread(buffer, 1, BUFSIZ, fs);
-    debug("about to read from file");
-    while(nread > 0) {
-        fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer, 1, BUFSIZ, fs);
+    /* Lookup cached headers (determines mimetype on first use) */
+    if (fstat(fd, &s) < 0 || !(resource = trace(r, TRACE_RESOURCE, resource_lookup(r->path, &s)))) {
+        close(fd);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
+    headers = resource_headers(resource, &headers_length);
+
+    /* Write headers and contents to socket */
+    if (s.st_size <= BUFSIZ) {
+        char buffer[BUFSIZ];
+        ssize_t nread = pread(fd, buffer, s.st_size, 0);
+        if (nread != s.st_size) {
+            close(fd);
+            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        }
 
-    debug("Done reading from file");
-
-    /* Close file, deallocate mimetype, return OK */
-    fclose(fs);
-    if(mimetype) {
-        free(mimetype);
+        struct iovec iov[] = {
+            {(void *)headers, headers_length},
+            {buffer, nread},
+        };
+        if (trace(r, TRACE_SEND, request_writev(r, iov, 2)) < 0) {
+            debug("Unable to writev: %s", strerror(errno));
+        }
+    } else {
+        uint64_t start = trace_begin();
+        ssize_t  sent  = request_write(r, headers, headers_length, MSG_MORE) < 0 ? -1 :
+                         LargeFileSize && s.st_size >= LargeFileSize ? handle_large_file(r, fd, s.st_size) :
+                         request_sendfile(r, fd, 0, s.st_size);
+        trace_end(r->trace, TRACE_SEND, start);
+        if (sent < 0) {
+            debug("Unable to send file: %s", strerror(errno));
+        }
     }
 
+    /* Share small files with every server process, close file, return OK */
+    content_store(r, resource, fd, &s);
+    close(fd);
     return HTTP_STATUS_OK;
+}
+
+/**
+ * Read output of a CGI script.
+ *
+ * In a coroutine, this waits for the pipe to become readable (letting other
+ * connections run meanwhile) and takes what is there, instead of blocking
+ * in fread until the buffer is full.
+ *
+ * @return  Number of bytes read (0 at end of output or on error).
+ **/
+static size_t handle_cgi_read(FILE *stream, char *buffer, size_t size) {
+    if (!coroutine_active()) {
+        return fread(buffer, 1, size, stream);
+    }
 
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    ssize_t n;
+    do {
+        n = coroutine_wait(fileno(stream), POLLIN, -1) < 0 ? -1 : read(fileno(stream), buffer, size);
+    } while (n < 0 && errno == EINTR);
+    return n > 0 ? n : 0;
 }
 
 /**
@@ -202,11 +387,27 @@ Status  handle_file_request(Request *r) {
  * This popens and streams the results of the specified executables to the
  * socket.
  *
+ * With the CGI cache enabled, a fresh cached response is sent instead; on a
+ * miss the script runs while holding the key's fill lock, so concurrent
+ * misses for the same URI and query run it once and then share its output.
+ *
  * If the path cannot be popened, then handle error with
  * HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 Status  handle_cgi_request(Request *r) {
     Status status;
+    int    lock = -1;
+
+    if (cgi_cache_enabled(r)) {
+        if (cgi_cache_serve(r)) {
+            return HTTP_STATUS_OK;
+        }
+        lock = cgi_cache_lock(r);
+        if (lock >= 0 && cgi_cache_serve(r)) {
+            cgi_cache_unlock(lock);
+            return HTTP_STATUS_OK;
+        }
+    }
 
     /* Export CGI environment variables from request:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
@@ -216,10 +417,10 @@ Status  handle_cgi_request(Request *r) {
     if(r->query) {
         setenv("QUERY_STRING", r->query, 1);
     }
-    if(r->host) {
+    if(r->host[0]) {
         setenv("REMOTE_ADDR", r->host, 1);
     }
-    if(r->port) {
+    if(r->port[0]) {
         setenv("REMOTE_PORT", r->port, 1);
     }
     if(r->method) {
@@ -235,75 +436,111 @@ Status  handle_cgi_request(Request *r) {
         setenv("SERVER_PORT", Port, 1);
     }
 
-    /* Export CGI environment variables from request headers */ 
-    for(Header *header = r->headers; header; header = header->next) {
-        if(streq(header->name, "Host")) {
-            setenv("HTTP_HOST", header->name, 1);
-        }
-        else if(streq(header->name, "Accept")) {
-            setenv("HTTP_ACCEPT", header->name, 1);
-        }
-        else if(streq(header->name, "Accept-Language")) {
-            setenv("HTTP_ACCEPT_LANGUAGE", header->name, 1);
+    /* Export CGI environment variables from request headers (clearing
+     * those a previous request in this process set) */
+    static const struct {
+        HeaderId    id;
+        const char *variable;
+    } Variables[] = {
+        {HEADER_HOST,               "HTTP_HOST"},
+        {HEADER_ACCEPT,             "HTTP_ACCEPT"},
+        {HEADER_ACCEPT_LANGUAGE,    "HTTP_ACCEPT_LANGUAGE"},
+        {HEADER_ACCEPT_ENCODING,    "HTTP_ACCEPT_ENCODING"},
+        {HEADER_CONNECTION,         "HTTP_CONNECTION"},
+        {HEADER_USER_AGENT,         "HTTP_USER_AGENT"},
+    };
+    for(size_t i = 0; i < sizeof(Variables) / sizeof(Variables[0]); i++) {
+        const char *data = request_known_header(r, Variables[i].id);
+        if(data) {
+            setenv(Variables[i].variable, data, 1);
         }
-        else if(streq(header->name, "Accept-Encoding")) {
-            setenv("HTTP_ACCEPT_ENCODING", header->name, 1);
-        }
-        else if(streq(header->name, "Connection")) {
-            setenv("HTTP_CONNECTION", header->name, 1);
-        }
-        else if(streq(header->name, "User-Agent")) {
-            setenv("HTTP_USER_AGENT", header->name, 1);
+        else {
+            unsetenv(Variables[i].variable);
         }
     }
 
     /* POpen CGI Script */
-    FILE *process_stream = popen(r->path, "r");
+    FILE *process_stream = trace(r, TRACE_POPEN, popen(r->path, "r"));
     if(!process_stream) {
         debug("error opening path with popen: %s\n", strerror(errno));
+        cgi_cache_unlock(lock);
         status = handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
         return status;
     }
 
-    /* Copy data from popen to socket */
+    /* Copy data from popen to socket (keeping a copy for the cache) */
     char buffer[BUFSIZ];
-    size_t nread = fread(buffer, 1, BUFSIZ, process_stream);
+    size_t nread = handle_cgi_read(process_stream, buffer, BUFSIZ);
+
+    char  *output = NULL;
+    size_t output_length = 0;
+    FILE  *capture = lock >= 0 ? open_memstream(&output, &output_length) : NULL;
 
     debug("CGI: reading from process stream\n");
     while(nread > 0) {
         fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer, 1, BUFSIZ, process_stream);
+        if (capture) {
+            fwrite(buffer, 1, nread, capture);
+        }
+        nread = handle_cgi_read(process_stream, buffer, BUFSIZ);
     }
 
-    /* Close popen, return OK */
-    pclose(process_stream);
+    /* Close popen, cache output of scripts that succeeded, return OK */
+    int exit_status = pclose(process_stream);
+    if (capture) {
+        if (fclose(capture) == 0 && exit_status == 0) {
+            cgi_cache_store(r, output, output_length);
+        }
+        free(output);
+    }
+    cgi_cache_unlock(lock);
 
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Render the response for each error status once, at startup, so every
+ * server process inherits them before it forks.
+ **/
+__attribute__((constructor))
+static void handle_error_init(void) {
+    for (Status status = HTTP_STATUS_OK; status <= HTTP_STATUS_BAD_GATEWAY; status++) {
+        const char *status_string = http_status_string(status);
+        char        body[128];
+        int         body_length = snprintf(body, sizeof(body),
+            " <h1>%s </h1>\r\n"
+            "Something bad has happened. You're really screwed this time </body> \r\n", status_string);
+
+        ErrorLengths[status] = snprintf(ErrorResponses[status], sizeof(ErrorResponses[status]),
+            "HTTP/1.0 %s\r\n"
+            "Content-Type: text/html\r\n"
+            "Content-Length: %d\r\n"
+            "\r\n"
+            "%s", status_string, body_length, body);
+    }
+}
+
 /**
  * Handle displaying error page
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP error request.
  *
- * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * This writes an HTTP status error code and an HTML message to notify the
+ * user of the error.  The response for each status (with Content-Length) is
+ * rendered by handle_error_init and sent in a single write.
  **/
 Status  handle_error(Request *r, Status status) {
-    const char *status_string = http_status_string(status);
-
-    /* Write HTTP Header */  
     debug("Handling error\n");
 
-    fprintf(r->stream, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->stream, "Content-Type: text/html\r\n"); 
-    fprintf(r->stream, "\r\n");
+    /* Anything already buffered goes first */
+    if (r->stream) {
+        fflush(r->stream);
+    }
+    if (request_write(r, ErrorResponses[status], ErrorLengths[status], 0) < 0) {
+        debug("Unable to write error: %s", strerror(errno));
+    }
 
-    /* Write HTML Description of Error*/
-    fprintf(r->stream, " <h1>%s </h1>\r\n", status_string);
-    fprintf(r->stream, "Something bad has happened. You're really screwed this time </body> \r\n"); 
-        
     /* Return specified status */
     return status;
 }
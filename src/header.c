@@ -0,0 +1,155 @@
+/* header.c: Well-Known Header Lookup */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <string.h>
+#include <strings.h>
+
+/* Constants */
+
+#define HEADER_SLOTS    64
+
+/**
+ * Perfect hash of a header name: its length, plus its first character,
+ * plus seven times its last character, both folded to lower case.  Every
+ * well-known name lands in a slot of its own, so a lookup is one hash and
+ * one strncasecmp.
+ **/
+#define HEADER_HASH(length, first, last) \
+    (((length) + ((first) | 0x20) + 7 * ((last) | 0x20)) & (HEADER_SLOTS - 1))
+
+/* Structures */
+
+typedef struct {
+    const char *name;
+    size_t      length;
+    HeaderId    id;
+} HeaderSlot;
+
+#define SLOT(slot, string, header) \
+    [slot] = {string, sizeof(string) - 1, header}
+
+/* Global Variables */
+
+/* Table of well-known headers by hash (see HEADER_HASH), generated offline
+ * and checked by header_init in debug builds */
+static const HeaderSlot Slots[HEADER_SLOTS] = {
+    SLOT( 1, "accept-encoding",         HEADER_ACCEPT_ENCODING),
+    SLOT( 2, "proxy-connection",        HEADER_PROXY_CONNECTION),
+    SLOT( 5, "proxy-authorization",     HEADER_PROXY_AUTHORIZATION),
+    SLOT( 9, "content-length",          HEADER_CONTENT_LENGTH),
+    SLOT(14, "if-none-match",           HEADER_IF_NONE_MATCH),
+    SLOT(19, "accept",                  HEADER_ACCEPT),
+    SLOT(22, "transfer-encoding",       HEADER_TRANSFER_ENCODING),
+    SLOT(23, "referer",                 HEADER_REFERER),
+    SLOT(24, "host",                    HEADER_HOST),
+    SLOT(25, "trailer",                 HEADER_TRAILER),
+    SLOT(27, "http2-settings",          HEADER_HTTP2_SETTINGS),
+    SLOT(36, "cache-control",           HEADER_CACHE_CONTROL),
+    SLOT(37, "x-forwarded-for",         HEADER_X_FORWARDED_FOR),
+    SLOT(43, "user-agent",              HEADER_USER_AGENT),
+    SLOT(44, "cookie",                  HEADER_COOKIE),
+    SLOT(47, "connection",              HEADER_CONNECTION),
+    SLOT(48, "authorization",           HEADER_AUTHORIZATION),
+    SLOT(50, "content-type",            HEADER_CONTENT_TYPE),
+    SLOT(51, "accept-language",         HEADER_ACCEPT_LANGUAGE),
+    SLOT(52, "if-range",                HEADER_IF_RANGE),
+    SLOT(56, "keep-alive",              HEADER_KEEP_ALIVE),
+    SLOT(57, "te",                      HEADER_TE),
+    SLOT(58, "range",                   HEADER_RANGE),
+    SLOT(61, "if-modified-since",       HEADER_IF_MODIFIED_SINCE),
+    SLOT(63, "upgrade",                 HEADER_UPGRADE),
+};
+
+/* Names of well-known headers by ID, in their usual spelling */
+static const char *Names[HEADER_KNOWN] = {
+    [HEADER_HOST]                   = "Host",
+    [HEADER_CONNECTION]             = "Connection",
+    [HEADER_KEEP_ALIVE]             = "Keep-Alive",
+    [HEADER_UPGRADE]                = "Upgrade",
+    [HEADER_HTTP2_SETTINGS]         = "HTTP2-Settings",
+    [HEADER_RANGE]                  = "Range",
+    [HEADER_IF_RANGE]               = "If-Range",
+    [HEADER_IF_NONE_MATCH]          = "If-None-Match",
+    [HEADER_IF_MODIFIED_SINCE]      = "If-Modified-Since",
+    [HEADER_ACCEPT]                 = "Accept",
+    [HEADER_ACCEPT_ENCODING]        = "Accept-Encoding",
+    [HEADER_ACCEPT_LANGUAGE]        = "Accept-Language",
+    [HEADER_CONTENT_LENGTH]         = "Content-Length",
+    [HEADER_CONTENT_TYPE]           = "Content-Type",
+    [HEADER_TRANSFER_ENCODING]      = "Transfer-Encoding",
+    [HEADER_TE]                     = "TE",
+    [HEADER_TRAILER]                = "Trailer",
+    [HEADER_USER_AGENT]             = "User-Agent",
+    [HEADER_REFERER]                = "Referer",
+    [HEADER_COOKIE]                 = "Cookie",
+    [HEADER_AUTHORIZATION]          = "Authorization",
+    [HEADER_PROXY_AUTHORIZATION]    = "Proxy-Authorization",
+    [HEADER_PROXY_CONNECTION]       = "Proxy-Connection",
+    [HEADER_X_FORWARDED_FOR]        = "X-Forwarded-For",
+    [HEADER_CACHE_CONTROL]          = "Cache-Control",
+};
+
+#ifndef NDEBUG
+/**
+ * Check that every well-known header sits in the slot its name hashes to.
+ **/
+__attribute__((constructor))
+static void header_init(void) {
+    size_t found = 0;
+    for (size_t slot = 0; slot < HEADER_SLOTS; slot++) {
+        const HeaderSlot *s = &Slots[slot];
+        if (s->name) {
+            if (HEADER_HASH(s->length, s->name[0], s->name[s->length - 1]) != slot ||
+                strcasecmp(s->name, Names[s->id]) != 0) {
+                fatal("Header %s is in the wrong slot (%zu)", s->name, slot);
+            }
+            found++;
+        }
+    }
+    if (found != HEADER_KNOWN) {
+        fatal("Header table has %zu of %d well-known headers", found, HEADER_KNOWN);
+    }
+}
+#endif
+
+/**
+ * Determine the ID of a header name.
+ *
+ * @param   name        Header name (any case).
+ * @param   length      Length of name.
+ * @return  Well-known header ID, or HEADER_OTHER.
+ **/
+HeaderId header_id(const char *name, size_t length) {
+    if (length == 0) {
+        return HEADER_OTHER;
+    }
+
+    const HeaderSlot *s = &Slots[HEADER_HASH(length, name[0], name[length - 1])];
+    if (s->length == length && strncasecmp(s->name, name, length) == 0) {
+        return s->id;
+    }
+    return HEADER_OTHER;
+}
+
+/**
+ * Return the usual spelling of a well-known header name.
+ **/
+const char *header_name(HeaderId id) {
+    return id < HEADER_KNOWN ? Names[id] : NULL;
+}
+
+/**
+ * Hash a header name into one of HEADER_BUCKETS, ignoring case (FNV-1a).
+ **/
+size_t header_bucket(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t)(*name | 0x20)) * 16777619u;
+    }
+    return hash % HEADER_BUCKETS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
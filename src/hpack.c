@@ -0,0 +1,570 @@
+/* hpack.c: HTTP/2 Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Constants */
+
+#define HPACK_STATIC_ENTRIES    61
+#define HPACK_ENTRY_OVERHEAD    32      /**< Per-entry size overhead (RFC 7541 4.1) */
+#define HUFFMAN_SYMBOLS         257     /**< 256 octets plus EOS */
+#define HUFFMAN_MAX_BITS        30
+
+/* Static Table (RFC 7541 Appendix A) */
+
+static const char *StaticTable[HPACK_STATIC_ENTRIES + 1][2] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* Huffman Code (RFC 7541 Appendix B): {code, length in bits} */
+
+static const struct {
+    uint32_t code;
+    uint8_t  length;
+} HuffmanCodes[HUFFMAN_SYMBOLS] = {
+    {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+    {0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+    {0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+    {0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+    {0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+    {0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+    {0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+    {0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+    {0x00000014,  6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+    {0x00001ff9, 13}, {0x00000015,  6}, {0x000000f8,  8}, {0x000007fa, 11},
+    {0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9,  8}, {0x000007fb, 11},
+    {0x000000fa,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+    {0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+    {0x0000001a,  6}, {0x0000001b,  6}, {0x0000001c,  6}, {0x0000001d,  6},
+    {0x0000001e,  6}, {0x0000001f,  6}, {0x0000005c,  7}, {0x000000fb,  8},
+    {0x00007ffc, 15}, {0x00000020,  6}, {0x00000ffb, 12}, {0x000003fc, 10},
+    {0x00001ffa, 13}, {0x00000021,  6}, {0x0000005d,  7}, {0x0000005e,  7},
+    {0x0000005f,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+    {0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+    {0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006a,  7},
+    {0x0000006b,  7}, {0x0000006c,  7}, {0x0000006d,  7}, {0x0000006e,  7},
+    {0x0000006f,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+    {0x000000fc,  8}, {0x00000073,  7}, {0x000000fd,  8}, {0x00001ffb, 13},
+    {0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022,  6},
+    {0x00007ffd, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+    {0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+    {0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+    {0x00000028,  6}, {0x00000029,  6}, {0x0000002a,  6}, {0x00000007,  5},
+    {0x0000002b,  6}, {0x00000076,  7}, {0x0000002c,  6}, {0x00000008,  5},
+    {0x00000009,  5}, {0x0000002d,  6}, {0x00000077,  7}, {0x00000078,  7},
+    {0x00000079,  7}, {0x0000007a,  7}, {0x0000007b,  7}, {0x00007ffe, 15},
+    {0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+    {0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+    {0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+    {0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+    {0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+    {0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+    {0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+    {0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+    {0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+    {0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+    {0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+    {0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+    {0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+    {0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+    {0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+    {0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+    {0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+    {0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+    {0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+    {0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+    {0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+    {0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+    {0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+    {0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+    {0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+    {0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+    {0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+    {0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+    {0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+    {0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+    {0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+    {0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+    {0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+/* Canonical decoding tables, built on first use */
+
+static uint16_t HuffmanSymbols[HUFFMAN_SYMBOLS];        /**< Symbols ordered by (length, code) */
+static uint32_t HuffmanFirst[HUFFMAN_MAX_BITS + 1];     /**< First code of each length */
+static uint16_t HuffmanCount[HUFFMAN_MAX_BITS + 1];     /**< Number of codes of each length */
+static uint16_t HuffmanOffset[HUFFMAN_MAX_BITS + 1];    /**< Index of first symbol of each length */
+static bool     HuffmanReady = false;
+
+/**
+ * Build canonical Huffman decoding tables.
+ *
+ * The HPACK code is canonical: codes of equal length are consecutive and
+ * assigned in symbol order, so decoding only needs the first code and the
+ * number of codes at each length.
+ **/
+static void huffman_init(void) {
+    size_t n = 0;
+
+    for (int length = 1; length <= HUFFMAN_MAX_BITS; length++) {
+        HuffmanOffset[length] = n;
+        for (int symbol = 0; symbol < HUFFMAN_SYMBOLS; symbol++) {
+            if (HuffmanCodes[symbol].length != length) {
+                continue;
+            }
+            if (HuffmanCount[length] == 0) {
+                HuffmanFirst[length] = HuffmanCodes[symbol].code;
+            }
+            HuffmanCount[length]++;
+            HuffmanSymbols[n++] = symbol;
+        }
+    }
+
+    HuffmanReady = true;
+}
+
+/**
+ * Decode Huffman-encoded string.
+ *
+ * @param   data        Encoded octets.
+ * @param   length      Number of encoded octets.
+ * @param   out         Output buffer (at least length * 8 / 5 + 1 bytes).
+ * @return  Number of decoded bytes or -1 on error.
+ **/
+static ssize_t huffman_decode(const uint8_t *data, size_t length, char *out) {
+    uint32_t code  = 0;
+    int      bits  = 0;
+    size_t   n     = 0;
+
+    if (!HuffmanReady) {
+        huffman_init();
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((data[i] >> b) & 1);
+            bits++;
+
+            if (HuffmanCount[bits] && code - HuffmanFirst[bits] < HuffmanCount[bits]) {
+                uint16_t symbol = HuffmanSymbols[HuffmanOffset[bits] + code - HuffmanFirst[bits]];
+                if (symbol == 256) {
+                    return -1;          /* EOS must not appear in a string */
+                }
+                out[n++] = symbol;
+                code = 0;
+                bits = 0;
+            } else if (bits == HUFFMAN_MAX_BITS) {
+                return -1;
+            }
+        }
+    }
+
+    /* Padding must be fewer than 8 bits, all ones (a prefix of EOS) */
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return -1;
+    }
+
+    return n;
+}
+
+/**
+ * Decode prefixed integer (RFC 7541 5.1).
+ *
+ * @param   p           Pointer to current position (advanced past integer).
+ * @param   end         End of input.
+ * @param   prefix      Number of prefix bits in the first octet.
+ * @param   value       Set to decoded value.
+ * @return  0 on success, -1 on error.
+ **/
+static int hpack_decode_integer(const uint8_t **p, const uint8_t *end, int prefix, size_t *value) {
+    size_t mask = (1u << prefix) - 1;
+
+    if (*p >= end) {
+        return -1;
+    }
+
+    *value = *(*p)++ & mask;
+    if (*value < mask) {
+        return 0;
+    }
+
+    for (int shift = 0; *p < end && shift < 28; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *value += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Decode string literal (RFC 7541 5.2) into a newly allocated string.
+ **/
+static char *hpack_decode_string(const uint8_t **p, const uint8_t *end) {
+    bool   huffman;
+    size_t length;
+
+    if (*p >= end) {
+        return NULL;
+    }
+    huffman = **p & 0x80;
+    if (hpack_decode_integer(p, end, 7, &length) < 0 || length > (size_t)(end - *p)) {
+        return NULL;
+    }
+
+    char *s = malloc(huffman ? length * 8 / 5 + 1 : length + 1);
+    if (!s) {
+        return NULL;
+    }
+
+    if (huffman) {
+        ssize_t n = huffman_decode(*p, length, s);
+        if (n < 0) {
+            free(s);
+            return NULL;
+        }
+        s[n] = '\0';
+    } else {
+        memcpy(s, *p, length);
+        s[length] = '\0';
+    }
+
+    *p += length;
+    return s;
+}
+
+/* Dynamic Table */
+
+static HpackEntry *hpack_entry(HpackTable *table, size_t index) {
+    /* Index 0 is the most recently inserted entry */
+    return &table->entries[(table->head + table->count - 1 - index) % table->capacity];
+}
+
+static void hpack_evict(HpackTable *table, size_t max_size) {
+    while (table->count && table->size > max_size) {
+        HpackEntry *oldest = &table->entries[table->head];
+        table->size -= strlen(oldest->name) + strlen(oldest->value) + HPACK_ENTRY_OVERHEAD;
+        free(oldest->name);
+        free(oldest->value);
+        table->head = (table->head + 1) % table->capacity;
+        table->count--;
+    }
+}
+
+static int hpack_insert(HpackTable *table, const char *name, const char *value) {
+    size_t size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+
+    hpack_evict(table, size > table->max_size ? 0 : table->max_size - size);
+    if (size > table->max_size) {
+        return 0;                       /* Too large: table is simply emptied */
+    }
+
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 16;
+        HpackEntry *entries = calloc(capacity, sizeof(HpackEntry));
+        if (!entries) {
+            return -1;
+        }
+        for (size_t i = 0; i < table->count; i++) {
+            entries[i] = table->entries[(table->head + i) % table->capacity];
+        }
+        free(table->entries);
+        table->entries  = entries;
+        table->capacity = capacity;
+        table->head     = 0;
+    }
+
+    HpackEntry *entry = &table->entries[(table->head + table->count) % table->capacity];
+    entry->name  = strdup(name);
+    entry->value = strdup(value);
+    if (!entry->name || !entry->value) {
+        free(entry->name);
+        free(entry->value);
+        return -1;
+    }
+    table->count++;
+    table->size += size;
+    return 0;
+}
+
+/**
+ * Initialize decoding context.
+ *
+ * @param   table       Dynamic table to initialize.
+ * @param   max_size    SETTINGS_HEADER_TABLE_SIZE advertised to the peer.
+ **/
+void hpack_init(HpackTable *table, size_t max_size) {
+    memset(table, 0, sizeof(HpackTable));
+    table->max_size      = max_size;
+    table->settings_size = max_size;
+}
+
+/**
+ * Release dynamic table entries.
+ *
+ * @param   table       Dynamic table.
+ **/
+void hpack_free(HpackTable *table) {
+    hpack_evict(table, 0);
+    free(table->entries);
+    memset(table, 0, sizeof(HpackTable));
+}
+
+/**
+ * Lookup name and value for an index into the combined static and dynamic
+ * address space (RFC 7541 2.3.3).
+ **/
+static int hpack_lookup(HpackTable *table, size_t index, const char **name, const char **value) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        *name  = StaticTable[index][0];
+        *value = StaticTable[index][1];
+        return 0;
+    }
+    if (index - HPACK_STATIC_ENTRIES > table->count) {
+        return -1;
+    }
+
+    HpackEntry *entry = hpack_entry(table, index - HPACK_STATIC_ENTRIES - 1);
+    *name  = entry->name;
+    *value = entry->value;
+    return 0;
+}
+
+/**
+ * Decode a complete header block.
+ *
+ * @param   table       Dynamic table for the connection.
+ * @param   data        Header block (HEADERS plus any CONTINUATION payloads).
+ * @param   length      Length of header block.
+ * @param   emit        Called with each decoded name and value.
+ * @param   ctx         Passed through to emit.
+ * @return  0 on success, -1 on a compression error.
+ **/
+int hpack_decode(HpackTable *table, const uint8_t *data, size_t length,
+                 int (*emit)(void *ctx, const char *name, const char *value), void *ctx) {
+    const uint8_t *p   = data;
+    const uint8_t *end = data + length;
+
+    while (p < end) {
+        uint8_t     byte = *p;
+        size_t      index;
+        const char *name;
+        const char *value;
+
+        if (byte & 0x80) {
+            /* Indexed header field */
+            if (hpack_decode_integer(&p, end, 7, &index) < 0 || hpack_lookup(table, index, &name, &value) < 0) {
+                return -1;
+            }
+            if (emit(ctx, name, value) < 0) {
+                return -1;
+            }
+        } else if ((byte & 0xe0) == 0x20) {
+            /* Dynamic table size update */
+            if (hpack_decode_integer(&p, end, 5, &index) < 0 || index > table->settings_size) {
+                return -1;
+            }
+            table->max_size = index;
+            hpack_evict(table, index);
+        } else {
+            /* Literal header field, with (01), without (0000) or never (0001) indexing */
+            bool  indexing = (byte & 0xc0) == 0x40;
+            char *literal_name = NULL;
+            char *literal_value;
+
+            if (hpack_decode_integer(&p, end, indexing ? 6 : 4, &index) < 0) {
+                return -1;
+            }
+            if (index) {
+                if (hpack_lookup(table, index, &name, &value) < 0) {
+                    return -1;
+                }
+            } else {
+                if (!(literal_name = hpack_decode_string(&p, end))) {
+                    return -1;
+                }
+                name = literal_name;
+            }
+
+            if (!(literal_value = hpack_decode_string(&p, end))) {
+                free(literal_name);
+                return -1;
+            }
+
+            int status = emit(ctx, name, literal_value);
+            if (status == 0 && indexing) {
+                /* Copy name first: inserting may evict the entry it came from */
+                char *copy = strdup(name);
+                status = copy ? hpack_insert(table, copy, literal_value) : -1;
+                free(copy);
+            }
+            free(literal_name);
+            free(literal_value);
+            if (status < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Encode prefixed integer (RFC 7541 5.1).
+ **/
+static size_t hpack_encode_integer(uint8_t *out, size_t size, uint8_t flags, int prefix, size_t value) {
+    size_t mask = (1u << prefix) - 1;
+    size_t n    = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if (value < mask) {
+        out[n++] = flags | value;
+        return n;
+    }
+
+    out[n++] = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        if (n == size) {
+            return 0;
+        }
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n == size) {
+        return 0;
+    }
+    out[n++] = value;
+    return n;
+}
+
+static size_t hpack_encode_string(uint8_t *out, size_t size, const char *s) {
+    size_t length = strlen(s);
+    size_t n      = hpack_encode_integer(out, size, 0x00, 7, length);
+
+    if (!n || size - n < length) {
+        return 0;
+    }
+    memcpy(out + n, s, length);
+    return n + length;
+}
+
+/**
+ * Encode one header field.
+ *
+ * @param   out         Output buffer.
+ * @param   size        Space left in output buffer.
+ * @param   name        Lowercase header name.
+ * @param   value       Header value.
+ * @return  Number of bytes written, or 0 if the buffer is too small.
+ *
+ * Exact static table matches are sent indexed; everything else is sent as a
+ * literal without indexing (reusing a static name index when possible), so
+ * the encoder never needs a dynamic table of its own.
+ **/
+size_t hpack_encode(uint8_t *out, size_t size, const char *name, const char *value) {
+    size_t name_index = 0;
+
+    for (size_t i = 1; i <= HPACK_STATIC_ENTRIES; i++) {
+        if (!streq(StaticTable[i][0], name)) {
+            continue;
+        }
+        if (streq(StaticTable[i][1], value)) {
+            return hpack_encode_integer(out, size, 0x80, 7, i);
+        }
+        if (!name_index) {
+            name_index = i;
+        }
+    }
+
+    size_t n = hpack_encode_integer(out, size, 0x00, 4, name_index);
+    if (!n) {
+        return 0;
+    }
+
+    if (!name_index) {
+        size_t m = hpack_encode_string(out + n, size - n, name);
+        if (!m) {
+            return 0;
+        }
+        n += m;
+    }
+
+    size_t m = hpack_encode_string(out + n, size - n, value);
+    return m ? n + m : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,1075 @@
+/* http2.c: HTTP/2 Cleartext (h2c) Connections */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define HTTP2_PREFACE           "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LENGTH    24
+#define HTTP2_FRAME_HEADER      9
+#define HTTP2_MAX_FRAME_SIZE    16384   /**< SETTINGS_MAX_FRAME_SIZE we accept */
+#define HTTP2_MAX_STREAMS       100     /**< SETTINGS_MAX_CONCURRENT_STREAMS */
+#define HTTP2_DEFAULT_WINDOW    65535
+#define HTTP2_HEADER_TABLE_SIZE 4096
+#define HTTP2_MAX_HEADER_BLOCK  65536
+#define HTTP2_MAX_HEAD          8192    /**< Largest HTTP/1 response head a handler may write */
+#define HTTP2_IDLE_TIMEOUT      5000    /**< Milliseconds to wait for the next frame */
+#define HTTP2_MAX_WINDOW        0x7fffffff
+#define HTTP2_MAX_PENDING       (256 * 1024)    /**< Response bytes queued before a handler waits on the connection window */
+#define HTTP2_MAX_BUFFER        (16 * 1024 * 1024)  /**< Response bytes queued before a handler waits regardless */
+
+typedef enum {
+    FRAME_DATA          = 0x0,
+    FRAME_HEADERS       = 0x1,
+    FRAME_PRIORITY      = 0x2,
+    FRAME_RST_STREAM    = 0x3,
+    FRAME_SETTINGS      = 0x4,
+    FRAME_PUSH_PROMISE  = 0x5,
+    FRAME_PING          = 0x6,
+    FRAME_GOAWAY        = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION  = 0x9,
+} FrameType;
+
+#define FLAG_END_STREAM         0x01
+#define FLAG_ACK                0x01
+#define FLAG_END_HEADERS        0x04
+#define FLAG_PADDED             0x08
+#define FLAG_PRIORITY           0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE      0x1
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define SETTINGS_MAX_FRAME_SIZE         0x5
+
+typedef enum {
+    ERROR_NONE                  = 0x0,
+    ERROR_PROTOCOL              = 0x1,
+    ERROR_INTERNAL              = 0x2,
+    ERROR_FLOW_CONTROL          = 0x3,
+    ERROR_FRAME_SIZE            = 0x6,
+    ERROR_REFUSED_STREAM        = 0x7,
+    ERROR_COMPRESSION           = 0x9,
+} ErrorCode;
+
+/* Structures */
+
+typedef struct Http2Connection Http2Connection;
+
+typedef struct {
+    Http2Connection *connection;
+    uint32_t    id;
+    int64_t     window;                 /**< Send window */
+    bool        ready;                  /**< Request complete, awaiting a handler */
+    bool        reset;                  /**< Peer reset the stream */
+    bool        end_stream;             /**< END_STREAM seen on HEADERS */
+    bool        headers_sent;           /**< Response HEADERS written */
+    bool        closed;                 /**< Handler finished: END_STREAM follows the pending body */
+    Request    *request;                /**< Request built from the header block */
+
+    uint8_t    *block;                  /**< Header block being reassembled */
+    size_t      block_length;
+
+    char        head[HTTP2_MAX_HEAD + 1];   /**< HTTP/1 response head from handler */
+    size_t      head_length;
+
+    char       *pending;                /**< Response body awaiting send window */
+    size_t      pending_offset;         /**< Bytes of pending already sent */
+    size_t      pending_length;
+    size_t      pending_capacity;
+} Http2Stream;
+
+struct Http2Connection {
+    Request    *request;                /**< Connection socket and input buffer */
+    HpackTable  decoder;                /**< Request header decompression state */
+    Http2Stream *streams[HTTP2_MAX_STREAMS];  /**< Open streams in creation order */
+    size_t      nstreams;
+    Http2Stream *active;                /**< Stream whose handler is running */
+    uint32_t    last_stream_id;         /**< Highest stream opened by the client */
+    uint32_t    continuation_id;        /**< Stream awaiting CONTINUATION (0 = none) */
+    int64_t     window;                 /**< Connection send window */
+    int64_t     initial_window;         /**< Peer SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t    max_frame;              /**< Peer SETTINGS_MAX_FRAME_SIZE */
+    bool        goaway;                 /**< Peer is going away */
+    ErrorCode   error;                  /**< Connection error to report */
+    bool        failed;                 /**< Connection unusable */
+    uint8_t     payload[HTTP2_MAX_FRAME_SIZE];
+};
+
+/* Frame I/O */
+
+static void put_uint32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static uint32_t get_uint32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Write one frame to the connection.
+ **/
+static bool http2_write_frame(Http2Connection *c, FrameType type, uint8_t flags, uint32_t id,
+                              const void *payload, size_t length) {
+    uint8_t header[HTTP2_FRAME_HEADER] = {
+        length >> 16, length >> 8, length, type, flags,
+    };
+    put_uint32(header + 5, id & 0x7fffffff);
+
+    struct iovec iov[] = {
+        {header, sizeof(header)},
+        {(void *)payload, length},
+    };
+
+    if (request_writev(c->request, iov, length ? 2 : 1) < 0) {
+        c->failed = true;
+        return false;
+    }
+    return true;
+}
+
+static void http2_connection_error(Http2Connection *c, ErrorCode error) {
+    debug("HTTP/2 connection error %d", error);
+    if (!c->error) {
+        c->error = error;
+    }
+    c->failed = true;
+}
+
+static void http2_reset_stream(Http2Connection *c, uint32_t id, ErrorCode error) {
+    uint8_t payload[4];
+    put_uint32(payload, error);
+    http2_write_frame(c, FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static void http2_window_update(Http2Connection *c, uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+    put_uint32(payload, increment);
+    http2_write_frame(c, FRAME_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * Read next frame from connection into c->payload.
+ *
+ * @return  Payload length, or -1 on EOF, timeout, or error.
+ **/
+static ssize_t http2_read_frame(Http2Connection *c, uint8_t *type, uint8_t *flags, uint32_t *id) {
+    Request *r = c->request;
+    uint8_t  header[HTTP2_FRAME_HEADER];
+
+    if (!request_wait(r, HTTP2_IDLE_TIMEOUT)) {
+        debug("HTTP/2 connection idle, closing");
+        return -1;
+    }
+
+    if (request_read(r, header, sizeof(header)) != sizeof(header)) {
+        return -1;
+    }
+
+    size_t length = ((size_t)header[0] << 16) | (header[1] << 8) | header[2];
+    *type  = header[3];
+    *flags = header[4];
+    *id    = get_uint32(header + 5) & 0x7fffffff;
+
+    if (length > HTTP2_MAX_FRAME_SIZE) {
+        http2_connection_error(c, ERROR_FRAME_SIZE);
+        return -1;
+    }
+
+    if (request_read(r, c->payload, length) != (ssize_t)length) {
+        return -1;
+    }
+
+    return length;
+}
+
+/* Streams */
+
+static Http2Stream *http2_find_stream(Http2Connection *c, uint32_t id) {
+    for (size_t i = 0; i < c->nstreams; i++) {
+        if (c->streams[i]->id == id) {
+            return c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void http2_remove_stream(Http2Connection *c, Http2Stream *s) {
+    for (size_t i = 0; i < c->nstreams; i++) {
+        if (c->streams[i] == s) {
+            memmove(&c->streams[i], &c->streams[i + 1], (c->nstreams - i - 1) * sizeof(Http2Stream *));
+            c->nstreams--;
+            break;
+        }
+    }
+
+    free_request(s->request);
+    free(s->block);
+    free(s->pending);
+    free(s);
+}
+
+static Http2Stream *http2_open_stream(Http2Connection *c, uint32_t id) {
+    Http2Stream *s = calloc(1, sizeof(Http2Stream));
+    if (!s) {
+        return NULL;
+    }
+
+    s->request = calloc(1, sizeof(Request));
+    if (!s->request) {
+        free(s);
+        return NULL;
+    }
+
+    s->connection  = c;
+    s->id          = id;
+    s->window      = c->initial_window;
+    s->request->fd = -1;
+    strcpy(s->request->host, c->request->host);
+    strcpy(s->request->port, c->request->port);
+    s->request->trace = trace_request();
+
+    c->streams[c->nstreams++] = s;
+    return s;
+}
+
+/**
+ * Add decoded header field to the stream's request.
+ **/
+static int http2_stream_header(void *ctx, const char *name, const char *value) {
+    Request *r = ctx;
+
+    if (name[0] == ':') {
+        if (streq(name, ":method") && !r->method) {
+            r->method = strdup(value);
+        } else if (streq(name, ":path") && !r->uri) {
+            const char *query = strchr(value, '?');
+            r->uri   = query ? strndup(value, query - value) : strdup(value);
+            r->query = strdup(query ? query + 1 : "");
+        } else if (streq(name, ":authority")) {
+            return request_add_header(r, "Host", value);
+        }
+        return 0;
+    }
+
+    return request_add_header(r, name, value);
+}
+
+/**
+ * Decode the reassembled header block once END_HEADERS arrives.
+ **/
+static void http2_finish_headers(Http2Connection *c, Http2Stream *s) {
+    Request scratch = {0};
+    Request *target = s->request->method ? &scratch : s->request;   /* Trailers are decoded and dropped */
+
+    c->continuation_id = 0;
+    if (hpack_decode(&c->decoder, s->block, s->block_length, http2_stream_header, target) < 0) {
+        http2_connection_error(c, ERROR_COMPRESSION);
+    }
+    free(s->block);
+    s->block = NULL;
+    s->block_length = 0;
+
+    request_free_headers(&scratch);
+    free(scratch.method);
+    free(scratch.uri);
+    free(scratch.query);
+
+    if (s->end_stream) {
+        s->ready = true;
+        log("HTTP/2 stream %u: %s %s", s->id, s->request->method, s->request->uri);
+    }
+}
+
+static bool http2_append_block(Http2Connection *c, Http2Stream *s, const uint8_t *data, size_t length) {
+    if (s->block_length + length > HTTP2_MAX_HEADER_BLOCK) {
+        http2_connection_error(c, ERROR_PROTOCOL);
+        return false;
+    }
+
+    uint8_t *block = realloc(s->block, s->block_length + length);
+    if (!block && s->block_length + length) {
+        http2_connection_error(c, ERROR_INTERNAL);
+        return false;
+    }
+    memcpy(block + s->block_length, data, length);
+    s->block = block;
+    s->block_length += length;
+    return true;
+}
+
+/* Frame Processing */
+
+static void http2_process_headers(Http2Connection *c, uint8_t flags, uint32_t id, size_t length) {
+    const uint8_t *p = c->payload;
+    size_t pad = 0;
+
+    if (flags & FLAG_PADDED) {
+        if (length < 1) {
+            http2_connection_error(c, ERROR_PROTOCOL);
+            return;
+        }
+        pad = *p++;
+        length--;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (length < 5) {
+            http2_connection_error(c, ERROR_PROTOCOL);
+            return;
+        }
+        p += 5;
+        length -= 5;
+    }
+    if (pad > length || id == 0) {
+        http2_connection_error(c, ERROR_PROTOCOL);
+        return;
+    }
+    length -= pad;
+
+    Http2Stream *s = http2_find_stream(c, id);
+    bool refused = false;
+    if (!s) {
+        if (!(id & 1) || id <= c->last_stream_id) {
+            http2_connection_error(c, ERROR_PROTOCOL);
+            return;
+        }
+        c->last_stream_id = id;
+
+        /* Refused streams are still decoded to keep HPACK state in sync */
+        refused = c->goaway || c->nstreams == HTTP2_MAX_STREAMS;
+        if (refused) {
+            Http2Stream scratch = {.connection = c, .id = id};
+            Request     request = {0};
+            scratch.request = &request;
+            if (!http2_append_block(c, &scratch, p, length)) {
+                return;
+            }
+            if (!(flags & FLAG_END_HEADERS)) {
+                /* Refusing a stream mid-block is not worth the bookkeeping */
+                free(scratch.block);
+                http2_connection_error(c, ERROR_PROTOCOL);
+                return;
+            }
+            scratch.request = calloc(1, sizeof(Request));
+            if (scratch.request) {
+                scratch.request->fd = -1;
+                http2_finish_headers(c, &scratch);
+                free_request(scratch.request);
+            }
+            free(scratch.block);
+            http2_reset_stream(c, id, ERROR_REFUSED_STREAM);
+            return;
+        }
+
+        if (!(s = http2_open_stream(c, id))) {
+            http2_connection_error(c, ERROR_INTERNAL);
+            return;
+        }
+    }
+
+    s->end_stream = flags & FLAG_END_STREAM;
+    if (!http2_append_block(c, s, p, length)) {
+        return;
+    }
+
+    if (flags & FLAG_END_HEADERS) {
+        http2_finish_headers(c, s);
+    } else {
+        c->continuation_id = id;
+    }
+}
+
+static void http2_process_settings(Http2Connection *c, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    if (id != 0 || length % 6) {
+        http2_connection_error(c, id ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+        return;
+    }
+    if (flags & FLAG_ACK) {
+        return;
+    }
+
+    for (size_t i = 0; i < length; i += 6) {
+        uint16_t setting = (p[i] << 8) | p[i + 1];
+        uint32_t value   = get_uint32(p + i + 2);
+
+        if (setting == SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > HTTP2_MAX_WINDOW) {
+                http2_connection_error(c, ERROR_FLOW_CONTROL);
+                return;
+            }
+            /* Changing the initial window adjusts every open stream */
+            for (size_t s = 0; s < c->nstreams; s++) {
+                c->streams[s]->window += (int64_t)value - c->initial_window;
+                if (c->streams[s]->window > HTTP2_MAX_WINDOW) {
+                    http2_connection_error(c, ERROR_FLOW_CONTROL);
+                    return;
+                }
+            }
+            c->initial_window = value;
+        } else if (setting == SETTINGS_MAX_FRAME_SIZE) {
+            if (value < 16384 || value > 16777215) {
+                http2_connection_error(c, ERROR_PROTOCOL);
+                return;
+            }
+            c->max_frame = value;
+        }
+    }
+}
+
+/**
+ * Process one frame read from the connection.
+ **/
+static void http2_process_frame(Http2Connection *c, uint8_t type, uint8_t flags, uint32_t id, size_t length) {
+    Http2Stream *s;
+    uint32_t     increment;
+
+    if (c->continuation_id && (type != FRAME_CONTINUATION || id != c->continuation_id)) {
+        http2_connection_error(c, ERROR_PROTOCOL);
+        return;
+    }
+
+    switch (type) {
+        case FRAME_HEADERS:
+            http2_process_headers(c, flags, id, length);
+            break;
+
+        case FRAME_CONTINUATION:
+            if (!c->continuation_id || !(s = http2_find_stream(c, id))) {
+                http2_connection_error(c, ERROR_PROTOCOL);
+                break;
+            }
+            if (http2_append_block(c, s, c->payload, length) && (flags & FLAG_END_HEADERS)) {
+                http2_finish_headers(c, s);
+            }
+            break;
+
+        case FRAME_DATA:
+            /* Request bodies are not used by any handler: consume them and
+             * give the flow-control credit straight back */
+            if (id == 0) {
+                http2_connection_error(c, ERROR_PROTOCOL);
+                break;
+            }
+            if (length) {
+                http2_window_update(c, 0, length);
+            }
+            if ((s = http2_find_stream(c, id)) && !s->ready) {
+                if (length && !(flags & FLAG_END_STREAM)) {
+                    http2_window_update(c, id, length);
+                }
+                if (flags & FLAG_END_STREAM) {
+                    s->ready = true;
+                    log("HTTP/2 stream %u: %s %s", s->id, s->request->method, s->request->uri);
+                }
+            }
+            break;
+
+        case FRAME_RST_STREAM:
+            if ((s = http2_find_stream(c, id))) {
+                s->reset = true;
+                if (s != c->active) {
+                    http2_remove_stream(c, s);
+                }
+            }
+            break;
+
+        case FRAME_SETTINGS:
+            http2_process_settings(c, flags, id, c->payload, length);
+            if (!c->failed && !(flags & FLAG_ACK)) {
+                http2_write_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+            }
+            break;
+
+        case FRAME_PING:
+            if (length != 8) {
+                http2_connection_error(c, ERROR_FRAME_SIZE);
+            } else if (!(flags & FLAG_ACK)) {
+                http2_write_frame(c, FRAME_PING, FLAG_ACK, 0, c->payload, 8);
+            }
+            break;
+
+        case FRAME_GOAWAY:
+            c->goaway = true;
+            break;
+
+        case FRAME_WINDOW_UPDATE:
+            if (length != 4) {
+                http2_connection_error(c, ERROR_FRAME_SIZE);
+                break;
+            }
+            increment = get_uint32(c->payload) & 0x7fffffff;
+            if (id == 0) {
+                /* A window may never exceed 2^31-1 (RFC 9113 6.9.1) */
+                if (!increment || c->window + increment > HTTP2_MAX_WINDOW) {
+                    http2_connection_error(c, increment ? ERROR_FLOW_CONTROL : ERROR_PROTOCOL);
+                    break;
+                }
+                c->window += increment;
+            } else if ((s = http2_find_stream(c, id))) {
+                if (!increment || s->window + increment > HTTP2_MAX_WINDOW) {
+                    http2_reset_stream(c, id, increment ? ERROR_FLOW_CONTROL : ERROR_PROTOCOL);
+                    s->reset = true;
+                    if (s != c->active) {
+                        http2_remove_stream(c, s);
+                    }
+                    break;
+                }
+                s->window += increment;
+            }
+            break;
+
+        case FRAME_PUSH_PROMISE:
+            http2_connection_error(c, ERROR_PROTOCOL);
+            break;
+
+        default:
+            /* PRIORITY and unknown frame types are ignored */
+            break;
+    }
+}
+
+/**
+ * Read and process one frame.
+ *
+ * @return  false if the connection is finished.
+ **/
+static bool http2_pump(Http2Connection *c) {
+    uint8_t  type, flags;
+    uint32_t id;
+    ssize_t  length = http2_read_frame(c, &type, &flags, &id);
+
+    if (length < 0) {
+        c->failed = true;
+        return false;
+    }
+
+    http2_process_frame(c, type, flags, id, length);
+    return !c->failed;
+}
+
+/* Responses */
+
+/**
+ * Queue response body bytes on a stream until its windows allow sending.
+ **/
+static bool http2_queue_data(Http2Stream *s, const char *data, size_t length) {
+    if (s->pending_offset == s->pending_length) {
+        s->pending_offset = s->pending_length = 0;
+    }
+
+    if (s->pending_length + length > s->pending_capacity) {
+        memmove(s->pending, s->pending + s->pending_offset, s->pending_length - s->pending_offset);
+        s->pending_length -= s->pending_offset;
+        s->pending_offset  = 0;
+
+        size_t capacity = s->pending_capacity ? s->pending_capacity : HTTP2_MAX_FRAME_SIZE;
+        while (capacity < s->pending_length + length) {
+            capacity *= 2;
+        }
+        if (capacity != s->pending_capacity) {
+            char *pending = realloc(s->pending, capacity);
+            if (!pending) {
+                return false;
+            }
+            s->pending          = pending;
+            s->pending_capacity = capacity;
+        }
+    }
+
+    memcpy(s->pending + s->pending_length, data, length);
+    s->pending_length += length;
+    return true;
+}
+
+/**
+ * Send queued DATA, one frame per stream in turn, while the connection
+ * window lasts.
+ *
+ * Each pass gives every stream with pending body and stream window one
+ * frame, so a stream waiting on its own WINDOW_UPDATE does not hold up the
+ * others.  Streams whose handler finished are removed once END_STREAM is
+ * sent.
+ **/
+static void http2_flush(Http2Connection *c) {
+    bool sent = true;
+
+    while (sent && c->window > 0 && !c->failed) {
+        sent = false;
+        for (size_t i = 0; i < c->nstreams && c->window > 0; i++) {
+            Http2Stream *s = c->streams[i];
+            size_t       n = s->pending_length - s->pending_offset;
+            if (!n || s->window <= 0 || s->reset) {
+                continue;
+            }
+
+            size_t  remaining = n;
+            n = n < c->max_frame ? n : c->max_frame;
+            n = (int64_t)n < c->window ? n : (size_t)c->window;
+            n = (int64_t)n < s->window ? n : (size_t)s->window;
+
+            uint8_t flags = s->closed && n == remaining ? FLAG_END_STREAM : 0;
+            if (!http2_write_frame(c, FRAME_DATA, flags, s->id, s->pending + s->pending_offset, n)) {
+                return;
+            }
+            c->window         -= n;
+            s->window         -= n;
+            s->pending_offset += n;
+            sent = true;
+        }
+    }
+
+    for (size_t i = 0; i < c->nstreams;) {
+        Http2Stream *s = c->streams[i];
+        if (s->closed && s->pending_offset == s->pending_length) {
+            http2_remove_stream(c, s);
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * Determine whether any stream still has response body to send.
+ **/
+static bool http2_sending(Http2Connection *c) {
+    for (size_t i = 0; i < c->nstreams; i++) {
+        if (c->streams[i]->pending_offset < c->streams[i]->pending_length) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Queue DATA for the stream whose handler is running and send what the
+ * windows allow.
+ *
+ * The handler only waits (processing incoming frames meanwhile) when the
+ * connection window is exhausted and HTTP2_MAX_PENDING bytes are queued.
+ * A stream out of its own window keeps queueing, up to HTTP2_MAX_BUFFER,
+ * so its handler returns and the next stream's can run.
+ **/
+static bool http2_send_data(Http2Connection *c, Http2Stream *s, const char *data, size_t length) {
+    if (!http2_queue_data(s, data, length)) {
+        http2_reset_stream(c, s->id, ERROR_INTERNAL);
+        s->reset = true;
+        return false;
+    }
+
+    http2_flush(c);
+    while (s->pending_length - s->pending_offset > (c->window > 0 ? HTTP2_MAX_BUFFER : HTTP2_MAX_PENDING)) {
+        if (!http2_pump(c) || s->reset) {
+            return false;
+        }
+        http2_flush(c);
+    }
+    return !c->failed;
+}
+
+static bool http2_skip_header(const char *name) {
+    static const char *ConnectionHeaders[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", NULL,
+    };
+
+    for (const char **header = ConnectionHeaders; *header; header++) {
+        if (streq(name, *header)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Translate the HTTP/1 response head a handler wrote into a HEADERS frame
+ * (plus CONTINUATIONs if it exceeds the peer's frame size).
+ *
+ * The head is either a status line followed by headers, as written by the
+ * file, browse and error handlers and the bundled scripts, or bare CGI
+ * headers with an optional Status: header.
+ **/
+static bool http2_send_headers(Http2Connection *c, Http2Stream *s, char *head, bool end_stream) {
+    uint8_t block[HTTP2_MAX_HEAD * 2];
+    size_t  length = 0;
+    char    status[4] = "200";
+    char   *line = head;
+
+    /* Status line or CGI Status header */
+    if (strncmp(head, "HTTP/", 5) == 0) {
+        char *code = skip_whitespace(skip_nonwhitespace(head));
+        snprintf(status, sizeof(status), "%.3s", code);
+        line = strchr(head, '\n');
+        line = line ? line + 1 : head + strlen(head);
+    }
+    for (char *p = line; *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : p + strlen(p)) {
+        if (strncasecmp(p, "Status:", 7) == 0) {
+            snprintf(status, sizeof(status), "%.3s", skip_whitespace(p + 7));
+        }
+    }
+
+    length += hpack_encode(block + length, sizeof(block) - length, ":status", status);
+
+    while (*line) {
+        char *end = strchr(line, '\n');
+        char *next = end ? end + 1 : line + strlen(line);
+        if (end) {
+            *end = '\0';
+            if (end > line && end[-1] == '\r') {
+                end[-1] = '\0';
+            }
+        }
+
+        char *colon = strchr(line, ':');
+        if (colon) {
+            *colon = '\0';
+            for (char *n = line; *n; n++) {
+                *n = tolower((unsigned char)*n);
+            }
+            if (!http2_skip_header(line) && !streq(line, "status")) {
+                size_t n = hpack_encode(block + length, sizeof(block) - length, line, skip_whitespace(colon + 1));
+                if (!n) {
+                    return false;
+                }
+                length += n;
+            }
+        }
+        line = next;
+    }
+
+    /* Split into HEADERS and CONTINUATION frames */
+    size_t offset = 0;
+    do {
+        size_t  n     = length - offset < c->max_frame ? length - offset : c->max_frame;
+        uint8_t flags = (offset + n == length ? FLAG_END_HEADERS : 0) |
+                        (offset == 0 && end_stream ? FLAG_END_STREAM : 0);
+        if (!http2_write_frame(c, offset ? FRAME_CONTINUATION : FRAME_HEADERS, flags, s->id, block + offset, n)) {
+            return false;
+        }
+        offset += n;
+    } while (offset < length);
+
+    s->headers_sent = true;
+    return true;
+}
+
+/**
+ * fopencookie write function for a stream's response.
+ *
+ * Buffers the HTTP/1 response head, converts it to HEADERS once complete,
+ * and frames everything after it as DATA.
+ **/
+static ssize_t http2_stream_write(void *cookie, const char *buffer, size_t size) {
+    Http2Stream     *s = cookie;
+    Http2Connection *c = s->connection;
+    size_t consumed = 0;
+
+    if (s->reset || c->failed) {
+        return 0;
+    }
+
+    if (!s->headers_sent) {
+        size_t n = HTTP2_MAX_HEAD - s->head_length;
+        n = n < size ? n : size;
+        memcpy(s->head + s->head_length, buffer, n);
+        s->head_length += n;
+        s->head[s->head_length] = '\0';
+        consumed = n;
+
+        /* Find blank line ending the head (CRLF or bare LF) */
+        char *end = NULL;
+        size_t skip = 0;
+        for (char *lf = strchr(s->head, '\n'); lf; lf = strchr(lf + 1, '\n')) {
+            if (lf[1] == '\n') {
+                end = lf + 1, skip = 1;
+                break;
+            }
+            if (lf[1] == '\r' && lf[2] == '\n') {
+                end = lf + 1, skip = 2;
+                break;
+            }
+        }
+
+        if (!end) {
+            if (s->head_length == HTTP2_MAX_HEAD) {
+                http2_reset_stream(c, s->id, ERROR_INTERNAL);
+                s->reset = true;
+                return 0;
+            }
+            return size;
+        }
+
+        size_t head_length = end - s->head;
+        size_t body_length = s->head_length - head_length - skip;
+        *end = '\0';
+
+        if (!http2_send_headers(c, s, s->head, false) ||
+            (body_length && !http2_send_data(c, s, end + skip, body_length))) {
+            return 0;
+        }
+    }
+
+    if (size > consumed && !http2_send_data(c, s, buffer + consumed, size - consumed)) {
+        return 0;
+    }
+    return size;
+}
+
+/**
+ * fopencookie close function: end the stream, or mark it for http2_flush
+ * to end once its queued body is sent.
+ **/
+static int http2_stream_close(void *cookie) {
+    Http2Stream     *s = cookie;
+    Http2Connection *c = s->connection;
+
+    if (s->reset || c->failed) {
+        return 0;
+    }
+
+    if (!s->headers_sent) {
+        if (!s->head_length) {
+            strcpy(s->head, "HTTP/1.0 500 Internal Server Error\r\n");
+        }
+        http2_send_headers(c, s, s->head, true);
+    } else if (s->pending_offset == s->pending_length) {
+        http2_write_frame(c, FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0);
+    } else {
+        s->closed = true;
+    }
+    return 0;
+}
+
+/**
+ * Run the existing request handlers for a completed stream.
+ *
+ * The stream stays open after its handler returns while it has queued body
+ * left to send.
+ **/
+static void http2_respond(Http2Connection *c, Http2Stream *s) {
+    Request *r = s->request;
+    cookie_io_functions_t functions = {
+        .write = http2_stream_write,
+        .close = http2_stream_close,
+    };
+
+    c->active = s;
+    s->ready  = false;
+    r->stream = fopencookie(s, "w", functions);
+    if (!r->stream) {
+        http2_reset_stream(c, s->id, ERROR_INTERNAL);
+    } else {
+        setvbuf(r->stream, NULL, _IOFBF, HTTP2_MAX_FRAME_SIZE);
+        if (!r->method || !r->uri) {
+            handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        } else {
+            dispatch_request(r);
+        }
+        fclose(r->stream);
+        r->stream = NULL;
+    }
+    c->active = NULL;
+
+    if (!s->closed) {
+        http2_remove_stream(c, s);
+    }
+}
+
+/* Connection Setup */
+
+/**
+ * Decode base64url (RFC 4648 5, unpadded) as used by HTTP2-Settings.
+ **/
+static ssize_t base64url_decode(const char *s, uint8_t *out, size_t size) {
+    uint32_t bits = 0;
+    int      nbits = 0;
+    size_t   n = 0;
+
+    for (; *s && *s != '='; s++) {
+        int value;
+        if      (*s >= 'A' && *s <= 'Z') value = *s - 'A';
+        else if (*s >= 'a' && *s <= 'z') value = *s - 'a' + 26;
+        else if (*s >= '0' && *s <= '9') value = *s - '0' + 52;
+        else if (*s == '-' || *s == '+') value = 62;
+        else if (*s == '_' || *s == '/') value = 63;
+        else return -1;
+
+        bits = (bits << 6) | value;
+        nbits += 6;
+        if (nbits >= 8) {
+            if (n == size) {
+                return -1;
+            }
+            nbits -= 8;
+            out[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+/**
+ * Determine whether request starts an HTTP/2 connection.
+ *
+ * @param   r           Parsed HTTP/1 request.
+ * @return  true for the prior-knowledge preface (PRI * HTTP/2.0) or an
+ *          h2c Upgrade request carrying HTTP2-Settings.
+ **/
+bool http2_requested(Request *r) {
+    if (streq(r->method, "PRI") && streq(r->uri, "*")) {
+        return true;
+    }
+
+    const char *upgrade = request_known_header(r, HEADER_UPGRADE);
+    if (!upgrade || !request_known_header(r, HEADER_HTTP2_SETTINGS)) {
+        return false;
+    }
+
+    /* Upgrade: h2c (possibly among other protocols) */
+    for (const char *p = upgrade; (p = strcasestr(p, "h2c")); p += 3) {
+        if ((p == upgrade || p[-1] == ' ' || p[-1] == ',') && (p[3] == '\0' || p[3] == ' ' || p[3] == ',')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Handle HTTP/2 connection.
+ *
+ * @param   r           Request that began the connection (preface or
+ *                      Upgrade request).
+ * @return  Status of the connection.
+ *
+ * Streams are read as frames arrive and their requests are handed, in the
+ * order they complete, to the same handlers used for HTTP/1.  Each handler
+ * writes through a stdio stream that frames its output; the body is queued
+ * on the stream and sent as DATA round-robin across all streams with send
+ * window, so a stream blocked on its own flow control does not stall the
+ * others.
+ **/
+Status handle_http2(Request *r) {
+    Http2Connection *c = calloc(1, sizeof(Http2Connection));
+    if (!c) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    c->request        = r;
+    c->window         = HTTP2_DEFAULT_WINDOW;
+    c->initial_window = HTTP2_DEFAULT_WINDOW;
+    c->max_frame      = 16384;
+    hpack_init(&c->decoder, HTTP2_HEADER_TABLE_SIZE);
+
+    bool upgrade = !streq(r->method, "PRI");
+    char preface[HTTP2_PREFACE_LENGTH];
+
+    /* Small frames (SETTINGS acks, WINDOW_UPDATEs, the end of a window's
+     * DATA) must not wait for Nagle behind the peer's delayed ACK (fails
+     * harmlessly on Unix sockets) */
+    int one = 1;
+    setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (upgrade) {
+        static const char Switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+        /* HTTP2-Settings counts as the client's first SETTINGS frame */
+        ssize_t length = base64url_decode(request_known_header(r, HEADER_HTTP2_SETTINGS), c->payload, sizeof(c->payload));
+        if (length < 0 || length % 6) {
+            hpack_free(&c->decoder);
+            free(c);
+            return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        }
+        http2_process_settings(c, 0, 0, c->payload, length);
+
+        if (request_write(r, Switching, sizeof(Switching) - 1, 0) < 0) {
+            goto done;
+        }
+
+        /* The upgraded request becomes stream 1, already half-closed */
+        Http2Stream *s = http2_open_stream(c, 1);
+        if (!s) {
+            goto done;
+        }
+        s->request->method  = r->method;
+        s->request->uri     = r->uri;
+        s->request->query   = r->query;
+        s->request->headers = r->headers;
+        s->request->table   = r->table;
+        r->method = r->uri = r->query = NULL;
+        r->headers = NULL;
+        memset(&r->table, 0, sizeof(r->table));
+        s->ready = true;
+        c->last_stream_id = 1;
+        log("HTTP/2 stream 1 (upgrade): %s %s", s->request->method, s->request->uri);
+    }
+
+    /* Server preface: our SETTINGS */
+    uint8_t settings[12];
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_uint32(settings + 2, HTTP2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = SETTINGS_HEADER_TABLE_SIZE;
+    put_uint32(settings + 8, HTTP2_HEADER_TABLE_SIZE);
+    if (!http2_write_frame(c, FRAME_SETTINGS, 0, 0, settings, sizeof(settings))) {
+        goto done;
+    }
+
+    /* Client preface: the request line and blank line were already parsed
+     * for prior knowledge, leaving "SM\r\n\r\n" */
+    size_t skip = upgrade ? 0 : HTTP2_PREFACE_LENGTH - 6;
+    if (request_read(r, preface + skip, HTTP2_PREFACE_LENGTH - skip) != (ssize_t)(HTTP2_PREFACE_LENGTH - skip) ||
+        memcmp(preface + skip, HTTP2_PREFACE + skip, HTTP2_PREFACE_LENGTH - skip) != 0) {
+        debug("Invalid HTTP/2 client preface");
+        http2_connection_error(c, ERROR_PROTOCOL);
+        goto done;
+    }
+
+    while (!c->failed) {
+        Http2Stream *ready = NULL;
+        for (size_t i = 0; i < c->nstreams && !ready; i++) {
+            if (c->streams[i]->ready) {
+                ready = c->streams[i];
+            }
+        }
+
+        if (ready) {
+            http2_respond(c, ready);
+        } else if (c->goaway && !c->continuation_id && !http2_sending(c)) {
+            break;
+        } else if (!http2_pump(c)) {
+            break;
+        }
+        http2_flush(c);
+    }
+
+done:
+    if (c->error || !c->failed) {
+        uint8_t goaway[8];
+        put_uint32(goaway, c->last_stream_id);
+        put_uint32(goaway + 4, c->error);
+        http2_write_frame(c, FRAME_GOAWAY, 0, 0, goaway, sizeof(goaway));
+    }
+
+    while (c->nstreams) {
+        http2_remove_stream(c, c->streams[0]);
+    }
+    hpack_free(&c->decoder);
+    free(c);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
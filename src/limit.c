@@ -0,0 +1,285 @@
+/* limit.c: Per-Client Rate and Connection Limits */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/* Constants */
+
+#define LIMIT_SLOTS     8192            /**< Clients tracked (power of two) */
+#define LIMIT_PROBES    8               /**< Slots searched for a client */
+
+/* Structures */
+
+/**
+ * Token bucket of one client.  The bucket is kept as the time its next
+ * token is due (GCRA's theoretical arrival time): it is full once the clock
+ * passes tat, and each request pushes tat one interval further, so a single
+ * compare-and-swap takes a token.
+ **/
+struct limit_slot {
+    uint64_t    key;                    /**< Hash of client host (0 = free) */
+    uint64_t    tat;                    /**< Nanosecond the bucket is full again */
+    uint32_t    connections;            /**< Connections open from client */
+};
+
+/* Global Variables */
+
+static double   LimitRate = -1;         /**< Requests per second per client (-1 = no limits) */
+static uint64_t LimitBurst = 1;         /**< Requests allowed at once */
+static uint32_t LimitConnections = 0;   /**< Connections per client (0 = unlimited) */
+
+static uint64_t Interval = 0;           /**< Nanoseconds per token (0 = no rate limit) */
+static uint64_t Tolerance = 0;          /**< How far tat may run ahead of the clock */
+static LimitSlot *Slots = NULL;         /**< Table shared by all server processes */
+static uint32_t *Held = NULL;           /**< Connections each worker counts in each slot */
+
+static char     TooManyRequests[256];   /**< Precomputed rejection */
+static size_t   TooManyRequestsLength = 0;
+
+/**
+ * Configure client limits from RATE[,BURST[,CONNECTIONS]].
+ *
+ * @param   spec        Requests per second (0 = only limit connections),
+ *                      requests allowed in a burst (default: one second's
+ *                      worth) and connections open at once (default:
+ *                      unlimited).
+ * @return  true if spec is valid.
+ **/
+bool limit_configure(const char *spec) {
+    char *end;
+
+    LimitRate = strtod(spec, &end);
+    if (end == spec || LimitRate < 0) {
+        return false;
+    }
+    LimitBurst = LimitRate > 1 ? (uint64_t)LimitRate : 1;
+    if (*end == ',') {
+        LimitBurst = strtoull(end + 1, &end, 10);
+    }
+    if (*end == ',') {
+        LimitConnections = strtoul(end + 1, &end, 10);
+    }
+    return *end == '\0' && LimitBurst > 0 && (LimitRate > 0 || LimitConnections > 0);
+}
+
+/**
+ * Map the table of clients and render the rejection.
+ *
+ * @return  0 on success (or if limits are disabled), -1 on error.
+ *
+ * Must be called before the server forks so every process enforces the
+ * same limits.
+ **/
+int limit_init(void) {
+    if (LimitRate < 0) {
+        return 0;
+    }
+
+    Slots = mmap(NULL, LIMIT_SLOTS * sizeof(LimitSlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Slots == MAP_FAILED) {
+        fprintf(stderr, "Unable to map client limits: %s\n", strerror(errno));
+        Slots = NULL;
+        return -1;
+    }
+
+    /* A prefork worker that dies cannot release its connections, so each
+     * worker's share of every count is kept for limit_reclaim */
+    if (LimitConnections) {
+        Held = mmap(NULL, Workers * LIMIT_SLOTS * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (Held == MAP_FAILED) {
+            fprintf(stderr, "Unable to map client limits: %s\n", strerror(errno));
+            Held = NULL;
+            return -1;
+        }
+    }
+
+    Interval  = LimitRate > 0 ? (uint64_t)(1e9 / LimitRate) : 0;
+    Tolerance = (LimitBurst - 1) * Interval;
+
+    const char *body = "Too Many Requests\n";
+    TooManyRequestsLength = snprintf(TooManyRequests, sizeof(TooManyRequests),
+        "HTTP/1.0 429 Too Many Requests\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %zu\r\n"
+        "Retry-After: %lu\r\n"
+        "\r\n"
+        "%s", strlen(body), Interval > 1000000000 ? (unsigned long)((Interval + 999999999) / 1000000000) : 1UL, body);
+
+    log("Limiting clients to %g requests/s (burst %lu) and %u connections each (0 = no limit)",
+        LimitRate, (unsigned long)LimitBurst, LimitConnections);
+    return 0;
+}
+
+/**
+ * Hash client host (FNV-1a; never 0, which marks a free slot).
+ **/
+static uint64_t limit_hash(const char *host) {
+    uint64_t hash = fnv1a(FNV1A_BASIS, host, strlen(host));
+    return hash ? hash : 1;
+}
+
+/**
+ * Current time in nanoseconds (CLOCK_MONOTONIC is the same in every process).
+ **/
+static uint64_t limit_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Find (or claim) the slot of a client.
+ *
+ * @param   key         Hash of client host.
+ * @param   now         Current time.
+ * @return  Slot, or NULL if every slot the client may use is busy.
+ *
+ * Slots are claimed with compare-and-swap and never freed, so a client is
+ * always found before the first free slot of its probe sequence.  When the
+ * sequence is full, a client whose bucket has refilled and who has no open
+ * connections gives up its slot: it is owed nothing, so the newcomer can
+ * take over its state as is.
+ **/
+static LimitSlot *limit_slot(uint64_t key, uint64_t now) {
+    LimitSlot *stale = NULL;
+
+    for (size_t i = 0; i < LIMIT_PROBES; i++) {
+        LimitSlot *slot  = &Slots[(key + i) & (LIMIT_SLOTS - 1)];
+        uint64_t   owner = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+        if (owner == 0 && (__atomic_compare_exchange_n(&slot->key, &owner, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || owner == key)) {
+            return slot;
+        }
+        if (owner == key) {
+            return slot;
+        }
+        if (!stale && __atomic_load_n(&slot->tat, __ATOMIC_RELAXED) <= now &&
+                      __atomic_load_n(&slot->connections, __ATOMIC_RELAXED) == 0) {
+            stale = slot;
+        }
+    }
+
+    if (stale) {
+        uint64_t owner = __atomic_load_n(&stale->key, __ATOMIC_ACQUIRE);
+        if (__atomic_compare_exchange_n(&stale->key, &owner, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return stale;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Turn a client away: the precomputed 429 for plain connections, or just a
+ * close for TLS ones (before any handshake work).
+ **/
+static void limit_reject(Request *r) {
+    debug("Limiting %s:%s", r->host, r->port);
+    if (r->secure) {
+        return;
+    }
+
+    /* The response fits in a fresh socket's buffer, so never wait for it.
+     * Read what the client already sent, so closing does not reset the
+     * connection (and discard the response) */
+    char scratch[BUFSIZ];
+    if (send(r->fd, TooManyRequests, TooManyRequestsLength, MSG_DONTWAIT | MSG_NOSIGNAL) > 0) {
+        shutdown(r->fd, SHUT_WR);
+        while (recv(r->fd, scratch, sizeof(scratch), MSG_DONTWAIT) > 0);
+    }
+}
+
+/**
+ * Admit a client's connection if it is within its limits.
+ *
+ * @param   r           Request structure (with host looked up).
+ * @return  true if admitted, false if the client was turned away.
+ *
+ * Each connection takes a token from the client's bucket.  With a
+ * connection limit, admitted connections are counted until limit_release
+ * (called by free_request).  Clients that cannot get a slot are admitted.
+ **/
+bool limit_admit(Request *r) {
+    if (!Slots) {
+        return true;
+    }
+
+    uint64_t   now  = limit_now();
+    LimitSlot *slot = limit_slot(limit_hash(r->host), now);
+    if (!slot) {
+        debug("Unable to track %s: client limits are full", r->host);
+        return true;
+    }
+
+    if (Interval) {
+        uint64_t tat = __atomic_load_n(&slot->tat, __ATOMIC_RELAXED);
+        uint64_t next;
+        do {
+            uint64_t start = tat > now ? tat : now;
+            if (start - now > Tolerance) {
+                limit_reject(r);
+                return false;
+            }
+            next = start + Interval;
+        } while (!__atomic_compare_exchange_n(&slot->tat, &tat, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    if (LimitConnections) {
+        if (__atomic_add_fetch(&slot->connections, 1, __ATOMIC_RELAXED) > LimitConnections) {
+            __atomic_sub_fetch(&slot->connections, 1, __ATOMIC_RELAXED);
+            limit_reject(r);
+            return false;
+        }
+        __atomic_add_fetch(&Held[WorkerId * LIMIT_SLOTS + (slot - Slots)], 1, __ATOMIC_RELAXED);
+        r->limit = slot;
+    }
+    return true;
+}
+
+/**
+ * Stop counting a connection against the client of slot.
+ *
+ * @param   slot        Slot the connection was admitted in (NULL = none).
+ *
+ * The forking server releases connections of its children this way when it
+ * reaps them, so one killed mid-request does not keep counting.
+ **/
+void limit_release_slot(LimitSlot *slot) {
+    if (slot) {
+        __atomic_sub_fetch(&Held[WorkerId * LIMIT_SLOTS + (slot - Slots)], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&slot->connections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Stop counting a request's connection against its client.
+ **/
+void limit_release(Request *r) {
+    limit_release_slot(r->limit);
+    r->limit = NULL;
+}
+
+/**
+ * Release every connection a dead worker was counting.
+ *
+ * @param   worker      Index of worker (it must have exited).
+ **/
+void limit_reclaim(size_t worker) {
+    if (!Held) {
+        return;
+    }
+
+    uint32_t *held = &Held[worker * LIMIT_SLOTS];
+    for (size_t i = 0; i < LIMIT_SLOTS; i++) {
+        uint32_t count = __atomic_exchange_n(&held[i], 0, __ATOMIC_RELAXED);
+        if (count) {
+            __atomic_sub_fetch(&Slots[i].connections, count, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,81 @@
+/* mod_hello.c: Sample Handler Module (www/scripts/hello.py in-process) */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <string.h>
+
+/**
+ * Decode a form-urlencoded value ('+' and %XX escapes) in place.
+ **/
+static void hello_decode(char *s) {
+    char *out = s;
+    for (; *s; s++) {
+        if (*s == '+') {
+            *out++ = ' ';
+        } else if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            char hex[3] = {s[1], s[2], '\0'};
+            *out++ = strtol(hex, NULL, 16);
+            s += 2;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+/**
+ * Append text to the response with HTML special characters escaped.
+ **/
+static void hello_escape(Response *response, const char *s) {
+    for (; *s; s++) {
+        switch (*s) {
+            case '<':  response_printf(response, "&lt;");   break;
+            case '>':  response_printf(response, "&gt;");   break;
+            case '&':  response_printf(response, "&amp;");  break;
+            case '"':  response_printf(response, "&quot;"); break;
+            default:   response_write(response, s, 1);      break;
+        }
+    }
+}
+
+/**
+ * Greet the user named in the query string, and show the form.
+ **/
+static Status hello_handle(Request *r, Response *response) {
+    response_header(response, "Content-Type", "text/html");
+
+    /* Find user=NAME among the query's fields */
+    char query[BUFSIZ];
+    char *state;
+    snprintf(query, sizeof(query), "%s", r->query ? r->query : "");
+    for (char *field = strtok_r(query, "&;", &state); field; field = strtok_r(NULL, "&;", &state)) {
+        if (strncmp(field, "user=", 5) == 0) {
+            hello_decode(field + 5);
+            response_printf(response, "<h1>Hello, ");
+            hello_escape(response, field + 5);
+            response_printf(response, "</h1>\n");
+            break;
+        }
+    }
+
+    response_printf(response,
+        "\n"
+        "<form>\n"
+        "    <input type=\"text\" name=\"user\">\n"
+        "    <input type=\"submit\">\n"
+        "</form>\n"
+        "\n");
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Register the module's handlers (called by module_load).
+ **/
+bool spidey_module_init(void) {
+    return module_register("/hello", hello_handle);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
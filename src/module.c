@@ -0,0 +1,227 @@
+/* module.c: In-Process Handler Modules */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+
+/* Structures */
+
+typedef struct {
+    char         *prefix;               /**< URI prefix handled */
+    ModuleHandler handler;
+} Module;
+
+struct response {
+    int         code;                   /**< Status code */
+    const char *reason;                 /**< Reason phrase */
+    char       *headers;                /**< Header lines added by the module */
+    size_t      headers_length;
+    FILE       *headers_stream;
+    char       *body;
+    size_t      body_length;
+    FILE       *body_stream;
+    bool        typed;                  /**< Module set Content-Type */
+};
+
+/* Global Variables */
+
+static Module Modules[MAX_MODULES];
+static size_t ModulesCount = 0;
+
+/**
+ * Load a handler module.
+ *
+ * @param   path        Path of shared object.
+ * @return  true if the module loaded and its MODULE_INIT function succeeded.
+ *
+ * MODULE_INIT is expected to call module_register for each prefix it
+ * handles.  Modules call back into the server (module_register, the
+ * response_ functions, request_header, ...), which spidey exports with
+ * -rdynamic.
+ **/
+bool module_load(const char *path) {
+    void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+        fprintf(stderr, "Unable to load module %s: %s\n", path, dlerror());
+        return false;
+    }
+
+    bool (*init)(void) = (bool (*)(void))dlsym(library, MODULE_INIT);
+    if (!init) {
+        fprintf(stderr, "Module %s does not export %s\n", path, MODULE_INIT);
+        dlclose(library);
+        return false;
+    }
+
+    size_t count = ModulesCount;
+    if (!init()) {
+        fprintf(stderr, "Module %s failed to initialize\n", path);
+        while (ModulesCount > count) {
+            free(Modules[--ModulesCount].prefix);
+        }
+        dlclose(library);
+        return false;
+    }
+
+    log("Loaded module %s (%zu handlers)", path, ModulesCount - count);
+    return true;
+}
+
+/**
+ * Register a module handler for a URI prefix.
+ *
+ * @param   prefix      URI prefix (matched like proxy routes: longest
+ *                      prefix, on a path segment boundary).
+ * @param   handler     Function to handle matching requests.
+ * @return  true on success, false if there are too many handlers.
+ **/
+bool module_register(const char *prefix, ModuleHandler handler) {
+    if (ModulesCount == MAX_MODULES || !prefix || prefix[0] != '/' || !handler) {
+        return false;
+    }
+
+    Modules[ModulesCount].prefix  = strdup(prefix);
+    Modules[ModulesCount].handler = handler;
+    return Modules[ModulesCount++].prefix != NULL;
+}
+
+/**
+ * Find module for request URI.
+ **/
+static Module *module_find(const char *uri) {
+    Module *match = NULL;
+    size_t match_length = 0;
+
+    for (size_t i = 0; i < ModulesCount; i++) {
+        size_t length = strlen(Modules[i].prefix);
+        if (strncmp(uri, Modules[i].prefix, length) == 0 &&
+            (Modules[i].prefix[length - 1] == '/' || uri[length] == '/' || uri[length] == '\0') &&
+            length > match_length) {
+            match = &Modules[i];
+            match_length = length;
+        }
+    }
+    return match;
+}
+
+/**
+ * Determine whether a module handles the request.
+ **/
+bool module_requested(Request *r) {
+    return ModulesCount && r->uri && module_find(r->uri);
+}
+
+/**
+ * Handle request with a module.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP request.
+ *
+ * The module's handler runs in-process, writing its response into memory;
+ * the status line, headers (with Date and Content-Length) and body then go
+ * out in a single writev.
+ **/
+Status handle_module_request(Request *r) {
+    Module  *module = module_find(r->uri);
+    Response response = {.code = 200, .reason = "OK"};
+
+    response.headers_stream = open_memstream(&response.headers, &response.headers_length);
+    response.body_stream    = open_memstream(&response.body, &response.body_length);
+    if (!module || !response.headers_stream || !response.body_stream) {
+        if (response.headers_stream) {
+            fclose(response.headers_stream);
+        }
+        if (response.body_stream) {
+            fclose(response.body_stream);
+        }
+        free(response.headers);
+        free(response.body);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    Status status = module->handler(r, &response);
+    if (!response.typed) {
+        fprintf(response.headers_stream, "Content-Type: %s\r\n", DefaultMimeType);
+    }
+    bool written = fclose(response.headers_stream) == 0 && fclose(response.body_stream) == 0;
+
+    if (status == HTTP_STATUS_OK && !written) {
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    if (status != HTTP_STATUS_OK) {
+        free(response.headers);
+        free(response.body);
+        return handle_error(r, status);
+    }
+
+    char head[256];
+    int  head_length = snprintf(head, sizeof(head), "HTTP/1.0 %d %s\r\nDate: %s\r\nContent-Length: %zu\r\n",
+                                response.code, response.reason, http_date(NULL), response.body_length);
+    struct iovec iov[] = {
+        {head, head_length < (int)sizeof(head) ? head_length : (int)sizeof(head) - 1},
+        {response.headers, response.headers_length},
+        {"\r\n", 2},
+        {response.body, response.body_length},
+    };
+
+    if (request_writev(r, iov, 4) < 0) {
+        debug("Unable to write module response: %s", strerror(errno));
+    }
+
+    free(response.headers);
+    free(response.body);
+    return HTTP_STATUS_OK;
+}
+
+/* Response Writer */
+
+/**
+ * Set the response status (default: 200 OK).
+ *
+ * @param   response    Response being written.
+ * @param   code        Status code.
+ * @param   reason      Reason phrase (a string that outlives the request).
+ **/
+void response_status(Response *response, int code, const char *reason) {
+    response->code   = code;
+    response->reason = reason;
+}
+
+/**
+ * Add a response header (Content-Type defaults to DefaultMimeType;
+ * Date and Content-Length are added by the server).
+ **/
+void response_header(Response *response, const char *name, const char *value) {
+    response->typed = response->typed || strcasecmp(name, "Content-Type") == 0;
+    fprintf(response->headers_stream, "%s: %s\r\n", name, value);
+}
+
+/**
+ * Append bytes to the response body.
+ *
+ * @return  Number of bytes appended.
+ **/
+size_t response_write(Response *response, const void *data, size_t length) {
+    return fwrite(data, 1, length, response->body_stream);
+}
+
+/**
+ * Append formatted text to the response body.
+ *
+ * @return  Number of bytes appended, or a negative value on error.
+ **/
+int response_printf(Response *response, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vfprintf(response->body_stream, format, args);
+    va_end(args);
+    return n;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,340 @@
+/* pack.c: Pack Document Root into Asset Archive */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Global Variables (normally defined by spidey.c) */
+
+char *Port	      = "9898";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath	      = "www";
+
+size_t Workers  = 1;
+size_t WorkerId = 0;
+
+/* Internal handler entry points (see handler.c) */
+
+Status handle_browse_request(Request *request);
+
+/* Structures */
+
+typedef struct {
+    char       *uri;                    /**< URI path served */
+    char       *path;                   /**< Real path on disk */
+    PackType    type;
+    struct stat s;
+} Item;
+
+/* Global Variables */
+
+static Item  *Items = NULL;
+static size_t ItemsCount = 0;
+static size_t ItemsCapacity = 0;
+
+/**
+ * Display usage message and exit with specified status code.
+ **/
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [-m path] [-M mimetype] ROOT ARCHIVE\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    exit(status);
+}
+
+/**
+ * Add a path to the list of items to pack.
+ **/
+static void pack_add(const char *uri, const char *path, PackType type, const struct stat *s) {
+    if (ItemsCount == ItemsCapacity) {
+        ItemsCapacity = ItemsCapacity ? ItemsCapacity * 2 : 64;
+        Items = realloc(Items, ItemsCapacity * sizeof(Item));
+        if (!Items) {
+            fatal("Unable to allocate items: %s", strerror(errno));
+        }
+    }
+
+    Items[ItemsCount++] = (Item){strdup(uri), strdup(path), type, *s};
+}
+
+/**
+ * Collect a directory and everything below it, classified the way
+ * dispatch_request classifies them at request time.
+ *
+ * Symbolic links are followed, but (like determine_request_path) only to
+ * targets inside RootPath.
+ **/
+static void pack_walk(const char *uri, const char *path) {
+    struct dirent **entries;
+    struct stat s;
+
+    if (stat(path, &s) < 0) {
+        fatal("Unable to stat %s: %s", path, strerror(errno));
+    }
+    pack_add(uri, path, PACK_DIRECTORY, &s);
+
+    int n = scandir(path, &entries, 0, alphasort);
+    if (n < 0) {
+        fatal("Unable to scan %s: %s", path, strerror(errno));
+    }
+
+    for (int i = 0; i < n; i++) {
+        char child_uri[PATH_MAX];
+        char child_path[PATH_MAX];
+        char real[PATH_MAX];
+        const char *name = entries[i]->d_name;
+
+        if (streq(name, ".") || streq(name, "..")) {
+            free(entries[i]);
+            continue;
+        }
+
+        snprintf(child_uri, sizeof(child_uri), "%s/%s", streq(uri, "/") ? "" : uri, name);
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, name);
+        free(entries[i]);
+
+        if (!realpath(child_path, real) || strncmp(real, RootPath, strlen(RootPath)) != 0 || stat(real, &s) < 0) {
+            fprintf(stderr, "Skipping %s\n", child_path);
+            continue;
+        }
+
+        if (S_ISDIR(s.st_mode)) {
+            pack_walk(child_uri, real);
+        } else if (access(real, X_OK) == 0) {
+            pack_add(child_uri, real, PACK_CGI, &s);
+        } else if (S_ISREG(s.st_mode) && access(real, R_OK) == 0) {
+            pack_add(child_uri, real, PACK_FILE, &s);
+        }
+    }
+    free(entries);
+}
+
+/**
+ * Compare items by URI (the order lookups binary search in).
+ **/
+static int pack_compare(const void *a, const void *b) {
+    return strcmp(((const Item *)a)->uri, ((const Item *)b)->uri);
+}
+
+/**
+ * Append data to the archive.
+ *
+ * @return  Offset of data in archive.
+ **/
+static uint64_t pack_append(FILE *archive, const void *data, size_t length) {
+    off_t offset = ftello(archive);
+    if (length && fwrite(data, 1, length, archive) != length) {
+        fatal("Unable to write archive: %s", strerror(errno));
+    }
+    return offset;
+}
+
+/**
+ * Read the contents of a file.
+ **/
+static char *pack_read(const char *path, size_t length) {
+    char *data = malloc(length ? length : 1);
+    FILE *stream = fopen(path, "r");
+    if (!data || !stream || fread(data, 1, length, stream) != length) {
+        fatal("Unable to read %s: %s", path, strerror(errno));
+    }
+    fclose(stream);
+    return data;
+}
+
+/**
+ * Render the directory listing handle_browse_request would send.
+ **/
+static char *pack_listing(Item *item, size_t *length) {
+    char   *response = NULL;
+    size_t  response_length = 0;
+    Request request = {.fd = -1, .uri = item->uri, .path = item->path};
+
+    request.stream = open_memstream(&response, &response_length);
+    if (!request.stream || handle_browse_request(&request) != HTTP_STATUS_OK || fclose(request.stream) != 0) {
+        fatal("Unable to list %s", item->path);
+    }
+
+    /* Keep the body: headers are packed separately */
+    char *body = strstr(response, "\r\n\r\n");
+    body = body ? body + 4 : response;
+    *length = response_length - (body - response);
+    memmove(response, body, *length);
+    return response;
+}
+
+/**
+ * Compress data with gzip.
+ *
+ * @return  Compressed data, or NULL if it would not save at least 10%.
+ **/
+static char *pack_gzip(const char *data, size_t length, size_t *gzip_length) {
+    z_stream z = {0};
+
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t bound = deflateBound(&z, length);
+    char  *gzip  = malloc(bound);
+    z.next_in    = (Bytef *)data;
+    z.avail_in   = length;
+    z.next_out   = (Bytef *)gzip;
+    z.avail_out  = bound;
+
+    int status = gzip ? deflate(&z, Z_FINISH) : Z_MEM_ERROR;
+    *gzip_length = z.total_out;
+    deflateEnd(&z);
+
+    if (status != Z_STREAM_END || *gzip_length >= length - length / 10) {
+        free(gzip);
+        return NULL;
+    }
+    return gzip;
+}
+
+/**
+ * Write an item's body, its gzip variant, and the headers of both.
+ **/
+static void pack_item(FILE *archive, Item *item, PackEntry *entry) {
+    size_t length = 0;
+    size_t gzip_length = 0;
+    char  *headers = NULL;
+    char   etag[64] = "";
+
+    entry->path        = pack_append(archive, item->uri, strlen(item->uri) + 1);
+    entry->path_length = strlen(item->uri);
+    entry->type        = item->type;
+
+    if (item->type == PACK_CGI) {
+        entry->body        = pack_append(archive, item->path, strlen(item->path) + 1);
+        entry->body_length = strlen(item->path);
+        return;
+    }
+
+    char *body = NULL;
+    char *mimetype = NULL;
+    if (item->type == PACK_DIRECTORY) {
+        body     = pack_listing(item, &length);
+        mimetype = strdup("text/html");
+    } else {
+        length   = item->s.st_size;
+        body     = pack_read(item->path, length);
+        mimetype = determine_mimetype(item->path);
+        snprintf(etag, sizeof(etag), "ETag: \"%lx-%llx-%lx\"\r\n",
+            (unsigned long)item->s.st_ino, (long long)item->s.st_size, (unsigned long)item->s.st_mtim.tv_sec);
+    }
+
+    char *gzip = pack_gzip(body, length, &gzip_length);
+    const char *vary = gzip ? "Vary: Accept-Encoding\r\n" : "";
+
+    int n = asprintf(&headers, "Content-Type: %s\r\nContent-Length: %zu\r\n%s%s\r\n", mimetype, length, etag, vary);
+    if (n < 0) {
+        fatal("Unable to render headers: %s", strerror(errno));
+    }
+    entry->headers        = pack_append(archive, headers, n);
+    entry->headers_length = n;
+    entry->body           = pack_append(archive, body, length);
+    entry->body_length    = length;
+    free(headers);
+
+    if (gzip) {
+        /* The variant needs an ETag of its own */
+        if (etag[0]) {
+            strcpy(strrchr(etag, '"'), "-gz\"\r\n");
+        }
+        n = asprintf(&headers, "Content-Type: %s\r\nContent-Encoding: gzip\r\nContent-Length: %zu\r\n%s%s\r\n", mimetype, gzip_length, etag, vary);
+        if (n < 0) {
+            fatal("Unable to render headers: %s", strerror(errno));
+        }
+        entry->gzip_headers        = pack_append(archive, headers, n);
+        entry->gzip_headers_length = n;
+        entry->gzip                = pack_append(archive, gzip, gzip_length);
+        entry->gzip_length         = gzip_length;
+        free(headers);
+        free(gzip);
+    }
+
+    free(mimetype);
+    free(body);
+}
+
+/**
+ * Pack a document root into an archive spidey serves with -r ARCHIVE.
+ **/
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        switch (arg[1]) {
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+                break;
+            case 'm':
+                MimeTypesPath = argv[argind++];
+                break;
+            case 'M':
+                DefaultMimeType = argv[argind++];
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+                break;
+        }
+    }
+    if (argc - argind != 2) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    RootPath = realpath(argv[argind], NULL);
+    if (!RootPath) {
+        fatal("Could not determine root path %s: %s", argv[argind], strerror(errno));
+    }
+    const char *output = argv[argind + 1];
+
+    /* Collect and sort everything under the root */
+    pack_walk("/", RootPath);
+    qsort(Items, ItemsCount, sizeof(Item), pack_compare);
+
+    /* Write bodies after room for the header and index, then fill those in */
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d", output, getpid());
+    FILE *archive = fopen(temporary, "w");
+    if (!archive) {
+        fatal("Unable to create %s: %s", temporary, strerror(errno));
+    }
+
+    PackHeader header  = {.count = ItemsCount, .entries = sizeof(PackHeader)};
+    PackEntry *entries = calloc(ItemsCount, sizeof(PackEntry));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+
+    fseeko(archive, sizeof(PackHeader) + ItemsCount * sizeof(PackEntry), SEEK_SET);
+    header.root = pack_append(archive, RootPath, strlen(RootPath) + 1);
+    for (size_t i = 0; i < ItemsCount; i++) {
+        pack_item(archive, &Items[i], &entries[i]);
+    }
+
+    rewind(archive);
+    pack_append(archive, &header, sizeof(header));
+    pack_append(archive, entries, ItemsCount * sizeof(PackEntry));
+    if (fclose(archive) != 0 || rename(temporary, output) < 0) {
+        unlink(temporary);
+        fatal("Unable to write %s: %s", output, strerror(errno));
+    }
+
+    printf("Packed %zu entries from %s into %s\n", ItemsCount, RootPath, output);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
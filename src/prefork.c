@@ -0,0 +1,172 @@
+/* prefork.c: Per-Core Prefork HTTP Server */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Global Variables */
+
+static pid_t Pids[MAX_WORKERS];         /**< Running worker processes */
+
+/**
+ * Send signal to every running worker.
+ **/
+static void prefork_signal(int signum) {
+    for (size_t i = 0; i < Workers; i++) {
+        if (Pids[i] > 0) {
+            kill(Pids[i], signum);
+        }
+    }
+}
+
+/**
+ * Determine the CPUs available to the server, up to count of them.
+ *
+ * @param   cpus        Array to fill with CPU numbers.
+ * @param   count       Maximum number of CPUs to return.
+ * @return  Number of CPUs found.
+ **/
+static size_t prefork_cpus(int *cpus, size_t count) {
+    cpu_set_t allowed;
+    size_t    found = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return 0;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && found < count; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[found++] = cpu;
+        }
+    }
+    return found;
+}
+
+/**
+ * Start a worker process serving its own set of listening sockets.
+ *
+ * @param   worker      Index of worker.
+ * @param   sets        Listening sockets of every worker.
+ * @param   cpu         CPU to pin worker to (-1 = not pinned).
+ * @return  Process ID of worker, or -1 on error.
+ **/
+static pid_t prefork_spawn(size_t worker, Listeners *sets, int cpu) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    WorkerId = worker;
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGUSR2, SIG_IGN);           /* Upgrades are run by the parent */
+
+    for (size_t i = 0; i < Workers; i++) {
+        if (i != worker) {
+            socket_close(&sets[i]);
+        }
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(cpu, &mask);
+        if (sched_setaffinity(0, sizeof(mask), &mask) < 0) {
+            log("Unable to pin worker %zu to CPU %d: %s", worker, cpu, strerror(errno));
+        }
+    }
+
+    debug("Worker %zu serving on CPU %d", worker, cpu);
+    exit(single_server(&sets[worker]));
+}
+
+/**
+ * Serve HTTP requests from one worker process per core.
+ *
+ * @param   listeners   Listening sockets (bound with SO_REUSEPORT).
+ * @return  Exit status of server.
+ *
+ * Each worker is pinned to a CPU and accepts from listening sockets of its
+ * own, and connections are steered to the worker on the CPU that received
+ * them.  A connection therefore never leaves its core, and everything a
+ * worker keeps per process (resource cache, allocator arenas, counters) is
+ * per core.  Workers that die are restarted on the same CPU and sockets,
+ * after the connections they were counting against clients are released.
+ * On upgrade or SIGQUIT the workers are asked to drain and waited for; on
+ * SIGTERM or SIGINT they are terminated and waited for.
+ **/
+int prefork_server(Listeners *listeners) {
+    static Listeners sets[MAX_WORKERS];
+    int    cpus[MAX_WORKERS];
+    size_t ncpus = prefork_cpus(cpus, MAX_WORKERS);
+    bool   pinned = ncpus >= Workers;
+
+    /* Keep the sockets each worker had before an upgrade, so their order in
+     * the reuseport groups (and thus the steering) stays the same */
+    sets[0] = *listeners;
+    for (size_t i = 1; i < Workers; i++) {
+        if (!upgrade_listeners(i, &sets[i]) && socket_clone(listeners, &sets[i]) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Steering only makes sense when every worker owns a CPU */
+    if (pinned && Workers > 1 && socket_steer(listeners, cpus, Workers) < 0) {
+        log("Connections will be spread by hash instead of CPU");
+    }
+
+    for (size_t i = 0; i < Workers; i++) {
+        if ((Pids[i] = prefork_spawn(i, sets, pinned ? cpus[i] : -1)) < 0) {
+            fprintf(stderr, "Unable to fork worker: %s\n", strerror(errno));
+            prefork_signal(SIGTERM);
+            return EXIT_FAILURE;
+        }
+    }
+    log("Started %zu workers%s", Workers, pinned ? " pinned per CPU" : "");
+
+    /* Supervise workers */
+    while (!upgrade_poll(sets, Workers)) {
+        int   status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return EXIT_FAILURE;
+        }
+
+        for (size_t i = 0; i < Workers; i++) {
+            if (Pids[i] == pid && !Draining) {
+                log("Worker %zu exited (status %d), restarting", i, status);
+                limit_reclaim(i);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                    sleep(1);   /* Do not spin on a worker that keeps crashing */
+                }
+                Pids[i] = prefork_spawn(i, sets, pinned ? cpus[i] : -1);
+            }
+        }
+    }
+
+    /* Drain: workers finish their current request and exit (unless
+     * terminating, when they exit at once) */
+    prefork_signal(Terminating ? SIGTERM : SIGQUIT);
+    for (size_t i = 0; i < Workers; i++) {
+        socket_close(&sets[i]);
+    }
+    for (size_t i = 0; i < Workers; i++) {
+        while (Pids[i] > 0 && waitpid(Pids[i], NULL, 0) < 0 && errno == EINTR);
+    }
+    log("Workers %s", Terminating ? "terminated" : "drained");
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
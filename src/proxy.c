@@ -0,0 +1,757 @@
+/* proxy.c: Reverse Proxy */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PROXY_MAX_ROUTES        16
+#define PROXY_MAX_UPSTREAMS     8       /**< Upstreams per route */
+#define PROXY_POOL_SIZE         8       /**< Idle connections kept per upstream */
+#define PROXY_CONNECT_TIMEOUT   1000    /**< Milliseconds */
+#define PROXY_IO_TIMEOUT        30      /**< Seconds an upstream may stall */
+#define PROXY_MIN_BACKOFF       1       /**< Seconds an upstream is skipped after failing */
+#define PROXY_MAX_BACKOFF       30
+#define PROXY_SPLICE_SIZE       65536
+
+/* Structures */
+
+/**
+ * Upstream health shared by all server processes, so every process skips an
+ * upstream another one saw fail.
+ **/
+typedef struct {
+    long        failures;               /**< Consecutive failures */
+    time_t      down_until;             /**< Skip until this time (0 = healthy) */
+} UpstreamState;
+
+/**
+ * Load of a route as seen by one worker, shared by the processes of that
+ * worker (forked children rotate and count together).  Each worker writes
+ * only its own cache line, so prefork workers on different cores balance
+ * their own connections without bouncing counters between them.
+ **/
+typedef struct {
+    unsigned long next;                         /**< Round-robin cursor */
+    long        active[PROXY_MAX_UPSTREAMS];    /**< Requests in flight */
+} __attribute__((aligned(CACHE_LINE))) RouteLoad;
+
+typedef struct {
+    char       *address;                /**< HOST:PORT as configured */
+    struct sockaddr_storage addr;
+    socklen_t   addrlen;
+    UpstreamState *state;               /**< Shared health and load */
+    int         idle[PROXY_POOL_SIZE];  /**< Pooled keep-alive connections */
+    size_t      nidle;
+} Upstream;
+
+typedef struct {
+    char       *prefix;                 /**< URI prefix forwarded */
+    Upstream    upstreams[PROXY_MAX_UPSTREAMS];
+    size_t      nupstreams;
+    RouteLoad  *load;                   /**< Load per worker */
+} Route;
+
+/**
+ * Buffered reader over an upstream connection.  Only the response head and
+ * chunk framing pass through the buffer; bodies are spliced from the socket.
+ **/
+typedef struct {
+    int         fd;
+    char        buffer[BUFSIZ];
+    size_t      offset;
+    size_t      length;
+} Reader;
+
+/* Global Variables */
+
+ProxyBalance ProxyPolicy = ROUND_ROBIN;
+bool         ProxyPooling = true;
+
+static Route  Routes[PROXY_MAX_ROUTES];
+static size_t RoutesCount = 0;
+static int    ProxyPipe[2] = {-1, -1};
+
+/* Configuration */
+
+/**
+ * Add a proxy route.
+ *
+ * @param   spec        PREFIX=HOST:PORT[,HOST:PORT...]
+ * @return  true if spec was valid and its upstreams resolved.
+ **/
+bool proxy_add_route(const char *spec) {
+    const char *equals = strchr(spec, '=');
+    if (!equals || equals == spec || spec[0] != '/' || RoutesCount == PROXY_MAX_ROUTES) {
+        return false;
+    }
+
+    Route *route  = &Routes[RoutesCount];
+    route->prefix = strndup(spec, equals - spec);
+
+    char *upstreams = strdup(equals + 1);
+    char *saveptr   = NULL;
+    for (char *address = strtok_r(upstreams, ",", &saveptr); address; address = strtok_r(NULL, ",", &saveptr)) {
+        if (route->nupstreams == PROXY_MAX_UPSTREAMS) {
+            return false;
+        }
+
+        char *colon = strrchr(address, ':');
+        if (!colon) {
+            fprintf(stderr, "Upstream %s is missing a port\n", address);
+            return false;
+        }
+
+        /* Resolve once, at startup */
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+        struct addrinfo *results;
+        char host[NI_MAXHOST];
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        int status = getaddrinfo(host, colon + 1, &hints, &results);
+        if (status != 0) {
+            fprintf(stderr, "Unable to resolve upstream %s: %s\n", address, gai_strerror(status));
+            return false;
+        }
+
+        Upstream *upstream = &route->upstreams[route->nupstreams++];
+        upstream->address = strdup(address);
+        upstream->addrlen = results->ai_addrlen;
+        memcpy(&upstream->addr, results->ai_addr, results->ai_addrlen);
+        freeaddrinfo(results);
+    }
+    free(upstreams);
+
+    if (!route->nupstreams) {
+        return false;
+    }
+
+    RoutesCount++;
+    return true;
+}
+
+/**
+ * Set balancing policy.
+ *
+ * @param   policy      "roundrobin" or "leastconn".
+ * @return  true if policy was recognized.
+ **/
+bool proxy_set_balance(const char *policy) {
+    if (streq(policy, "roundrobin")) {
+        ProxyPolicy = ROUND_ROBIN;
+    } else if (streq(policy, "leastconn")) {
+        ProxyPolicy = LEAST_CONNECTIONS;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Allocate the state shared between server processes.
+ *
+ * @return  0 on success, -1 on error.
+ *
+ * Must be called after all routes are added and the number of workers is
+ * known, and before the server forks.
+ **/
+int proxy_init(void) {
+    size_t count = 0;
+    for (size_t i = 0; i < RoutesCount; i++) {
+        count += Routes[i].nupstreams;
+    }
+    if (!RoutesCount) {
+        return 0;
+    }
+
+    size_t size = RoutesCount * Workers * sizeof(RouteLoad) + count * sizeof(UpstreamState);
+    void *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Unable to map proxy state: %s\n", strerror(errno));
+        return -1;
+    }
+
+    UpstreamState *state = (UpstreamState *)((RouteLoad *)shared + RoutesCount * Workers);
+    for (size_t i = 0; i < RoutesCount; i++) {
+        Routes[i].load = (RouteLoad *)shared + i * Workers;
+        for (size_t u = 0; u < Routes[i].nupstreams; u++) {
+            Routes[i].upstreams[u].state = state++;
+        }
+    }
+    return 0;
+}
+
+/* Upstream Selection */
+
+/**
+ * Find route for request URI: the longest prefix that matches on a path
+ * segment boundary.
+ **/
+static Route *proxy_route(const char *uri) {
+    Route *match = NULL;
+    size_t match_length = 0;
+
+    for (size_t i = 0; i < RoutesCount; i++) {
+        size_t length = strlen(Routes[i].prefix);
+        if (strncmp(uri, Routes[i].prefix, length) == 0 &&
+            (Routes[i].prefix[length - 1] == '/' || uri[length] == '/' || uri[length] == '\0') &&
+            length > match_length) {
+            match = &Routes[i];
+            match_length = length;
+        }
+    }
+    return match;
+}
+
+/**
+ * Determine whether request should be proxied.
+ **/
+bool proxy_requested(Request *r) {
+    return RoutesCount && r->uri && proxy_route(r->uri);
+}
+
+/**
+ * Pick an upstream for the route.
+ *
+ * Upstreams that failed recently are skipped until their backoff expires;
+ * the first request after that claims the upstream and acts as its health
+ * check.  If every upstream is down the least recently failed one is tried
+ * anyway rather than failing outright.
+ **/
+static Upstream *proxy_select(Route *route) {
+    RouteLoad *load = &route->load[WorkerId];
+    time_t    now  = time(NULL);
+    Upstream *best = NULL;
+    long      best_active = 0;
+
+    unsigned long start = __atomic_fetch_add(&load->next, 1, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < route->nupstreams; i++) {
+        Upstream *upstream = &route->upstreams[(start + i) % route->nupstreams];
+        time_t    down     = __atomic_load_n(&upstream->state->down_until, __ATOMIC_RELAXED);
+
+        if (down) {
+            /* Only one process gets to probe an upstream whose backoff expired */
+            if (now < down || !__atomic_compare_exchange_n(&upstream->state->down_until, &down,
+                    now + PROXY_MIN_BACKOFF, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            return upstream;
+        }
+
+        long active = __atomic_load_n(&load->active[upstream - route->upstreams], __ATOMIC_RELAXED);
+        if (!best || (ProxyPolicy == LEAST_CONNECTIONS && active < best_active)) {
+            best = upstream;
+            best_active = active;
+        }
+        if (ProxyPolicy == ROUND_ROBIN) {
+            break;
+        }
+    }
+
+    if (!best) {
+        best = &route->upstreams[0];
+        for (size_t i = 1; i < route->nupstreams; i++) {
+            if (route->upstreams[i].state->down_until < best->state->down_until) {
+                best = &route->upstreams[i];
+            }
+        }
+    }
+    return best;
+}
+
+static void proxy_mark_failed(Upstream *upstream) {
+    long   failures = __atomic_add_fetch(&upstream->state->failures, 1, __ATOMIC_RELAXED);
+    time_t backoff  = PROXY_MIN_BACKOFF << (failures < 6 ? failures - 1 : 5);
+
+    backoff = backoff < PROXY_MAX_BACKOFF ? backoff : PROXY_MAX_BACKOFF;
+    __atomic_store_n(&upstream->state->down_until, time(NULL) + backoff, __ATOMIC_RELAXED);
+    log("Upstream %s failed (%ld in a row), skipping for %lds", upstream->address, failures, (long)backoff);
+}
+
+static void proxy_mark_healthy(Upstream *upstream) {
+    if (__atomic_load_n(&upstream->state->failures, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&upstream->state->failures, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&upstream->state->down_until, 0, __ATOMIC_RELAXED);
+        log("Upstream %s recovered", upstream->address);
+    }
+}
+
+/* Connections */
+
+static int proxy_connect(Upstream *upstream) {
+    int fd = socket(upstream->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&upstream->addr, upstream->addrlen) < 0 && errno != EINPROGRESS) {
+        goto fail;
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (coroutine_wait(fd, POLLOUT, PROXY_CONNECT_TIMEOUT) <= 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+        errno = error ? error : ETIMEDOUT;
+        goto fail;
+    }
+
+    int one = 1;
+    struct timeval timeout = {.tv_sec = PROXY_IO_TIMEOUT};
+    if (!coroutine_active()) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);   /* Coroutines wait in proxy_wait */
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+
+fail:
+    debug("Unable to connect to %s: %s", upstream->address, strerror(errno));
+    close(fd);
+    return -1;
+}
+
+/**
+ * Take an idle pooled connection, skipping any the upstream has closed (a
+ * readable idle connection means EOF or unsolicited bytes).
+ *
+ * Pools are per process, so they only pay off in processes that serve many
+ * requests (single, event and prefork modes).  A forking child exits after
+ * one request, so the forking server turns ProxyPooling off.
+ **/
+static int proxy_pool_get(Upstream *upstream) {
+    while (upstream->nidle) {
+        int fd = upstream->idle[--upstream->nidle];
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 0) == 0) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+static void proxy_pool_put(Upstream *upstream, int fd) {
+    if (ProxyPooling && upstream->nidle < PROXY_POOL_SIZE) {
+        upstream->idle[upstream->nidle++] = fd;
+    } else {
+        close(fd);
+    }
+}
+
+/* Upstream I/O */
+
+/**
+ * Wait for an upstream socket after EAGAIN in a coroutine (which keeps them
+ * non-blocking), for as long as SO_RCVTIMEO/SO_SNDTIMEO would elsewhere.
+ *
+ * @return  true if the call should be retried.
+ **/
+static bool proxy_wait(int fd, short events) {
+    return errno == EAGAIN && coroutine_active() && coroutine_wait(fd, events, PROXY_IO_TIMEOUT * 1000) > 0;
+}
+
+static bool proxy_send(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EINTR || proxy_wait(fd, POLLOUT))) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data   += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool reader_fill(Reader *reader) {
+    if (reader->offset == reader->length) {
+        reader->offset = reader->length = 0;
+    }
+    if (reader->length == sizeof(reader->buffer)) {
+        return false;
+    }
+
+    ssize_t n;
+    do {
+        n = recv(reader->fd, reader->buffer + reader->length, sizeof(reader->buffer) - reader->length, 0);
+    } while (n < 0 && (errno == EINTR || proxy_wait(reader->fd, POLLIN)));
+
+    if (n <= 0) {
+        return false;
+    }
+    reader->length += n;
+    return true;
+}
+
+/**
+ * Read a line (without its CRLF) from the upstream.
+ **/
+static char *reader_gets(Reader *reader) {
+    while (true) {
+        char *start = reader->buffer + reader->offset;
+        char *eol   = memchr(start, '\n', reader->length - reader->offset);
+        if (eol) {
+            *eol = '\0';
+            if (eol > start && eol[-1] == '\r') {
+                eol[-1] = '\0';
+            }
+            reader->offset = eol + 1 - reader->buffer;
+            return start;
+        }
+
+        /* Make room by moving the partial line to the front */
+        memmove(reader->buffer, start, reader->length - reader->offset);
+        reader->length -= reader->offset;
+        reader->offset  = 0;
+        if (!reader_fill(reader)) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Forward up to length body bytes (SIZE_MAX = until EOF) to the client.
+ *
+ * @return  true if length bytes (or everything until EOF) were forwarded.
+ *
+ * Bytes already read into the reader's buffer are written first; the rest
+ * moves from the upstream socket to the client socket through a pipe with
+ * splice(2), never entering user space.  Clients without a plain socket
+ * (HTTP/2 streams, TLS without kTLS) get a buffered copy instead.
+ **/
+static bool proxy_forward(Request *r, Reader *reader, size_t length) {
+    bool until_eof = length == SIZE_MAX;
+
+    size_t buffered = reader->length - reader->offset;
+    size_t n = buffered < length ? buffered : length;
+    if (n && request_write(r, reader->buffer + reader->offset, n, 0) < 0) {
+        return false;
+    }
+    reader->offset += n;
+    length -= until_eof ? 0 : n;
+
+    /* Coroutines copy too: they may yield with bytes in the shared pipe */
+    bool spliceable = r->fd >= 0 && (!r->ssl || r->ktls) && !coroutine_active();
+    if (spliceable && ProxyPipe[0] < 0 && pipe2(ProxyPipe, O_CLOEXEC) < 0) {
+        spliceable = false;
+    }
+
+    while (length > 0) {
+        size_t want = length < PROXY_SPLICE_SIZE ? length : PROXY_SPLICE_SIZE;
+        ssize_t nread;
+
+        if (!spliceable) {
+            char buffer[BUFSIZ];
+            nread = recv(reader->fd, buffer, want < sizeof(buffer) ? want : sizeof(buffer), 0);
+            if (nread > 0 && request_write(r, buffer, nread, 0) < 0) {
+                return false;
+            }
+        } else {
+            nread = splice(reader->fd, NULL, ProxyPipe[1], NULL, want, SPLICE_F_MOVE);
+            int more = until_eof || (nread > 0 && length > (size_t)nread) ? SPLICE_F_MORE : 0;
+            for (ssize_t pending = nread; pending > 0; ) {
+                ssize_t nwritten = splice(ProxyPipe[0], NULL, r->fd, NULL, pending, SPLICE_F_MOVE | more);
+                if (nwritten < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (nwritten <= 0) {
+                    /* Bytes stuck in the pipe would corrupt the next response */
+                    close(ProxyPipe[0]);
+                    close(ProxyPipe[1]);
+                    ProxyPipe[0] = ProxyPipe[1] = -1;
+                    return false;
+                }
+                pending -= nwritten;
+            }
+        }
+
+        if (nread < 0 && (errno == EINTR || proxy_wait(reader->fd, POLLIN))) {
+            continue;
+        }
+        if (nread <= 0) {
+            return until_eof && nread == 0;
+        }
+        if (!until_eof) {
+            length -= nread;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Forward a chunked body to the client without its chunk framing (clients
+ * are spoken to in HTTP/1.0, where the body ends when the connection does).
+ **/
+static bool proxy_forward_chunked(Request *r, Reader *reader) {
+    while (true) {
+        char *line = reader_gets(reader);
+        if (!line) {
+            return false;
+        }
+
+        char *end;
+        unsigned long size = strtoul(line, &end, 16);
+        if (end == line) {
+            return false;
+        }
+
+        if (size == 0) {
+            /* Skip trailers */
+            while ((line = reader_gets(reader)) && *line) {
+            }
+            return line != NULL;
+        }
+
+        if (!proxy_forward(r, reader, size) || !(line = reader_gets(reader)) || *line) {
+            return false;
+        }
+    }
+}
+
+/* Request Handling */
+
+static bool proxy_hop_header(HeaderId id) {
+    switch (id) {
+        case HEADER_CONNECTION:
+        case HEADER_KEEP_ALIVE:
+        case HEADER_PROXY_CONNECTION:
+        case HEADER_PROXY_AUTHORIZATION:
+        case HEADER_TE:
+        case HEADER_TRAILER:
+        case HEADER_TRANSFER_ENCODING:
+        case HEADER_UPGRADE:
+        case HEADER_HTTP2_SETTINGS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Render the request sent upstream: HTTP/1.1 so the connection can be kept
+ * alive (unless pooling is off), without hop-by-hop headers, and with
+ * X-Forwarded-For appended.
+ **/
+static char *proxy_render_request(Request *r, Upstream *upstream, size_t *length) {
+    char  *text = NULL;
+    size_t size = 0;
+    FILE  *stream = open_memstream(&text, &size);
+    if (!stream) {
+        return NULL;
+    }
+
+    fprintf(stream, "%s %s%s%s HTTP/1.1\r\n", r->method, r->uri, r->query[0] ? "?" : "", r->query);
+    for (Header *header = r->headers; header; header = header->next) {
+        if (!proxy_hop_header(header->id) && header->id != HEADER_X_FORWARDED_FOR) {
+            fprintf(stream, "%s: %s\r\n", header->name, header->data);
+        }
+    }
+    if (!request_known_header(r, HEADER_HOST)) {
+        fprintf(stream, "Host: %s\r\n", upstream->address);
+    }
+
+    const char *forwarded = request_known_header(r, HEADER_X_FORWARDED_FOR);
+    fprintf(stream, "X-Forwarded-For: %s%s%s\r\n", forwarded ? forwarded : "", forwarded ? ", " : "", r->host);
+    fprintf(stream, "Connection: %s\r\n\r\n", ProxyPooling ? "keep-alive" : "close");
+
+    if (fclose(stream) != 0) {
+        free(text);
+        return NULL;
+    }
+    *length = size;
+    return text;
+}
+
+/**
+ * Copy the request body (Content-Length only) to the upstream.
+ **/
+static bool proxy_send_body(Request *r, int fd, size_t length) {
+    char buffer[BUFSIZ];
+
+    while (length > 0) {
+        ssize_t n = request_read(r, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+        if (n <= 0 || !proxy_send(fd, buffer, n)) {
+            return false;
+        }
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * Forward the upstream response to the client.
+ *
+ * @return  1 if the upstream connection can be reused, 0 if it must be
+ *          closed, -1 if no response head arrived (nothing was written to
+ *          the client, so the request may be retried).
+ **/
+static int proxy_relay(Request *r, Reader *reader) {
+    char *line = reader_gets(reader);
+    if (!line) {
+        return -1;
+    }
+
+    /* Status line: HTTP/1.x CODE REASON, relayed as HTTP/1.0 */
+    if (strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12) {
+        return 0;
+    }
+    int  code       = atoi(line + 9);
+    bool keep_alive = line[7] == '1';
+
+    char  *head = NULL;
+    size_t head_length = 0;
+    FILE  *stream = open_memstream(&head, &head_length);
+    if (!stream) {
+        return 0;
+    }
+    fprintf(stream, "HTTP/1.0 %s\r\n", line + 9);
+
+    bool   chunked = false;
+    size_t content_length = SIZE_MAX;
+    while ((line = reader_gets(reader)) && *line) {
+        char *colon = strchr(line, ':');
+        if (!colon) {
+            continue;
+        }
+        *colon = '\0';
+        char    *value = skip_whitespace(colon + 1);
+        HeaderId id    = header_id(line, colon - line);
+
+        if (id == HEADER_CONTENT_LENGTH) {
+            content_length = strtoull(value, NULL, 10);
+        } else if (id == HEADER_TRANSFER_ENCODING) {
+            chunked = strcasestr(value, "chunked") != NULL;
+        } else if (id == HEADER_CONNECTION) {
+            keep_alive = keep_alive ? !strcasestr(value, "close") : strcasestr(value, "keep-alive") != NULL;
+        }
+
+        if (!proxy_hop_header(id) && !(chunked && id == HEADER_CONTENT_LENGTH)) {
+            fprintf(stream, "%s: %s\r\n", line, value);
+        }
+    }
+    fprintf(stream, "\r\n");
+    if (fclose(stream) != 0 || !line) {
+        free(head);
+        return 0;
+    }
+
+    bool has_body = !streq(r->method, "HEAD") && code != 204 && code != 304 && code >= 200;
+    int  sent = request_write(r, head, head_length, has_body ? MSG_MORE : 0);
+    free(head);
+    if (sent < 0) {
+        return 0;
+    }
+
+    if (!has_body) {
+        return keep_alive;
+    }
+    if (chunked) {
+        return proxy_forward_chunked(r, reader) && keep_alive;
+    }
+    if (content_length != SIZE_MAX) {
+        return proxy_forward(r, reader, content_length) && keep_alive;
+    }
+
+    /* Body delimited by the upstream closing the connection */
+    proxy_forward(r, reader, SIZE_MAX);
+    return 0;
+}
+
+/**
+ * Handle proxied request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP request.
+ *
+ * The request is sent over a pooled keep-alive connection (see
+ * proxy_pool_get) to an upstream chosen by ProxyPolicy, falling back to a new connection if the pooled one
+ * turns out to have been closed.  Upstreams that cannot be reached are
+ * marked down (with exponential backoff) and the next one is tried; if none
+ * answer the client gets 502 Bad Gateway.
+ **/
+Status handle_proxy_request(Request *r) {
+    Route *route = proxy_route(r->uri);
+    size_t length;
+    char  *text = NULL;
+
+    const char *content_length = request_known_header(r, HEADER_CONTENT_LENGTH);
+    size_t body = content_length ? strtoull(content_length, NULL, 10) : 0;
+
+    for (size_t attempt = 0; attempt < route->nupstreams; attempt++) {
+        Upstream *upstream = proxy_select(route);
+        Reader    reader   = {.fd = proxy_pool_get(upstream)};
+        bool      pooled   = reader.fd >= 0;
+        long     *active   = &route->load[WorkerId].active[upstream - route->upstreams];
+
+        free(text);
+        if (!(text = proxy_render_request(r, upstream, &length))) {
+            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        }
+
+        /* A pooled connection may have been closed by the upstream just as
+         * it was picked: retry once on a new one before blaming the upstream */
+        int result = -1;
+        for (int tries = 0; tries < 2 && result < 0; tries++) {
+            if (reader.fd < 0) {
+                pooled = false;
+                if ((reader.fd = proxy_connect(upstream)) < 0) {
+                    break;
+                }
+            }
+
+            __atomic_add_fetch(active, 1, __ATOMIC_RELAXED);
+            if (proxy_send(reader.fd, text, length) && (!body || proxy_send_body(r, reader.fd, body))) {
+                result = proxy_relay(r, &reader);
+            }
+            __atomic_sub_fetch(active, 1, __ATOMIC_RELAXED);
+
+            if (result < 0) {
+                close(reader.fd);
+                reader.fd = -1;
+                if (!pooled || body) {
+                    break;
+                }
+            }
+        }
+
+        if (result >= 0) {
+            log("Proxied %s %s to %s", r->method, r->uri, upstream->address);
+            proxy_mark_healthy(upstream);
+            if (result && reader.offset == reader.length) {
+                proxy_pool_put(upstream, reader.fd);
+            } else {
+                close(reader.fd);
+            }
+            free(text);
+            return HTTP_STATUS_OK;
+        }
+
+        proxy_mark_failed(upstream);
+        if (body) {
+            break;  /* Body already consumed: cannot replay elsewhere */
+        }
+    }
+
+    free(text);
+    return handle_error(r, HTTP_STATUS_BAD_GATEWAY);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,489 @@
+/* replay.c: Replay Captured Traffic */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/* Constants */
+
+#define NSEC_PER_SEC    1000000000ULL
+#define STATUS_BUFSIZ   16              /**< Bytes of status line kept to read the code */
+
+/* Structures */
+
+typedef struct {
+    uint64_t    time;                   /**< Nanoseconds after the first request */
+    const char *bytes;                  /**< What the client sent (in the mapped capture) */
+    size_t      length;
+    size_t      index;                  /**< Position in capture (orders ties) */
+} Record;
+
+typedef enum {
+    PHASE_STATUS = 0,                   /**< Reading status line */
+    PHASE_HEADERS,                      /**< Skipping headers (they carry the Date) */
+    PHASE_BODY,                         /**< Reading body until the server closes */
+} ParsePhase;
+
+typedef struct {
+    int         fd;                     /**< -1 when idle */
+    size_t      record;
+    size_t      written;                /**< Bytes of record sent */
+    uint64_t    started;
+    ParsePhase  phase;
+    size_t      line;                   /**< Bytes of current header line */
+    char        status[STATUS_BUFSIZ];
+    size_t      status_length;
+    uint64_t    checksum;               /**< FNV-1a of status line and body */
+    size_t      body;
+} Connection;
+
+typedef struct {
+    int         status;                 /**< HTTP status (0 = none, -1 = error) */
+    size_t      body;
+    uint64_t    checksum;
+    uint64_t    latency;
+} Result;
+
+/* Global Variables */
+
+static const char *Host     = "localhost";
+static const char *Service  = NULL;
+static const char *CapturePath = NULL;
+static const char *OutputPath  = NULL;
+static double      Speed    = 1;        /**< Multiple of recorded pace (0 = as fast as possible) */
+static size_t      Limit    = 64;       /**< Connections in flight at most */
+
+static Record     *Records  = NULL;
+static size_t      RecordsCount = 0;
+static Result     *Results  = NULL;
+static struct addrinfo *Address = NULL;
+
+/* Functions */
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [-x SPEED] [-c CONNECTIONS] [-o PATH] CAPTURE [HOST:]PORT\n", progname);
+    fprintf(stderr, "    -x  SPEED       Replay at SPEED times the recorded pace (1); 0 = as fast as possible\n");
+    fprintf(stderr, "    -c  CONNECTIONS Connections in flight at most (64)\n");
+    fprintf(stderr, "    -o  PATH        Write index, status, body length and checksum of each response\n");
+    fprintf(stderr, "                    (checksum of status line and body, in arrival order)\n");
+    exit(status);
+}
+
+/**
+ * Return current monotonic time in nanoseconds.
+ **/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Decode an unsigned LEB128 varint.
+ *
+ * @return  false if it runs past end.
+ **/
+static bool read_varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int record_compare(const void *a, const void *b) {
+    const Record *x = a, *y = b;
+    if (x->time != y->time) {
+        return x->time < y->time ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Map capture and order its records by arrival.
+ *
+ * A truncated last record (the server was still writing) is skipped.
+ **/
+static bool load_capture(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) < 0 || s.st_size < (off_t)sizeof(CaptureHeader)) {
+        fprintf(stderr, "Unable to read %s: not a capture\n", path);
+        close(fd);
+        return false;
+    }
+
+    const uint8_t *data = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED || memcmp(data, CAPTURE_MAGIC, sizeof(((CaptureHeader *)0)->magic))) {
+        fprintf(stderr, "Unable to read %s: not a capture\n", path);
+        return false;
+    }
+
+    size_t         capacity = 0;
+    const uint8_t *end = data + s.st_size;
+    const uint8_t *p   = data + sizeof(CaptureHeader);
+    while (p < end) {
+        uint64_t time, length;
+        if (!read_varint(&p, end, &time) || !read_varint(&p, end, &length) || length > (uint64_t)(end - p)) {
+            fprintf(stderr, "Skipping truncated record %zu\n", RecordsCount);
+            break;
+        }
+        if (RecordsCount == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            Records  = realloc(Records, capacity * sizeof(Record));
+            if (!Records) {
+                fatal("Unable to allocate records: %s", strerror(errno));
+            }
+        }
+        Records[RecordsCount] = (Record){time, (const char *)p, length, RecordsCount};
+        RecordsCount++;
+        p += length;
+    }
+
+    qsort(Records, RecordsCount, sizeof(Record), record_compare);
+    for (size_t i = 1; i < RecordsCount; i++) {
+        Records[i].time -= Records[0].time;
+    }
+    if (RecordsCount) {
+        Records[0].time = 0;
+    }
+    return true;
+}
+
+static void checksum_update(Connection *c, const char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        c->checksum = (c->checksum ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+}
+
+/**
+ * Hash status line and body of a response, skipping headers (Date differs
+ * on every run).
+ **/
+static void connection_consume(Connection *c, const char *data, size_t length) {
+    for (size_t i = 0; i < length && c->phase != PHASE_BODY; i++) {
+        char byte = data[i];
+        if (c->phase == PHASE_STATUS) {
+            if (byte == '\n') {
+                c->phase = PHASE_HEADERS;
+                c->line  = 0;
+            } else if (byte != '\r') {
+                checksum_update(c, &byte, 1);
+                if (c->status_length + 1 < STATUS_BUFSIZ) {
+                    c->status[c->status_length++] = byte;
+                }
+            }
+        } else if (byte == '\n') {
+            if (c->line == 0) {
+                c->phase = PHASE_BODY;
+                data    += i + 1;
+                length  -= i + 1;
+                break;
+            }
+            c->line = 0;
+        } else if (byte != '\r') {
+            c->line++;
+        }
+    }
+
+    if (c->phase == PHASE_BODY) {
+        checksum_update(c, data, length);
+        c->body += length;
+    }
+}
+
+static void connection_finish(int efd, Connection *c, bool success) {
+    Result *result = &Results[c->record];
+    result->status   = -1;
+    result->latency  = now_ns() - c->started;
+    if (success) {
+        c->status[c->status_length] = '\0';
+        char *code = strchr(c->status, ' ');
+        result->status   = code ? atoi(code + 1) : 0;
+        result->body     = c->body;
+        result->checksum = c->checksum;
+    }
+
+    epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static bool connection_open(int efd, Connection *c, size_t record) {
+    memset(c, 0, sizeof(Connection));
+    c->record   = record;
+    c->started  = now_ns();
+    c->checksum = 0xcbf29ce484222325ULL;
+    c->fd       = socket(Address->ai_family, Address->ai_socktype | SOCK_NONBLOCK, Address->ai_protocol);
+    if (c->fd < 0) {
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+        .data.ptr = c,
+    };
+    if ((connect(c->fd, Address->ai_addr, Address->ai_addrlen) < 0 && errno != EINPROGRESS) ||
+        epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send what the client sent, then half-close so the server sees the end of
+ * the request the way it did when the client was done.
+ **/
+static bool connection_write(int efd, Connection *c) {
+    const Record *record = &Records[c->record];
+    while (c->written < record->length) {
+        ssize_t n = send(c->fd, record->bytes + c->written, record->length - c->written, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN;
+        }
+        c->written += n;
+    }
+
+    shutdown(c->fd, SHUT_WR);
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLRDHUP,
+        .data.ptr = c,
+    };
+    epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &event);
+    return true;
+}
+
+/**
+ * Read response.
+ *
+ * @return  1 once the server closed, 0 if more is to come, -1 on error.
+ **/
+static int connection_read(Connection *c) {
+    char buffer[BUFSIZ];
+    while (true) {
+        ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+        if (n == 0) {
+            return 1;
+        }
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        connection_consume(c, buffer, n);
+    }
+}
+
+static bool parse_target(char *target) {
+    char *colon = strrchr(target, ':');
+    if (colon) {
+        *colon = '\0';
+        Host    = target;
+        Service = colon + 1;
+        if (target[0] == '[' && colon[-1] == ']') {
+            colon[-1] = '\0';
+            Host = target + 1;
+        }
+    } else {
+        Service = target;
+    }
+    return *Host && *Service;
+}
+
+static bool parse_options(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (strchr("xco", arg[1]) && argind >= argc) {
+            return false;
+        }
+
+        switch (arg[1]) {
+            case 'x': Speed      = strtod(argv[argind++], NULL); break;
+            case 'c': Limit      = strtoul(argv[argind++], NULL, 10); break;
+            case 'o': OutputPath = argv[argind++]; break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  return false;
+        }
+    }
+
+    if (argind != argc - 2 || Speed < 0 || !Limit) {
+        return false;
+    }
+
+    CapturePath = argv[argind];
+    return parse_target(argv[argind + 1]);
+}
+
+static int latency_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    if (!parse_options(argc, argv)) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+    if (!load_capture(CapturePath)) {
+        return EXIT_FAILURE;
+    }
+
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    int status = getaddrinfo(Host, Service, &hints, &Address);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    int         efd         = epoll_create1(0);
+    Connection *connections = calloc(Limit, sizeof(Connection));
+    Results = calloc(RecordsCount + 1, sizeof(Result));
+    if (efd < 0 || !connections || !Results) {
+        fatal("Unable to set up replay: %s", strerror(errno));
+    }
+    for (size_t i = 0; i < Limit; i++) {
+        connections[i].fd = -1;
+    }
+
+    /* Start each request at its recorded offset (scaled by speed), as soon
+     * as a connection is free; late requests go out at once */
+    uint64_t start  = now_ns();
+    size_t   next   = 0;
+    size_t   active = 0;
+    struct epoll_event events[256];
+
+    while (next < RecordsCount || active) {
+        uint64_t now = now_ns();
+        for (size_t i = 0; i < Limit && next < RecordsCount; i++) {
+            uint64_t due = Speed > 0 ? start + (uint64_t)(Records[next].time / Speed) : start;
+            if (due > now) {
+                break;
+            }
+            if (connections[i].fd >= 0) {
+                continue;
+            }
+            if (!connection_open(efd, &connections[i], next)) {
+                Results[next].status = -1;
+            } else {
+                active++;
+            }
+            next++;
+        }
+
+        int timeout = -1;
+        if (next < RecordsCount && active < Limit) {
+            uint64_t due = Speed > 0 ? start + (uint64_t)(Records[next].time / Speed) : start;
+            now     = now_ns();
+            timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+        }
+
+        int nevents = epoll_wait(efd, events, sizeof(events) / sizeof(events[0]), timeout);
+        if (nevents < 0 && errno != EINTR) {
+            fatal("Unable to epoll_wait: %s", strerror(errno));
+        }
+
+        for (int e = 0; e < nevents; e++) {
+            Connection *c    = events[e].data.ptr;
+            int         done = 0;
+
+            if (events[e].events & EPOLLOUT) {
+                int       error  = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                done = error || !connection_write(efd, c) ? -1 : 0;
+            }
+            if (!done && (events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                done = connection_read(c);
+            }
+            if (done) {
+                connection_finish(efd, c, done > 0);
+                active--;
+            }
+        }
+    }
+
+    double elapsed = (double)(now_ns() - start) / NSEC_PER_SEC;
+
+    /* Summarize, in arrival order so runs can be compared line by line */
+    FILE *output = OutputPath ? fopen(OutputPath, "w") : NULL;
+    if (OutputPath && !output) {
+        fatal("Unable to open %s: %s", OutputPath, strerror(errno));
+    }
+
+    size_t    errors = 0, classes[6] = {0};
+    uint64_t *latencies = calloc(RecordsCount + 1, sizeof(uint64_t));
+    if (!latencies) {
+        fatal("Unable to allocate latencies: %s", strerror(errno));
+    }
+    for (size_t i = 0; i < RecordsCount; i++) {
+        Result *result = &Results[i];
+        latencies[i] = result->latency;
+        if (result->status < 0) {
+            errors++;
+        } else {
+            classes[result->status / 100 < 6 ? result->status / 100 : 0]++;
+        }
+        if (output) {
+            fprintf(output, "%zu %d %zu %016lx\n", i, result->status, result->body, (unsigned long)result->checksum);
+        }
+    }
+    if (output) {
+        fclose(output);
+    }
+    qsort(latencies, RecordsCount, sizeof(uint64_t), latency_compare);
+
+    double recorded = RecordsCount ? (double)Records[RecordsCount - 1].time / NSEC_PER_SEC : 0;
+    if (Speed > 0) {
+        printf("Replayed %s against %s:%s at %gx the recorded pace\n", CapturePath, Host, Service, Speed);
+    } else {
+        printf("Replayed %s against %s:%s as fast as possible\n", CapturePath, Host, Service);
+    }
+    printf("    %zu requests in %.2fs (recorded over %.2fs), %zu errors\n", RecordsCount, elapsed, recorded, errors);
+    printf("    Status: %zu 2xx, %zu 3xx, %zu 4xx, %zu 5xx, %zu other\n", classes[2], classes[3], classes[4], classes[5], classes[0] + classes[1]);
+    printf("    Throughput: %.2f requests/s\n", RecordsCount / elapsed);
+    if (RecordsCount) {
+        printf("    Latency: p50 %.1fus, p99 %.1fus, max %.1fus\n",
+            latencies[RecordsCount / 2] / 1000.0, latencies[RecordsCount * 99 / 100] / 1000.0, latencies[RecordsCount - 1] / 1000.0);
+    }
+
+    freeaddrinfo(Address);
+    free(latencies);
+    free(connections);
+    free(Results);
+    free(Records);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,19 +1,70 @@
 /* request.c: HTTP Request Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <string.h>
+#include <strings.h>
 
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
 
+/**
+ * Read from the request socket, decrypting if it speaks TLS.
+ *
+ * Non-blocking sockets (in coroutines) are waited on until readable.  What
+ * is read is recorded when capturing traffic.
+ **/
+static ssize_t request_recv(Request *r, void *data, size_t length) {
+    while (true) {
+        ssize_t n = r->ssl ? tls_read(r, data, length) : read(r->fd, data, length);
+        if (n > 0) {
+            capture_append(r, data, n);
+        }
+        if (n >= 0 || errno != EAGAIN || coroutine_wait(r->fd, POLLIN, -1) < 0) {
+            return n;
+        }
+    }
+}
+
+/**
+ * Wait until the request socket accepts more bytes after a write returned
+ * EAGAIN (only non-blocking sockets in coroutines do).
+ *
+ * @return  true if the write should be retried.
+ **/
+static bool request_block(Request *r) {
+    return errno == EAGAIN && coroutine_wait(r->fd, POLLOUT, -1) > 0;
+}
+
+/**
+ * fopencookie write function for non-blocking sockets.
+ **/
+static ssize_t request_stream_write(void *cookie, const char *buffer, size_t size) {
+    return request_write(cookie, buffer, size, 0) < 0 ? 0 : (ssize_t)size;
+}
+
+/**
+ * fopencookie close function: closes the socket, like fclose on fdopen's
+ * stream would.
+ **/
+static int request_stream_close(void *cookie) {
+    Request *r = cookie;
+    return close(r->fd);
+}
+
 /**
  * Accept request from server socket.
  *
  * @param   sfd         Server socket file descriptor.
+ * @param   secure      Whether the listener terminates TLS.
  * @return  Newly allocated Request structure.
  *
  * This function does the following:
@@ -22,15 +73,19 @@ int parse_request_headers(Request *r);
  *  2. Initializes the headers list in the request struct.
  *  3. Accepts a client connection from the server socket.
  *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
+ *  5. Opens the client socket stream (used for writing) for the request struct.
  *  6. Returns the request struct.
  *
+ * For TLS connections the stream is only opened by tls_accept, after the
+ * handshake, which handle_request performs so a forking server does not
+ * handshake in the accepting process.
+ *
  * The returned request struct must be deallocated using free_request.
  **/
-Request * accept_request(int sfd) {
+Request * accept_request(int sfd, bool secure) {
     
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
 
     /* Allocate request struct (zeroed) */
     Request *r = calloc(1, sizeof(Request));
@@ -39,24 +94,36 @@ Request * accept_request(int sfd) {
         return NULL;
     }
 
-    /* Accept a client */
-    r->fd = accept(sfd, &raddr, &rlen);
+    /* Accept a client (non-blocking when a coroutine will handle it) */
+    r->trace = trace_request();
+    r->fd = trace(r, TRACE_ACCEPT, accept4(sfd, (struct sockaddr *)&raddr, &rlen, coroutine_active() ? SOCK_NONBLOCK : 0));
     if (r->fd < 0) {
         debug("Unable to accept: %s", strerror(errno));
         goto fail;
     }
 
-    /* Lookup client information */                     
-    int client_stat = getnameinfo( &raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
+    /* Lookup client information (Unix domain peers have no address) */
+    if (raddr.ss_family == AF_UNIX) {
+        strcpy(r->host, "unix");
+        strcpy(r->port, "0");
+    } else {
+        int client_stat = trace(r, TRACE_LOOKUP, getnameinfo((struct sockaddr *)&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV));
+
+        if (client_stat != 0) {
+            debug("Unable to getnameinfo: %s", gai_strerror(client_stat));
+            goto fail;
+        }
+    }
 
-    if (client_stat < 0) {
-        debug("Unable to getnameinfo: %s", gai_strerror(client_stat));
+    /* Turn away clients over their limits (callers see EAGAIN) */
+    r->secure = secure;
+    if (!limit_admit(r)) {
+        errno = EAGAIN;
         goto fail;
     }
 
-    /* Open socket stream */
-    r->stream = fdopen(r->fd, "w+");
-    if (!r->stream) {
+    /* Open socket stream (requests are read through request_gets) */
+    if (!secure && !(r->stream = request_stream(r))) {
         debug("Unable to fdopen: %s", strerror(errno));
         goto fail;
     }
@@ -65,11 +132,36 @@ Request * accept_request(int sfd) {
     return r;
 
 fail:
-    /* Deallocate request struct */
-    free_request(r);
+    /* Deallocate request struct (callers check errno, e.g. for EINTR) */
+    {
+        int error = errno;
+        free_request(r);
+        errno = error;
+    }
     return NULL;
 }
 
+/**
+ * Open the stream handlers write responses to over the request socket.
+ *
+ * @param   r           Request structure.
+ * @return  Stream (closing it closes the socket), or NULL on error.
+ *
+ * This is a plain stdio stream on the socket, except in coroutines, where
+ * the socket is non-blocking and the stream writes through request_write
+ * instead (which waits rather than fail on EAGAIN).
+ **/
+FILE * request_stream(Request *r) {
+    if (coroutine_active()) {
+        cookie_io_functions_t functions = {
+            .write = request_stream_write,
+            .close = request_stream_close,
+        };
+        return fopencookie(r, "w", functions);
+    }
+    return fdopen(r->fd, "w");
+}
+
 /**
  * Deallocate request struct.
  *
@@ -77,7 +169,9 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Shuts down any TLS session and closes the request socket stream or
+ *     file descriptor (no longer counting it against the client's limits,
+ *     and recording what the client sent when capturing traffic).
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
  *  4. Frees request struct.
@@ -88,12 +182,21 @@ void free_request(Request *r) {
     }
 
     /* Close socket or fd and free allocated strings */
+    if (r->ssl) {
+        if (r->stream) {
+            fflush(r->stream);
+        }
+        tls_shutdown(r);
+    }
+
     if (r->stream) { 
         fclose(r->stream); 
     }
     else {
         close(r->fd);
     }
+    limit_release(r);
+    capture_end(r);
 
     if (r->method) {
         free(r->method);  
@@ -109,16 +212,7 @@ void free_request(Request *r) {
     }
 
     /* Free headers */
-    Header *curr = r->headers;
-    Header *temp;
-    
-    while(curr) {
-        temp = curr->next;
-        free(curr->name);
-        free(curr->data);
-        free(curr);
-        curr = temp;
-    }
+    request_free_headers(r);
 
     /* Free request */
     free(r);
@@ -175,17 +269,25 @@ int parse_request_method(Request *r) {
     char *uri;
 
     /* Read line from socket */
-    if (!fgets(buffer, BUFSIZ, r->stream)) {
+    if (!request_gets(r, buffer, BUFSIZ)) {
         return -1;
     }    
 
-    /* Parse method and uri */      
-    method = strtok(buffer, WHITESPACE);
-    uri = strtok(NULL, WHITESPACE);
+    /* Parse method (a token) and uri (up to the next space or CRLF) */
+    size_t length = strlen(buffer);
+    size_t n = scan_span(buffer, length, SCAN_TOKEN);
+    if (n == 0 || buffer[n] != ' ') {
+        return -1;
+    }
+    method = buffer;
+    method[n] = '\0';
 
-    if (!method || !uri) {
+    uri = method + n + 1;
+    n = scan_until(uri, buffer + length - uri, SCAN_DELIMITER);
+    if (n == 0) {
         return -1;
     }
+    uri[n] = '\0';
 
     /* Parse query from uri */
     char *query = strchr(uri, '?');
@@ -239,71 +341,380 @@ int parse_request_method(Request *r) {
  *      headers.append(header)
  **/
 int parse_request_headers(Request *r) {
-    Header *curr = NULL;
     char buffer[BUFSIZ];
-    char *name;
     char *data;
 
-    /* Parse headers from socket */  
-
-    if(!r->stream) {
-        goto fail;
-    }
-
-    while(fgets(buffer, BUFSIZ, r->stream) && strlen(buffer) > 2){
-        data = strchr(buffer, ':');
-
-        if(!data) {
+    /* Parse headers from socket: a token name directly followed by ':',
+     * optional whitespace, then a value that ends at CRLF (any other
+     * control character is rejected) */
+    size_t length;
+    while(request_gets(r, buffer, BUFSIZ) && (length = strlen(buffer)) > 2){
+        size_t n = scan_span(buffer, length, SCAN_TOKEN);
+        if(n == 0 || buffer[n] != ':') {
             goto fail;
         }
 
-        *data = '\0';
-        data++;
-        data = skip_whitespace(data);
-        chomp(data);
+        buffer[n] = '\0';
+        data = buffer + n + 1;
+        data += scan_span(data, buffer + length - data, SCAN_WHITESPACE);
 
-        name = strdup(buffer);
-        if(!name) {
+        n = scan_until(data, buffer + length - data, SCAN_CONTROL);
+        if(data[n] != '\r' && data[n] != '\n' && data[n] != '\0') {
             goto fail;
         }
+        data[n] = '\0';
 
-        Header *newHeader = calloc(1, sizeof(Header));
-        if(!newHeader) {
-            fprintf(stderr, "error calloc newHeader: %s\n", strerror(errno));
+        if(request_add_header(r, buffer, data) < 0) {
+            fprintf(stderr, "error adding header: %s\n", strerror(errno));
             goto fail;
         }
-        
-        newHeader->name = name;
-        newHeader->data = strdup(data);
+    }
 
-        if(!newHeader->data) {
-            goto fail;
+#ifndef NDEBUG
+    for (Header *header = r->headers; header; header = header->next) {
+    	debug("HTTP HEADER %s = %s", header->name, header->data);
+    }
+#endif
+    return 0;
+
+fail:
+    return -1;
+}
+
+/**
+ * Read a line from the request socket.
+ *
+ * @param   r           Request structure.
+ * @param   s           Buffer to store line in.
+ * @param   size        Size of buffer.
+ * @return  s on success, NULL on end of stream or error.
+ *
+ * This behaves like fgets(3), but reads through the request's own input
+ * buffer so that bytes following the headers remain available to the
+ * handlers.  If the request has no socket (r->fd < 0), only bytes already
+ * in the input buffer are returned.
+ **/
+char * request_gets(Request *r, char *s, size_t size) {
+    size_t n = 0;
+
+    while (n + 1 < size) {
+        if (r->input_offset == r->input_length) {
+            if (r->fd < 0) {
+                break;
+            }
+
+            ssize_t nread = request_recv(r, r->input, sizeof(r->input));
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nread <= 0) {
+                break;
+            }
+            r->input_offset = 0;
+            r->input_length = nread;
         }
 
-        if(!r->headers) {
-            r->headers = newHeader;
+        char  *start = r->input + r->input_offset;
+        size_t avail = r->input_length - r->input_offset;
+        size_t want  = size - 1 - n;
+        char  *eol   = memchr(start, '\n', avail < want ? avail : want);
+        size_t take  = eol ? (size_t)(eol - start + 1) : (avail < want ? avail : want);
+
+        memcpy(s + n, start, take);
+        r->input_offset += take;
+        n += take;
+        if (eol) {
+            break;
         }
+    }
+
+    if (n == 0) {
+        return NULL;
+    }
+
+    s[n] = '\0';
+    return s;
+}
 
-        else {
-            curr->next = newHeader;
+/**
+ * Read exactly length bytes from the request socket.
+ *
+ * @param   r           Request structure.
+ * @param   data        Buffer to store bytes in.
+ * @param   length      Number of bytes to read.
+ * @return  Number of bytes read (less than length only at end of stream)
+ *          or -1 on error.
+ *
+ * Bytes already in the input buffer (e.g. read ahead by request_gets) are
+ * consumed first.
+ **/
+ssize_t request_read(Request *r, void *data, size_t length) {
+    size_t nread = 0;
+
+    while (nread < length) {
+        if (r->input_offset == r->input_length) {
+            if (r->fd < 0) {
+                break;
+            }
+
+            ssize_t n = request_recv(r, r->input, sizeof(r->input));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return -1;
+            }
+            if (n == 0) {
+                break;
+            }
+            r->input_offset = 0;
+            r->input_length = n;
         }
 
-        curr = newHeader;
-        curr->next = NULL;
+        size_t avail = r->input_length - r->input_offset;
+        size_t take  = avail < length - nread ? avail : length - nread;
+        memcpy((char *)data + nread, r->input + r->input_offset, take);
+        r->input_offset += take;
+        nread += take;
+    }
+
+    return nread;
+}
 
-        debug("Header: %s  %s", newHeader->name, newHeader->data);
-        
+/**
+ * Wait until request input is available.
+ *
+ * @param   r           Request structure.
+ * @param   timeout     Milliseconds to wait (-1 = forever).
+ * @return  true if input is buffered or the socket became readable.
+ **/
+bool request_wait(Request *r, int timeout) {
+    if (r->input_offset < r->input_length || tls_pending(r)) {
+        return true;
     }
 
-#ifndef NDEBUG
-    for (Header *header = r->headers; header; header = header->next) {
-    	debug("HTTP HEADER %s = %s", header->name, header->data);
+    return coroutine_wait(r->fd, POLLIN, timeout) > 0;
+}
+
+/**
+ * Append header to request.
+ *
+ * @param   r           Request structure.
+ * @param   name        Header name.
+ * @param   data        Header data.
+ * @return  -1 on error and 0 on success.
+ *
+ * The header is also indexed: well-known headers (see header_id) by ID,
+ * others in a bucket by case-insensitive hash of their name.  Repeated
+ * headers are chained after the first, which lookups return.
+ **/
+int request_add_header(Request *r, const char *name, const char *data) {
+    Header *header = calloc(1, sizeof(Header));
+    if (!header) {
+        return -1;
     }
-#endif
+
+    header->name = strdup(name);
+    header->data = strdup(data);
+    if (!header->name || !header->data) {
+        free(header->name);
+        free(header->data);
+        free(header);
+        return -1;
+    }
+
+    Header **tail = &r->headers;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = header;
+
+    header->id = header_id(name, strlen(name));
+    tail = header->id < HEADER_KNOWN ? &r->table.known[header->id] : &r->table.other[header_bucket(name)];
+    while (*tail) {
+        tail = &(*tail)->chain;
+    }
+    *tail = header;
     return 0;
+}
 
-fail:
-    return -1;
+/**
+ * Lookup request header by name.
+ *
+ * @param   r           Request structure.
+ * @param   name        Header name (case-insensitive).
+ * @return  Header data or NULL if the request has no such header.
+ **/
+const char *request_header(Request *r, const char *name) {
+    HeaderId id = header_id(name, strlen(name));
+    if (id < HEADER_KNOWN) {
+        return request_known_header(r, id);
+    }
+
+    for (Header *header = r->table.other[header_bucket(name)]; header; header = header->chain) {
+        if (strcasecmp(header->name, name) == 0) {
+            return header->data;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Lookup well-known request header by ID.
+ *
+ * @param   r           Request structure.
+ * @param   id          Well-known header ID.
+ * @return  Header data or NULL if the request has no such header.
+ **/
+const char *request_known_header(Request *r, HeaderId id) {
+    Header *header = id < HEADER_KNOWN ? r->table.known[id] : NULL;
+    return header ? header->data : NULL;
+}
+
+/**
+ * Free all of the request's headers and clear its header index.
+ *
+ * @param   r           Request structure.
+ **/
+void request_free_headers(Request *r) {
+    for (Header *header = r->headers, *next; header; header = next) {
+        next = header->next;
+        free(header->name);
+        free(header->data);
+        free(header);
+    }
+    r->headers = NULL;
+    memset(&r->table, 0, sizeof(r->table));
+}
+
+/**
+ * Write data to the request socket.
+ *
+ * @param   r           Request structure.
+ * @param   data        Data to write.
+ * @param   length      Number of bytes to write.
+ * @param   flags       send(2) flags (e.g. MSG_MORE when a body follows).
+ * @return  Number of bytes written or -1 on error.
+ **/
+ssize_t request_write(Request *r, const void *data, size_t length, int flags) {
+    size_t nwritten = 0;
+
+    /* Requests without a socket (e.g. HTTP/2 streams) write to their stream */
+    if (r->fd < 0) {
+        return fwrite(data, 1, length, r->stream) == length ? (ssize_t)length : -1;
+    }
+    if (r->ssl && !r->ktls) {
+        return tls_write(r, data, length);
+    }
+
+    while (nwritten < length) {
+        ssize_t n = send(r->fd, (const char *)data + nwritten, length - nwritten, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) {
+            n = write(r->fd, (const char *)data + nwritten, length - nwritten);
+        }
+        if (n < 0) {
+            if (errno == EINTR || request_block(r)) {
+                continue;
+            }
+            return -1;
+        }
+        nwritten += n;
+    }
+
+    return nwritten;
+}
+
+/**
+ * Write vector of buffers to the request socket with as few syscalls as
+ * possible.
+ *
+ * @param   r           Request structure.
+ * @param   iov         Array of buffers (modified to track progress).
+ * @param   iovcnt      Number of buffers.
+ * @return  Number of bytes written or -1 on error.
+ **/
+ssize_t request_writev(Request *r, struct iovec *iov, int iovcnt) {
+    size_t nwritten = 0;
+
+    if (r->fd < 0) {
+        for (int i = 0; i < iovcnt; i++) {
+            if (request_write(r, iov[i].iov_base, iov[i].iov_len, 0) < 0) {
+                return -1;
+            }
+            nwritten += iov[i].iov_len;
+        }
+        return nwritten;
+    }
+    if (r->ssl && !r->ktls) {
+        return tls_writev(r, iov, iovcnt);
+    }
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(r->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR || request_block(r)) {
+                continue;
+            }
+            return -1;
+        }
+        nwritten += n;
+
+        /* Advance past fully written buffers */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base  = (char *)iov->iov_base + n;
+            iov->iov_len  -= n;
+        }
+    }
+
+    return nwritten;
+}
+
+/**
+ * Copy file contents to the request socket without passing through user
+ * space.
+ *
+ * @param   r           Request structure.
+ * @param   fd          File descriptor of file to send.
+ * @param   offset      Offset in file to start at.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes written or -1 on error.
+ *
+ * Falls back to read/write if sendfile(2) is not supported for the
+ * descriptors involved, the request has no socket, or it speaks TLS without
+ * kernel offload (with kTLS the kernel encrypts what sendfile queues).
+ **/
+ssize_t request_sendfile(Request *r, int fd, off_t offset, size_t length) {
+    size_t nwritten = 0;
+    bool   copy = r->fd < 0 || (r->ssl && !r->ktls);
+
+    while (nwritten < length) {
+        ssize_t n = copy ? -1 : sendfile(r->fd, fd, &offset, length - nwritten);
+        if (copy || (n < 0 && (errno == EINVAL || errno == ENOSYS))) {
+            char buffer[BUFSIZ];
+            n = pread(fd, buffer, sizeof(buffer), offset);
+            if (n > 0 && request_write(r, buffer, n, 0) < 0) {
+                return -1;
+            }
+            offset += n > 0 ? n : 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR || request_block(r)) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        nwritten += n;
+    }
+
+    return nwritten;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
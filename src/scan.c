@@ -0,0 +1,262 @@
+/* scan.c: Character Class Scanning */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* Structures */
+
+/**
+ * Set of ASCII bytes in two forms: a table for the scalar kernel, and a
+ * bitmap for the vector kernels, where bit h of bitmap[l] is set if byte
+ * 0xhl is in the set.  A byte is then classified with two table lookups
+ * (PSHUFB) on its low and high nibbles, 16 or 32 bytes at a time.  Bytes
+ * of 0x80 and above are never members.
+ **/
+typedef struct {
+    uint8_t     bitmap[16];
+    bool        table[256];
+} ScanSet;
+
+typedef size_t (*ScanFunction)(const char *s, size_t length, const ScanSet *set, bool until);
+
+typedef struct {
+    const char  *name;
+    const char  *feature;               /**< CPU feature required (NULL = none) */
+    ScanFunction scan;
+} ScanKernel;
+
+/* Global Variables */
+
+static ScanSet Sets[SCAN_CLASSES];
+
+/**
+ * Add characters to a set.
+ **/
+static void scan_set_add(ScanSet *set, int first, int last) {
+    for (int c = first; c <= last; c++) {
+        set->table[c] = true;
+        set->bitmap[c & 0x0f] |= 1 << (c >> 4);
+    }
+}
+
+/**
+ * Add each character of a string to a set.
+ **/
+static void scan_set_add_string(ScanSet *set, const char *s) {
+    for (; *s; s++) {
+        scan_set_add(set, (unsigned char)*s, (unsigned char)*s);
+    }
+}
+
+/* Kernels */
+
+/**
+ * Scan one byte at a time.
+ *
+ * @param   s           Bytes to scan.
+ * @param   length      Number of bytes to scan.
+ * @param   set         Set of bytes.
+ * @param   until       Stop at the first byte in set (otherwise the first
+ *                      byte not in set).
+ * @return  Index of the byte scanning stopped at, or length.
+ **/
+static size_t scan_scalar(const char *s, size_t length, const ScanSet *set, bool until) {
+    size_t i = 0;
+    while (i < length && set->table[(unsigned char)s[i]] != until) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef SCAN_X86
+
+/**
+ * Scan 16 bytes at a time with SSSE3 nibble lookups (SSE4.2 CPUs).
+ **/
+__attribute__((target("sse4.2")))
+static size_t scan_sse42(const char *s, size_t length, const ScanSet *set, bool until) {
+    const __m128i bitmap = _mm_loadu_si128((const __m128i *)set->bitmap);
+    const __m128i bits   = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const unsigned flip  = until ? 0xffff : 0;
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i rows  = _mm_shuffle_epi8(bitmap, _mm_and_si128(block, nibble));
+        __m128i bit   = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(block, 4), nibble));
+        __m128i out   = _mm_cmpeq_epi8(_mm_and_si128(rows, bit), _mm_setzero_si128());
+        unsigned mask = (unsigned)_mm_movemask_epi8(out) ^ flip;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + scan_scalar(s + i, length - i, set, until);
+}
+
+/**
+ * Scan 32 bytes at a time with AVX2 nibble lookups.
+ *
+ * The tail is finished here with VEX-encoded 16-byte lookups rather than by
+ * calling scan_sse42: legacy SSE instructions after 256-bit ones, with the
+ * upper halves dirty, pay the AVX-SSE transition penalty, which made this
+ * the slowest kernel.  The upper halves are cleared before returning, as
+ * the compiler only does so itself when optimizing.
+ **/
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *s, size_t length, const ScanSet *set, bool until) {
+    const __m256i bitmap = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->bitmap));
+    const __m256i bits   = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const uint32_t flip  = until ? 0xffffffff : 0;
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i rows  = _mm256_shuffle_epi8(bitmap, _mm256_and_si256(block, nibble));
+        __m256i bit   = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble));
+        __m256i out   = _mm256_cmpeq_epi8(_mm256_and_si256(rows, bit), _mm256_setzero_si256());
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(out) ^ flip;
+        if (mask) {
+            _mm256_zeroupper();
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    if (i + 16 <= length) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i rows  = _mm_shuffle_epi8(_mm256_castsi256_si128(bitmap), _mm_and_si128(block, _mm256_castsi256_si128(nibble)));
+        __m128i bit   = _mm_shuffle_epi8(_mm256_castsi256_si128(bits), _mm_and_si128(_mm_srli_epi16(block, 4), _mm256_castsi256_si128(nibble)));
+        __m128i out   = _mm_cmpeq_epi8(_mm_and_si128(rows, bit), _mm_setzero_si128());
+        uint32_t mask = ((uint32_t)_mm_movemask_epi8(out) ^ flip) & 0xffff;
+        if (mask) {
+            _mm256_zeroupper();
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+
+    _mm256_zeroupper();
+    return i + scan_scalar(s + i, length - i, set, until);
+}
+
+#endif
+
+/* Dispatch */
+
+static const ScanKernel Kernels[] = {
+#ifdef SCAN_X86
+    {"avx2",    "avx2",   scan_avx2},
+    {"sse4.2",  "sse4.2", scan_sse42},
+#endif
+    {"scalar",  NULL,     scan_scalar},
+};
+
+static const ScanKernel *Kernel = &Kernels[sizeof(Kernels) / sizeof(ScanKernel) - 1];
+
+/**
+ * Determine whether the CPU can run a kernel.
+ **/
+static bool scan_supported(const ScanKernel *kernel) {
+#ifdef SCAN_X86
+    if (kernel->feature && streq(kernel->feature, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (kernel->feature && streq(kernel->feature, "sse4.2")) {
+        return __builtin_cpu_supports("sse4.2");
+    }
+#endif
+    return kernel->feature == NULL;
+}
+
+/**
+ * Build the character classes and pick the widest kernel the CPU supports.
+ **/
+__attribute__((constructor))
+static void scan_init(void) {
+    /* RFC 7230 tchar */
+    scan_set_add(&Sets[SCAN_TOKEN], '0', '9');
+    scan_set_add(&Sets[SCAN_TOKEN], 'A', 'Z');
+    scan_set_add(&Sets[SCAN_TOKEN], 'a', 'z');
+    scan_set_add_string(&Sets[SCAN_TOKEN], "!#$%&'*+-.^_`|~");
+
+    /* isspace(3) in the C locale */
+    scan_set_add_string(&Sets[SCAN_WHITESPACE], " \t\n\v\f\r");
+
+    /* Ends a request target: space or control character */
+    scan_set_add(&Sets[SCAN_DELIMITER], 0x00, 0x20);
+    scan_set_add(&Sets[SCAN_DELIMITER], 0x7f, 0x7f);
+
+    /* Ends a field value: control character other than tab (i.e. CR/LF) */
+    scan_set_add(&Sets[SCAN_CONTROL], 0x00, 0x08);
+    scan_set_add(&Sets[SCAN_CONTROL], 0x0a, 0x1f);
+    scan_set_add(&Sets[SCAN_CONTROL], 0x7f, 0x7f);
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t i = 0; i < sizeof(Kernels) / sizeof(ScanKernel); i++) {
+        if (scan_supported(&Kernels[i])) {
+            Kernel = &Kernels[i];
+            break;
+        }
+    }
+}
+
+/**
+ * Select a kernel by name (e.g. to compare them in benchmarks).
+ *
+ * @param   name        Kernel name: avx2, sse4.2, or scalar.
+ * @return  true if the kernel exists and the CPU supports it.
+ **/
+bool scan_select(const char *name) {
+    for (size_t i = 0; i < sizeof(Kernels) / sizeof(ScanKernel); i++) {
+        if (streq(Kernels[i].name, name) && scan_supported(&Kernels[i])) {
+            Kernel = &Kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Return the name of the kernel in use.
+ **/
+const char *scan_kernel(void) {
+    return Kernel->name;
+}
+
+/**
+ * Count the leading bytes of s that belong to a character class.
+ *
+ * @param   s           Bytes to scan.
+ * @param   length      Number of bytes to scan.
+ * @param   class       Character class.
+ * @return  Index of the first byte not in class, or length.
+ **/
+size_t scan_span(const char *s, size_t length, ScanClass class) {
+    return Kernel->scan(s, length, &Sets[class], false);
+}
+
+/**
+ * Count the leading bytes of s that do not belong to a character class.
+ *
+ * @param   s           Bytes to scan.
+ * @param   length      Number of bytes to scan.
+ * @param   class       Character class.
+ * @return  Index of the first byte in class, or length.
+ **/
+size_t scan_until(const char *s, size_t length, ScanClass class) {
+    return Kernel->scan(s, length, &Sets[class], true);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -10,18 +10,24 @@
 /**
  * Handle one HTTP request at a time.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listeners   Listening sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
  **/
-int single_server(int sfd) {
+int single_server(Listeners *listeners) {
 
-    /* Accept and handle HTTP request */
-    while (true) {
+    /* Accept and handle HTTP request until asked to drain */
+    while (!upgrade_poll(listeners, 1)) {
 
     	/* Accept request */
-        Request *r = accept_request(sfd);
+        int sfd = socket_wait(listeners);
+        if (sfd < 0) {
+            continue;
+        }
+        Request *r = accept_request(sfd, socket_secure(listeners, sfd));
         if (!r) {
-            log("Cannot accept request: %s", strerror(errno));
+            if (errno != EINTR && errno != EAGAIN) {
+                log("Cannot accept request: %s", strerror(errno));
+            }
             continue;
         }
 
@@ -32,8 +38,8 @@ int single_server(int sfd) {
         free_request(r);
     }
 
-    /* Close server socket */
-    close(sfd);
+    /* Close server sockets */
+    socket_close(listeners);
 
     return EXIT_SUCCESS;
 }
@@ -3,22 +3,195 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /**
- * Allocate socket, bind it, and listen to specified port.
+ * Apply configured socket options to a listening socket.
  *
- * @param   port        Port number to bind to and listen on.
- * @return  Allocated server socket file descriptor.
+ * @param   fd          Listening socket file descriptor.
+ * @param   family      Address family of socket.
+ * @return  0 on success, -1 on error.
+ *
+ * Options set on the listening socket (TCP_NODELAY, buffer sizes) are
+ * inherited by every connection accepted from it.
+ **/
+static int socket_tune(int fd, int family) {
+    int one = 1;
+
+    if (family != AF_UNIX && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Unable to set SO_REUSEADDR: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Every worker binds its own socket; the kernel spreads connections */
+    if (ListenOptions.reuseport && family != AF_UNIX && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Unable to set SO_REUSEPORT: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Let IPv4 and IPv6 wildcard sockets bind the same port side by side */
+    if (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Unable to set IPV6_V6ONLY: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (ListenOptions.sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &ListenOptions.sndbuf, sizeof(int)) < 0) {
+        fprintf(stderr, "Unable to set SO_SNDBUF: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (ListenOptions.rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ListenOptions.rcvbuf, sizeof(int)) < 0) {
+        fprintf(stderr, "Unable to set SO_RCVBUF: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (family == AF_UNIX) {
+        return 0;
+    }
+
+    if (ListenOptions.nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Unable to set TCP_NODELAY: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (ListenOptions.defer_accept && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &ListenOptions.defer_accept, sizeof(int)) < 0) {
+        fprintf(stderr, "Unable to set TCP_DEFER_ACCEPT: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (ListenOptions.fastopen && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &ListenOptions.fastopen, sizeof(int)) < 0) {
+        fprintf(stderr, "Unable to set TCP_FASTOPEN: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Allocate socket, tune it, bind it to address, and listen.
+ *
+ * @param   family      Address family.
+ * @param   addr        Address to bind to.
+ * @param   addrlen     Length of address.
+ * @return  Listening socket file descriptor or -1 on error.
  **/
-int socket_listen(const char *port) {
+static int socket_bind(int family, const struct sockaddr *addr, socklen_t addrlen) {
+    int socket_fd;
+
+    /* Allocate socket */
+    if ((socket_fd = socket(family, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Bind socket */
+    if (socket_tune(socket_fd, family) < 0 || bind(socket_fd, addr, addrlen) < 0) {
+        fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+
+    /* Listen to socket */
+    if (listen(socket_fd, ListenOptions.backlog) < 0) {
+        fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+/**
+ * Listen on a Unix domain socket.
+ *
+ * @param   path        Filesystem path of socket.
+ * @param   listeners   Set of listening sockets to add to.
+ * @return  Number of sockets added or -1 on error.
+ *
+ * A stale socket left behind at path by a previous run is removed first.
+ **/
+static int socket_listen_unix(const char *path, Listeners *listeners) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat s;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (stat(path, &s) == 0 && S_ISSOCK(s.st_mode)) {
+        unlink(path);
+    }
+
+    int socket_fd = socket_bind(AF_UNIX, (struct sockaddr *)&addr, sizeof(addr));
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    listeners->fds[listeners->count++] = socket_fd;
+    return 1;
+}
+
+/**
+ * Allocate sockets, bind them, and listen on the specified address.
+ *
+ * @param   address     Address to listen on: PORT, HOST:PORT, [IPV6]:PORT,
+ *                      or unix:PATH, optionally prefixed with tls: to
+ *                      terminate TLS on its connections.
+ * @param   listeners   Set of listening sockets to add to.
+ * @return  Number of sockets added or -1 on error.
+ *
+ * Every result getaddrinfo returns for the address is bound, so a bare port
+ * listens on both IPv4 and IPv6.
+ **/
+int socket_listen(const char *address, Listeners *listeners) {
+    char host[NI_MAXHOST] = "";
+
+    if (strncmp(address, "tls:", 4) == 0) {
+        size_t first = listeners->count;
+        int    added = socket_listen(address + 4, listeners);
+        for (size_t i = first; i < listeners->count; i++) {
+            listeners->secure[i] = true;
+        }
+        return added;
+    }
+
+    const char *port = address;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        if (listeners->count >= MAX_LISTENERS) {
+            fprintf(stderr, "Too many listening sockets\n");
+            return -1;
+        }
+        return socket_listen_unix(address + 5, listeners);
+    }
+
+    /* Split host from port */
+    const char *colon = strrchr(address, ':');
+    if (colon) {
+        const char *start = address;
+        const char *end   = colon;
+        if (*start == '[' && end[-1] == ']') {
+            start++;
+            end--;
+        }
+        snprintf(host, sizeof(host), "%.*s", (int)(end - start), start);
+        port = colon + 1;
+    }
+
     /* Lookup server address information */
     struct addrinfo hints = {
         .ai_family = AF_UNSPEC,
@@ -29,39 +202,214 @@ int socket_listen(const char *port) {
     struct addrinfo *results;
     int status;
 
-    if((status = getaddrinfo(NULL, port, &hints, &results)) != 0) {
+    if((status = getaddrinfo(host[0] ? host : NULL, port, &hints, &results)) != 0) {
         fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
         return -1;
     }
 
-    /* For each server entry, allocate socket and try to connect */
-    int socket_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
-	/* Allocate socket */
-        if((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
-            fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
-            continue;
+    /* For each server entry, allocate socket and listen */
+    int added = 0;
+    for (struct addrinfo *p = results; p != NULL; p = p->ai_next) {
+        if (listeners->count >= MAX_LISTENERS) {
+            fprintf(stderr, "Too many listening sockets\n");
+            break;
         }
 
-	/* Bind socket */
-        if(bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
-            fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
-            close(socket_fd);
-            socket_fd = -1;
-            continue;
+        int socket_fd = socket_bind(p->ai_family, p->ai_addr, p->ai_addrlen);
+        if (socket_fd >= 0) {
+            listeners->fds[listeners->count++] = socket_fd;
+            added++;
+        }
+    }
+
+    freeaddrinfo(results);
+    return added ? added : -1;
+}
+
+/**
+ * Wait until one of the listening sockets has a connection to accept.
+ *
+ * @param   listeners   Set of listening sockets.
+ * @return  Listening socket file descriptor that is ready, or -1 on error
+ *          (including EINTR, so servers can act on signals).
+ *
+ * With a single listener there is nothing to multiplex, so its descriptor
+ * is returned immediately and accept(2) does the waiting.
+ **/
+int socket_wait(Listeners *listeners) {
+    struct pollfd pfds[MAX_LISTENERS];
+
+    if (listeners->count == 1) {
+        return listeners->fds[0];
+    }
+
+    for (size_t i = 0; i < listeners->count; i++) {
+        pfds[i].fd     = listeners->fds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    if (poll(pfds, listeners->count, -1) < 0) {
+        return -1;
+    }
+
+    /* Start scanning after the last socket served so none is starved */
+    for (size_t i = 0; i < listeners->count; i++) {
+        size_t index = (listeners->next + i) % listeners->count;
+        if (pfds[index].revents & POLLIN) {
+            listeners->next = index + 1;
+            return pfds[index].fd;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Determine whether a listening socket terminates TLS.
+ *
+ * @param   listeners   Set of listening sockets.
+ * @param   fd          Listening socket file descriptor.
+ * @return  true if fd was listed with the tls: prefix.
+ **/
+bool socket_secure(Listeners *listeners, int fd) {
+    for (size_t i = 0; i < listeners->count; i++) {
+        if (listeners->fds[i] == fd) {
+            return listeners->secure[i];
+        }
+    }
+    return false;
+}
+
+/**
+ * Bind another set of listening sockets to the same addresses.
+ *
+ * @param   listeners   Set of listening sockets (bound with reuseport).
+ * @param   clone       Set of listening sockets to fill.
+ * @return  0 on success, -1 on error.
+ *
+ * Each TCP listener gets a new socket in the same SO_REUSEPORT group, so
+ * every worker has an accept queue of its own.  Sockets join a group in the
+ * order they are bound, which is the index socket_steer's program returns.
+ * Unix sockets cannot be shared that way and are duplicated instead.
+ **/
+int socket_clone(Listeners *listeners, Listeners *clone) {
+    *clone = (Listeners){.count = 0};
+
+    for (size_t i = 0; i < listeners->count; i++) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        int socket_fd;
+
+        if (getsockname(listeners->fds[i], (struct sockaddr *)&addr, &addrlen) < 0) {
+            fprintf(stderr, "Unable to get socket address: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (addr.ss_family == AF_UNIX) {
+            socket_fd = dup(listeners->fds[i]);
+        } else {
+            socket_fd = socket_bind(addr.ss_family, (struct sockaddr *)&addr, addrlen);
+        }
+        if (socket_fd < 0) {
+            socket_close(clone);
+            return -1;
         }
 
-    	/* Listen to socket */
-        if(listen(socket_fd, SOMAXCONN) < 0) {
-            fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
-            close(socket_fd);
-            socket_fd = -1;
+        clone->fds[clone->count]    = socket_fd;
+        clone->secure[clone->count] = listeners->secure[i];
+        clone->count++;
+    }
+
+    return 0;
+}
+
+/**
+ * Steer each connection to the worker pinned to the CPU that received it.
+ *
+ * @param   listeners   First set of listening sockets of each reuseport group.
+ * @param   cpus        CPU that worker i is pinned to, for each worker.
+ * @param   count       Number of workers.
+ * @return  0 on success, -1 on error.
+ *
+ * A classic BPF program attached to the group maps the CPU handling the
+ * incoming SYN to the index of that CPU's worker socket, so a connection is
+ * accepted, parsed, and answered on the core whose caches already hold it.
+ * CPUs without a worker fall through to the kernel's hash.
+ **/
+int socket_steer(Listeners *listeners, const int *cpus, size_t count) {
+    struct sock_filter code[2 * MAX_WORKERS + 2];
+    size_t length = 0;
+
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (size_t i = 0; i < count && i < MAX_WORKERS; i++) {
+        code[length++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+        code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+    struct sock_fprog program = {
+        .len    = length,
+        .filter = code,
+    };
+
+    for (size_t i = 0; i < listeners->count; i++) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+
+        if (getsockname(listeners->fds[i], (struct sockaddr *)&addr, &addrlen) < 0 || addr.ss_family == AF_UNIX) {
             continue;
         }
+
+        if (setsockopt(listeners->fds[i], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+            fprintf(stderr, "Unable to attach steering program: %s\n", strerror(errno));
+            return -1;
+        }
     }
 
-    freeaddrinfo(results);
-    return socket_fd;
+    return 0;
+}
+
+/**
+ * Close all listening sockets.
+ *
+ * @param   listeners   Set of listening sockets.
+ **/
+void socket_close(Listeners *listeners) {
+    for (size_t i = 0; i < listeners->count; i++) {
+        close(listeners->fds[i]);
+    }
+}
+
+/**
+ * Parse socket tuning option of the form name[=value] into ListenOptions.
+ *
+ * @param   option      Option string (e.g. "nodelay", "backlog=4096").
+ * @return  true if option was recognized, false otherwise.
+ **/
+bool socket_option(const char *option) {
+    const char *equals = strchr(option, '=');
+    int value = equals ? atoi(equals + 1) : 1;
+    size_t length = equals ? (size_t)(equals - option) : strlen(option);
+
+    if (length == 7 && strncmp(option, "nodelay", length) == 0) {
+        ListenOptions.nodelay = value != 0;
+    } else if (length == 12 && strncmp(option, "defer_accept", length) == 0) {
+        ListenOptions.defer_accept = value;
+    } else if (length == 8 && strncmp(option, "fastopen", length) == 0) {
+        ListenOptions.fastopen = value;
+    } else if (length == 6 && strncmp(option, "sndbuf", length) == 0) {
+        ListenOptions.sndbuf = value;
+    } else if (length == 6 && strncmp(option, "rcvbuf", length) == 0) {
+        ListenOptions.rcvbuf = value;
+    } else if (length == 7 && strncmp(option, "backlog", length) == 0 && value > 0) {
+        ListenOptions.backlog = value;
+    } else if (length == 9 && strncmp(option, "reuseport", length) == 0) {
+        ListenOptions.reuseport = value != 0;
+    } else {
+        return false;
+    }
+
+    return true;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,8 +1,12 @@
 /* spidey: Simple HTTP Server */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -14,6 +18,22 @@ char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
 
+SocketOptions ListenOptions = {
+    .backlog = SOMAXCONN,
+};
+
+size_t Workers  = 1;
+size_t WorkerId = 0;
+
+static char *Addresses[MAX_LISTENERS];  /**< Addresses given with -l */
+static size_t AddressesCount = 0;
+static char *CertificatePath = NULL;    /**< PEM certificate chain for tls: listeners */
+static char *KeyPath = NULL;            /**< PEM private key for tls: listeners */
+static size_t WorkersRequested = 0;     /**< Prefork workers given with -w (0 = one per CPU) */
+static char *ManifestPath = NULL;       /**< Hot-file manifest given with -H */
+static char *TracePath = NULL;          /**< Chrome trace JSON given with -T */
+static char *CapturePath = NULL;        /**< Traffic capture given with -W */
+
 /**
  * Display usage message and exit with specified status code.
  *
@@ -21,14 +41,36 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hcwmMprlsSKPBCHLRTFXNW]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -c mode       Single, Forking, Prefork or Event mode\n");
+    fprintf(stderr, "    -w workers    Number of prefork workers (default: one per CPU)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
-    fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -r path       Root directory (or archive made by spidey-pack)\n");
+    fprintf(stderr, "    -l address    Listen on PORT, HOST:PORT, [IPV6]:PORT or unix:PATH (repeatable);\n");
+    fprintf(stderr, "                  prefix with tls: to terminate TLS\n");
+    fprintf(stderr, "    -s option     Socket option: nodelay, defer_accept=SECS, fastopen=QLEN,\n");
+    fprintf(stderr, "                  sndbuf=BYTES, rcvbuf=BYTES, backlog=N, reuseport (repeatable)\n");
+    fprintf(stderr, "    -S path       TLS certificate chain (PEM)\n");
+    fprintf(stderr, "    -K path       TLS private key (PEM)\n");
+    fprintf(stderr, "    -P route      Proxy PREFIX=HOST:PORT[,HOST:PORT...] upstream (repeatable)\n");
+    fprintf(stderr, "    -B policy     Proxy balancing: roundrobin or leastconn\n");
+    fprintf(stderr, "    -C ttl[,max]  Cache CGI output for ttl seconds (0 = only with max-age),\n");
+    fprintf(stderr, "                  bounded to max bytes in total\n");
+    fprintf(stderr, "    -H path       Hot-file manifest: saved on upgrade (SIGUSR2), pre-warmed at start\n");
+    fprintf(stderr, "    -L path       Load handler module (shared object; repeatable)\n");
+    fprintf(stderr, "    -R rate[,burst[,conns]]\n");
+    fprintf(stderr, "                  Limit each client to rate requests/s (0 = no rate limit),\n");
+    fprintf(stderr, "                  burst requests at once and conns connections at once\n");
+    fprintf(stderr, "    -T path       Trace request phases, written as Chrome trace JSON on SIGUSR1 and exit\n");
+    fprintf(stderr, "    -F bytes      Stream files this large past the page cache (default: 64 MiB, 0 = never)\n");
+    fprintf(stderr, "    -X bytes      Share a content cache of small files' headers and bodies\n");
+    fprintf(stderr, "    -N paths      Reject requests for missing files without touching the filesystem\n");
+    fprintf(stderr, "                  (filter sized for paths files under root, kept current with inotify)\n");
+    fprintf(stderr, "    -W path       Capture requests and their arrival times for spidey-replay\n");
     exit(status);
 }
 
@@ -40,8 +82,11 @@ void usage(const char *progname, int status) {
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, workers, MimeTypesPath, DefaultMimeType, Port, RootPath,
+ * listening addresses, socket options, TLS certificate and key, proxy
+ * routes, CGI caching, the hot-file manifest, handler modules, client
+ * limits, the trace file, the large file size, the content cache, the
+ * negative lookup filter and the traffic capture if specified.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
     int argind = 1;
@@ -53,6 +98,11 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    	    *mode = SINGLE;
                 } else if (streq(argv[argind], "forking")) {
 	    	    *mode = FORKING;
+                } else if (streq(argv[argind], "prefork")) {
+	    	    *mode = PREFORK;
+	    	    ListenOptions.reuseport = true;
+	    	} else if (streq(argv[argind], "event")) {
+	    	    *mode = EVENT;
 	    	} else {
 	    	    return false;
 	    	}
@@ -61,6 +111,12 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    case 'h':
 	    	usage(argv[0], EXIT_SUCCESS);
 	    	break;
+	    case 'w':
+	    	WorkersRequested = strtoul(argv[argind++], NULL, 10);
+	    	if (WorkersRequested < 1 || WorkersRequested > MAX_WORKERS) {
+	    	    return false;
+	    	}
+	    	break;
 	    case 'm':
 	    	MimeTypesPath = argv[argind++];
 	    	break;
@@ -73,6 +129,72 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    case 'r':
 	    	RootPath = argv[argind++];
 	    	break;
+	    case 'l':
+	    	if (AddressesCount == MAX_LISTENERS) {
+	    	    return false;
+	    	}
+	    	Addresses[AddressesCount++] = argv[argind++];
+	    	break;
+	    case 's':
+	    	if (!socket_option(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'S':
+	    	CertificatePath = argv[argind++];
+	    	break;
+	    case 'K':
+	    	KeyPath = argv[argind++];
+	    	break;
+	    case 'P':
+	    	if (!proxy_add_route(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'B':
+	    	if (!proxy_set_balance(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'C':
+	    	if (!cgi_cache_configure(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'H':
+	    	ManifestPath = argv[argind++];
+	    	break;
+	    case 'L':
+	    	if (!module_load(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'R':
+	    	if (!limit_configure(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'T':
+	    	TracePath = argv[argind++];
+	    	break;
+	    case 'F':
+	    	if (!large_file_configure(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'X':
+	    	if (!content_configure(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'N':
+	    	if (!filter_configure(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'W':
+	    	CapturePath = argv[argind++];
+	    	break;
 	    default:
 	        return false;
 	    	break;
@@ -96,36 +218,131 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    /* Listen to server socket */
-     int server_fd = socket_listen(Port);
-     if (server_fd < 0) {
+    /* Prefork runs one worker per CPU unless told otherwise */
+    if (mode == PREFORK) {
+        cpu_set_t allowed;
+        Workers = WorkersRequested;
+        if (!Workers) {
+            Workers = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+        }
+        if (Workers > MAX_WORKERS) {
+            Workers = MAX_WORKERS;
+        }
+    }
+
+    /* Forked children serve one request each, so pooled upstream
+     * connections would only ever be closed */
+    ProxyPooling = mode != FORKING;
+
+    /* Clients that hang up mid-response must not take the server down */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* SIGUSR2 upgrades to a new binary, SIGQUIT drains and stops, SIGTERM
+     * and SIGINT stop without draining */
+    upgrade_init(argv, ManifestPath);
+
+    /* Listen to server sockets (every address Port resolves to by default),
+     * unless the process being upgraded hands its sockets over */
+    Listeners listeners = {0};
+    int inherited = upgrade_inherit(&listeners);
+    if (inherited < 0) {
+        return EXIT_FAILURE;
+    }
+    if (AddressesCount == 0) {
+        Addresses[AddressesCount++] = Port;
+    }
+    for (size_t i = 0; i < AddressesCount && !inherited; i++) {
+        if (socket_listen(Addresses[i], &listeners) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Load TLS certificate if any listener terminates TLS */
+    bool secure = false;
+    for (size_t i = 0; i < listeners.count; i++) {
+        secure = secure || listeners.secure[i];
+    }
+    if (secure) {
+        if (!CertificatePath || !KeyPath) {
+            fprintf(stderr, "tls: listeners require -S certificate and -K key\n");
+            return EXIT_FAILURE;
+        }
+        if (tls_init(CertificatePath, KeyPath) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Share proxy upstream and CGI cache state between server processes
+     * (with per-worker slots for the counters every request touches), the
+     * list of hot files, the limits of each client, and small files */
+    if (proxy_init() < 0 || cgi_cache_init() < 0 || resource_init() < 0 || limit_init() < 0 || content_init() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Record request phases into a ring per worker */
+    if (TracePath && trace_init(TracePath) < 0) {
         return EXIT_FAILURE;
     }
 
-    /* Determine real RootPath */
-    RootPath = realpath(RootPath, NULL);
-    if (!RootPath) {
-        debug("Could not determine root Path: %s", strerror(errno));
+    /* Append what clients send to the capture */
+    if (CapturePath && capture_init(CapturePath) < 0) {
+        return EXIT_FAILURE;
     }
 
-    log("Listening on port %s", Port);
+    /* Map archive given as root, or determine real RootPath */
+    struct stat root;
+    if (stat(RootPath, &root) == 0 && S_ISREG(root.st_mode)) {
+        if (archive_open(RootPath) < 0) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        RootPath = realpath(RootPath, NULL);
+        if (!RootPath) {
+            debug("Could not determine root Path: %s", strerror(errno));
+        }
+
+        /* Learn every path under the root before forking */
+        if (filter_init() < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Pre-warm before accepting, so workers forked later inherit the cache */
+    if (ManifestPath && !archive_enabled()) {
+        log("Pre-warmed %d hot files from %s", resource_prewarm(ManifestPath), ManifestPath);
+    }
+
+    for (size_t i = 0; i < AddressesCount && !inherited; i++) {
+        log("Listening on %s", Addresses[i]);
+    }
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == FORKING ? "Forking" : mode == PREFORK ? "Prefork" : "Event");
+
+    /* Let the process being upgraded (if any) drain */
+    upgrade_ready();
 
     /* Start either forking or single HTTP server */
     if (mode == SINGLE) {
         printf("single HTTP server");
-        status = single_server(server_fd);
+        status = single_server(&listeners);
     }
     else if (mode == FORKING) {
-        status = forking_server(server_fd);
+        status = forking_server(&listeners);
+    }
+    else if (mode == PREFORK) {
+        status = prefork_server(&listeners);
+    }
+    else if (mode == EVENT) {
+        status = event_server(&listeners);
     }
     else {
         return EXIT_FAILURE;
     }
 
+    trace_dump();
+    cgi_cache_cleanup();
     return status;
 }
 
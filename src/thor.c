@@ -0,0 +1,870 @@
+/* thor.c: HTTP Load Generator */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Macros */
+
+#define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
+
+/* Constants */
+
+#define MAX_DEPTH           64          /**< Maximum pipeline depth */
+#define HEADER_BUFSIZ       8192        /**< Maximum response header size */
+#define HIST_SUB_BITS       11          /**< 2048 sub-buckets per magnitude */
+#define HIST_HALF           (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS        28          /**< Covers 1us to ~37 hours */
+#define HIST_COUNTS         ((HIST_BUCKETS + 1) << (HIST_SUB_BITS - 1))
+#define NSEC_PER_SEC        1000000000ULL
+#define NSEC_PER_USEC       1000ULL
+
+/* Structures */
+
+/**
+ * Log-linear latency histogram (in the spirit of HdrHistogram).
+ *
+ * Values are recorded in microseconds with three significant digits of
+ * precision across the whole range.
+ */
+typedef struct {
+    uint64_t    counts[HIST_COUNTS];
+    uint64_t    total;
+    uint64_t    min;
+    uint64_t    max;
+    double      sum;
+    double      sum2;
+} Histogram;
+
+typedef enum {
+    CONN_CLOSED = 0,                    /**< No socket allocated */
+    CONN_CONNECTING,                    /**< Non-blocking connect in progress */
+    CONN_CONNECTED,                     /**< Socket ready for requests */
+} ConnState;
+
+typedef enum {
+    PHASE_HEADERS = 0,                  /**< Reading status line and headers */
+    PHASE_BODY,                         /**< Reading response body */
+} ParsePhase;
+
+typedef struct {
+    int         fd;
+    ConnState   state;
+    ParsePhase  phase;
+
+    char        rbuf[HEADER_BUFSIZ];    /**< Partial response headers */
+    size_t      rlen;
+    long long   remaining;              /**< Body bytes left (-1 = until EOF) */
+    bool        closing;                /**< Server will close after response */
+
+    uint64_t    intended[MAX_DEPTH];    /**< Intended start of each in-flight request */
+    uint64_t    started[MAX_DEPTH];     /**< Actual start of each in-flight request */
+    size_t      head;
+    size_t      inflight;               /**< Requests written or queued on socket */
+    size_t      unsent;                 /**< Requests not yet fully written */
+    size_t      woffset;                /**< Offset into request being written */
+    size_t      served;                 /**< Requests completed on this socket */
+} Connection;
+
+/* Global Variables */
+
+static const char *Host     = NULL;
+static const char *Service  = "80";
+static const char *Path     = "/";
+static char       *RequestText = NULL;
+static size_t      RequestLength = 0;
+static struct addrinfo *Address = NULL;
+
+static size_t   Hammers     = 1;        /**< Concurrent connections */
+static size_t   Throws      = 1;        /**< Requests per connection */
+static double   Duration    = 0;        /**< Run length in seconds (0 = use throws) */
+static double   Rate        = 0;        /**< Open-loop request rate (0 = closed loop) */
+static size_t   Depth       = 1;        /**< Pipeline depth per connection */
+static bool     KeepAlive   = false;
+static bool     Verbose     = false;
+static bool     Json        = false;    /**< Emit machine-readable summary */
+
+static Histogram Corrected;             /**< Latency from intended start */
+static Histogram Uncorrected;           /**< Latency from actual send */
+
+static uint64_t Issued      = 0;        /**< Requests handed to connections */
+static uint64_t Completed   = 0;        /**< Requests finished (any outcome) */
+static uint64_t Errors      = 0;        /**< Socket or protocol errors */
+static uint64_t Non2xx      = 0;        /**< Responses with status >= 300 */
+static uint64_t Reconnects  = 0;        /**< Sockets opened */
+static uint64_t BytesRead   = 0;        /**< Response bytes received */
+
+static uint64_t *Backlog    = NULL;     /**< Intended times awaiting a connection */
+static size_t    BacklogHead = 0;
+static size_t    BacklogSize = 0;
+static size_t    BacklogCapacity = 0;
+
+/* Functions */
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [-h HAMMERS -t THROWS] [options] URL\n", progname);
+    fprintf(stderr, "    -h  HAMMERS     Number of concurrent connections (1)\n");
+    fprintf(stderr, "    -t  THROWS      Number of requests per hammer (1)\n");
+    fprintf(stderr, "    -d  SECONDS     Run for duration instead of a fixed number of throws\n");
+    fprintf(stderr, "    -k              Reuse connections (HTTP/1.1 keep-alive)\n");
+    fprintf(stderr, "    -p  DEPTH       Pipeline up to DEPTH requests per connection (implies -k)\n");
+    fprintf(stderr, "    -R  RATE        Open-loop mode: issue RATE requests per second in total\n");
+    fprintf(stderr, "    -v              Display response bodies\n");
+    fprintf(stderr, "    -j              Print summary as a single JSON object\n");
+    exit(status);
+}
+
+/**
+ * Return current monotonic time in nanoseconds.
+ **/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Wait for events until timeout nanoseconds pass (-1 = forever).
+ *
+ * epoll_wait only takes milliseconds, which would send open-loop requests
+ * in 1 ms bursts at high rates, so epoll_pwait2 is used where available;
+ * otherwise the last partial millisecond is spent polling.
+ **/
+static int wait_events(int efd, struct epoll_event *events, int maxevents, int64_t timeout) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    static bool unsupported = false;
+    if (!unsupported) {
+        struct timespec ts = {timeout / NSEC_PER_SEC, timeout % NSEC_PER_SEC};
+        int nevents = epoll_pwait2(efd, events, maxevents, timeout < 0 ? NULL : &ts, NULL);
+        if (nevents >= 0 || errno != ENOSYS) {
+            return nevents;
+        }
+        unsupported = true;
+    }
+#endif
+    return epoll_wait(efd, events, maxevents, timeout < 0 ? -1 : (int)(timeout / 1000000));
+}
+
+/* Histogram */
+
+static size_t histogram_index(uint64_t value) {
+    int bucket = (63 - __builtin_clzll(value | ((1 << HIST_SUB_BITS) - 1))) - (HIST_SUB_BITS - 1);
+    if (bucket >= HIST_BUCKETS) {
+        return HIST_COUNTS - 1;
+    }
+    return ((size_t)bucket << (HIST_SUB_BITS - 1)) + (value >> bucket);
+}
+
+static uint64_t histogram_value(size_t index) {
+    if (index < (1 << HIST_SUB_BITS)) {
+        return index;
+    }
+
+    int bucket = (index >> (HIST_SUB_BITS - 1)) - 1;
+    uint64_t sub = (index & (HIST_HALF - 1)) + HIST_HALF;
+    return (sub << bucket) + ((1ULL << bucket) - 1);
+}
+
+static void histogram_record_n(Histogram *h, uint64_t value, uint64_t n) {
+    h->counts[histogram_index(value)] += n;
+    h->total += n;
+    h->sum   += (double)value * n;
+    h->sum2  += (double)value * value * n;
+    if (h->total == n || value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static void histogram_record(Histogram *h, uint64_t value) {
+    histogram_record_n(h, value, 1);
+}
+
+/**
+ * Back-fill samples that a closed-loop client could not have issued while it
+ * was blocked on a slow response (HdrHistogram's expected-interval correction).
+ **/
+static void histogram_correct(Histogram *dst, const Histogram *src, uint64_t interval) {
+    for (size_t i = 0; i < HIST_COUNTS; i++) {
+        uint64_t count = src->counts[i];
+        if (!count) {
+            continue;
+        }
+
+        uint64_t value = histogram_value(i);
+        histogram_record_n(dst, value, count);
+        if (!interval) {
+            continue;
+        }
+
+        for (uint64_t missing = value - interval; missing >= interval && missing < value; missing -= interval) {
+            histogram_record_n(dst, missing, count);
+        }
+    }
+}
+
+static uint64_t histogram_percentile(const Histogram *h, double percentile) {
+    uint64_t target = (uint64_t)ceil(h->total * percentile / 100.0);
+    uint64_t seen   = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (size_t i = 0; i < HIST_COUNTS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t value = histogram_value(i);
+            return value > h->max ? h->max : value;
+        }
+    }
+
+    return h->max;
+}
+
+static void histogram_print(const char *title, const Histogram *h) {
+    static const double Percentiles[] = {50, 75, 90, 99, 99.9, 99.99, 99.999, 100};
+
+    if (!h->total) {
+        printf("%s: no samples\n", title);
+        return;
+    }
+
+    double mean  = h->sum / h->total;
+    double stdev = sqrt(fmax(0, h->sum2 / h->total - mean * mean));
+
+    printf("%s (usec)\n", title);
+    printf("    Mean   %12.2f    StdDev %12.2f    Min %10lu    Max %10lu\n",
+        mean, stdev, (unsigned long)h->min, (unsigned long)h->max);
+    for (size_t i = 0; i < sizeof(Percentiles) / sizeof(double); i++) {
+        printf("    %8.3f%% %12lu\n", Percentiles[i], (unsigned long)histogram_percentile(h, Percentiles[i]));
+    }
+}
+
+/**
+ * Print the full percentile spectrum, halving the distance to 100% at each
+ * step the way HdrHistogram's percentile output does.
+ **/
+static void histogram_print_spectrum(const Histogram *h) {
+    printf("Latency distribution (usec)\n");
+    printf("    %12s %14s %12s\n", "Value", "Percentile", "TotalCount");
+
+    double   percentile = 0;
+    double   step       = 50;
+    uint64_t last       = UINT64_MAX;
+    while (h->total) {
+        uint64_t value = histogram_percentile(h, percentile);
+        if (value != last) {
+            uint64_t count = 0;
+            for (size_t i = 0; i < HIST_COUNTS && histogram_value(i) <= value; i++) {
+                count += h->counts[i];
+            }
+            printf("    %12lu %13.6f%% %12lu\n", (unsigned long)value, percentile, (unsigned long)count);
+            last = value;
+        }
+        if (percentile >= 100 || value == h->max) {
+            break;
+        }
+        percentile += step;
+        step /= 2;
+        if (step < 1e-6) {
+            percentile = 100;
+        }
+    }
+}
+
+static void histogram_print_json(const char *name, const Histogram *h) {
+    double mean  = h->total ? h->sum / h->total : 0;
+    double stdev = h->total ? sqrt(fmax(0, h->sum2 / h->total - mean * mean)) : 0;
+
+    printf("\"%s\": {\"count\": %lu, \"mean\": %.2f, \"stdev\": %.2f, \"min\": %lu, \"max\": %lu, "
+           "\"p50\": %lu, \"p75\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"p9999\": %lu}",
+        name, (unsigned long)h->total, mean, stdev, (unsigned long)h->min, (unsigned long)h->max,
+        (unsigned long)histogram_percentile(h, 50),   (unsigned long)histogram_percentile(h, 75),
+        (unsigned long)histogram_percentile(h, 90),   (unsigned long)histogram_percentile(h, 99),
+        (unsigned long)histogram_percentile(h, 99.9), (unsigned long)histogram_percentile(h, 99.99));
+}
+
+/* Request Scheduling */
+
+static bool backlog_push(uint64_t intended) {
+    if (BacklogSize == BacklogCapacity) {
+        size_t capacity = BacklogCapacity ? BacklogCapacity * 2 : 1024;
+        uint64_t *backlog = malloc(capacity * sizeof(uint64_t));
+        if (!backlog) {
+            return false;
+        }
+        for (size_t i = 0; i < BacklogSize; i++) {
+            backlog[i] = Backlog[(BacklogHead + i) % BacklogCapacity];
+        }
+        free(Backlog);
+        Backlog         = backlog;
+        BacklogHead     = 0;
+        BacklogCapacity = capacity;
+    }
+
+    Backlog[(BacklogHead + BacklogSize++) % BacklogCapacity] = intended;
+    return true;
+}
+
+static uint64_t backlog_pop(void) {
+    uint64_t intended = Backlog[BacklogHead];
+    BacklogHead = (BacklogHead + 1) % BacklogCapacity;
+    BacklogSize--;
+    return intended;
+}
+
+/* Connections */
+
+static void connection_close(int efd, Connection *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd       = -1;
+    c->state    = CONN_CLOSED;
+    c->phase    = PHASE_HEADERS;
+    c->rlen     = 0;
+    c->closing  = false;
+    c->unsent   = c->inflight;
+    c->woffset  = 0;
+    c->served   = 0;
+}
+
+static bool connection_open(int efd, Connection *c) {
+    c->fd = socket(Address->ai_family, Address->ai_socktype | SOCK_NONBLOCK, Address->ai_protocol);
+    if (c->fd < 0) {
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, Address->ai_addr, Address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP,
+        .data.ptr = c,
+    };
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+
+    c->state = CONN_CONNECTING;
+    Reconnects++;
+    return true;
+}
+
+/**
+ * Write as many queued requests as the socket will take.
+ **/
+static bool connection_flush(Connection *c) {
+    while (c->state == CONN_CONNECTED && c->unsent > 0) {
+        ssize_t nwritten = send(c->fd, RequestText + c->woffset, RequestLength - c->woffset, MSG_NOSIGNAL);
+        if (nwritten < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        c->woffset += nwritten;
+        if (c->woffset == RequestLength) {
+            c->woffset = 0;
+            c->unsent--;
+        }
+    }
+    return true;
+}
+
+/**
+ * Queue one request on the connection, opening a socket if needed.
+ **/
+static bool connection_issue(int efd, Connection *c, uint64_t intended) {
+    size_t slot = (c->head + c->inflight) % MAX_DEPTH;
+    c->intended[slot] = intended;
+    c->started[slot]  = now_ns();
+    c->inflight++;
+    c->unsent++;
+    Issued++;
+
+    if (c->state == CONN_CLOSED && !connection_open(efd, c)) {
+        return false;
+    }
+    return connection_flush(c);
+}
+
+static void connection_complete(Connection *c, bool success) {
+    uint64_t now = now_ns();
+
+    if (success) {
+        histogram_record(&Corrected,   (now - c->intended[c->head]) / NSEC_PER_USEC);
+        histogram_record(&Uncorrected, (now - c->started[c->head]) / NSEC_PER_USEC);
+    } else {
+        Errors++;
+    }
+
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->inflight--;
+    if (c->unsent > c->inflight) {
+        c->unsent = c->inflight;
+    }
+    c->served++;
+    Completed++;
+}
+
+/**
+ * Parse the status line and headers buffered in c->rbuf.
+ *
+ * @return  Number of header bytes consumed, 0 if incomplete, -1 on error.
+ **/
+static ssize_t connection_parse_headers(Connection *c) {
+    /* Tolerate bare LF line endings (CGI scripts often emit them) */
+    char  *end  = NULL;
+    size_t skip = 0;
+    for (char *lf = memchr(c->rbuf, '\n', c->rlen); lf; lf = memchr(lf + 1, '\n', c->rbuf + c->rlen - lf - 1)) {
+        size_t left = c->rbuf + c->rlen - lf - 1;
+        if (left >= 1 && lf[1] == '\n') {
+            end = lf, skip = 2;
+        } else if (left >= 2 && lf[1] == '\r' && lf[2] == '\n') {
+            end = lf, skip = 3;
+        }
+        if (end) {
+            break;
+        }
+    }
+    if (!end) {
+        return c->rlen == sizeof(c->rbuf) ? -1 : 0;
+    }
+    *end = '\0';
+
+    int major = 1, minor = 0, status = 0;
+    if (sscanf(c->rbuf, "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+        return -1;
+    }
+    if (status < 200 || status >= 300) {
+        Non2xx++;
+    }
+
+    c->remaining = -1;
+    c->closing   = !KeepAlive || (major == 1 && minor == 0);
+
+    for (char *line = strchr(c->rbuf, '\n'); line; line = strchr(line, '\n')) {
+        line += 1;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->remaining = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            char *value = line + 11 + strspn(line + 11, " \t");
+            if (strncasecmp(value, "close", 5) == 0) {
+                c->closing = true;
+            } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+                c->closing = !KeepAlive;
+            }
+        }
+    }
+
+    if (c->remaining < 0) {
+        c->closing = true;
+    }
+
+    c->phase = PHASE_BODY;
+    return end - c->rbuf + skip;
+}
+
+/**
+ * Consume response bytes, completing requests as their bodies finish.
+ **/
+static bool connection_consume(Connection *c, const char *data, size_t length) {
+    while (length > 0) {
+        if (c->inflight == 0) {
+            return false;
+        }
+
+        if (c->phase == PHASE_HEADERS) {
+            size_t n = sizeof(c->rbuf) - c->rlen;
+            n = n < length ? n : length;
+            memcpy(c->rbuf + c->rlen, data, n);
+            c->rlen += n;
+
+            ssize_t consumed = connection_parse_headers(c);
+            if (consumed < 0) {
+                return false;
+            }
+            if (consumed == 0) {
+                data += n;
+                length -= n;
+                continue;
+            }
+
+            /* Hand body bytes that were buffered with the headers back */
+            size_t extra = c->rlen - consumed;
+            data   = data + n - extra;
+            length = length - n + extra;
+            c->rlen = 0;
+        }
+
+        size_t n = length;
+        if (c->remaining >= 0 && (long long)n > c->remaining) {
+            n = c->remaining;
+        }
+        if (Verbose) {
+            fwrite(data, 1, n, stdout);
+        }
+        data   += n;
+        length -= n;
+        if (c->remaining >= 0) {
+            c->remaining -= n;
+            if (c->remaining == 0) {
+                c->phase = PHASE_HEADERS;
+                connection_complete(c, true);
+                if (c->closing) {
+                    return length == 0;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Drain the socket.
+ *
+ * @return  false once the connection needs to be closed.
+ **/
+static bool connection_read(Connection *c) {
+    char buffer[BUFSIZ * 8];
+
+    while (true) {
+        ssize_t nread = recv(c->fd, buffer, sizeof(buffer), 0);
+        if (nread < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return !(c->closing && c->inflight == 0);
+            }
+            return false;
+        }
+
+        if (nread == 0) {
+            /* Close-delimited body ends here */
+            if (c->inflight && c->phase == PHASE_BODY && c->remaining < 0) {
+                c->phase = PHASE_HEADERS;
+                connection_complete(c, true);
+            }
+            return false;
+        }
+
+        BytesRead += nread;
+        if (!connection_consume(c, buffer, nread)) {
+            return false;
+        }
+        if (c->closing && c->inflight == 0) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Parse URL of the form http://host[:port][/path].
+ **/
+static bool parse_url(char *url) {
+    static char port[NI_MAXSERV];
+
+    if (strncmp(url, "http://", 7) == 0) {
+        url += 7;
+    } else if (strstr(url, "://")) {
+        return false;
+    }
+
+    char *path = strchr(url, '/');
+    if (path) {
+        Path = strdup(path);
+        *path = '\0';
+    }
+
+    char *colon = strrchr(url, ':');
+    if (*url == '[') {
+        char *bracket = strchr(url, ']');
+        if (!bracket) {
+            return false;
+        }
+        *bracket = '\0';
+        colon = bracket[1] == ':' ? bracket + 1 : NULL;
+        url++;
+    }
+    if (colon) {
+        *colon = '\0';
+        snprintf(port, sizeof(port), "%s", colon + 1);
+        Service = port;
+    }
+
+    Host = url;
+    return *Host != '\0';
+}
+
+static bool parse_options(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        bool needs_value = strchr("htdpR", arg[1]) != NULL;
+        if (needs_value && argind >= argc) {
+            return false;
+        }
+
+        switch (arg[1]) {
+            case 'h': Hammers  = strtoul(argv[argind++], NULL, 10); break;
+            case 't': Throws   = strtoul(argv[argind++], NULL, 10); break;
+            case 'd': Duration = strtod(argv[argind++], NULL); break;
+            case 'p': Depth    = strtoul(argv[argind++], NULL, 10); KeepAlive = true; break;
+            case 'R': Rate     = strtod(argv[argind++], NULL); break;
+            case 'k': KeepAlive = true; break;
+            case 'v': Verbose   = true; break;
+            case 'j': Json      = true; break;
+            default:  return false;
+        }
+    }
+
+    if (argind != argc - 1 || !Hammers || !Throws || !Depth || Depth > MAX_DEPTH) {
+        return false;
+    }
+
+    return parse_url(argv[argind]);
+}
+
+int main(int argc, char *argv[]) {
+    if (!parse_options(argc, argv)) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    int status = getaddrinfo(Host, Service, &hints, &Address);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    /* Pre-render the request every throw sends */
+    RequestLength = asprintf(&RequestText,
+        "GET %s HTTP/%s\r\nHost: %s\r\nUser-Agent: thor\r\n%s\r\n",
+        Path, KeepAlive ? "1.1" : "1.0", Host,
+        KeepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+
+    int efd = epoll_create1(0);
+    if (efd < 0) {
+        fatal("Unable to epoll_create: %s", strerror(errno));
+    }
+
+    Connection *connections = calloc(Hammers, sizeof(Connection));
+    if (!connections) {
+        fatal("Unable to allocate connections: %s", strerror(errno));
+    }
+    for (size_t i = 0; i < Hammers; i++) {
+        connections[i].fd = -1;
+    }
+
+    size_t   depth    = KeepAlive ? Depth : 1;
+    uint64_t total    = Duration > 0 ? UINT64_MAX : (uint64_t)Hammers * Throws;
+    uint64_t start    = now_ns();
+    uint64_t deadline = Duration > 0 ? start + (uint64_t)(Duration * NSEC_PER_SEC) : UINT64_MAX;
+    uint64_t interval = Rate > 0 ? (uint64_t)(NSEC_PER_SEC / Rate) : 0;
+    uint64_t next     = start;
+    uint64_t scheduled = 0;
+    struct epoll_event events[256];
+
+    while (true) {
+        uint64_t now = now_ns();
+
+        /* Open loop: requests become due on a fixed schedule regardless of
+         * how quickly earlier ones completed, and wait in the backlog with
+         * their intended start time until a connection slot frees up. */
+        if (interval) {
+            while (next <= now && next < deadline && scheduled < total) {
+                if (!backlog_push(next)) {
+                    fatal("Unable to grow backlog: %s", strerror(errno));
+                }
+                scheduled++;
+                next += interval;
+            }
+        }
+
+        for (size_t i = 0; i < Hammers; i++) {
+            Connection *c = &connections[i];
+
+            /* Reconnect to retry requests a closed socket left unanswered */
+            if (c->state == CONN_CLOSED && c->inflight && !connection_open(efd, c)) {
+                while (c->inflight) {
+                    connection_complete(c, false);
+                }
+            }
+
+            while (c->inflight < depth && !(c->closing && c->inflight)) {
+                uint64_t intended;
+                if (interval) {
+                    if (!BacklogSize) {
+                        break;
+                    }
+                    intended = backlog_pop();
+                } else {
+                    if (Issued >= total || now >= deadline) {
+                        break;
+                    }
+                    intended = now_ns();
+                }
+
+                if (!connection_issue(efd, c, intended)) {
+                    connection_close(efd, c);
+                    connection_complete(c, false);
+                }
+                if (c->state != CONN_CONNECTED) {
+                    break;
+                }
+            }
+        }
+
+        bool issuing = interval ? (next < deadline && scheduled < total) || BacklogSize
+                                : (Issued < total && now < deadline);
+        if (!issuing && Completed == Issued) {
+            break;
+        }
+
+        int64_t timeout = -1;
+        if (interval && issuing && next < deadline) {
+            now = now_ns();
+            timeout = next > now ? (int64_t)(next - now) : 0;
+        } else if (deadline != UINT64_MAX) {
+            now = now_ns();
+            timeout = deadline > now ? (int64_t)(deadline - now) : 0;
+        }
+
+        int nevents = wait_events(efd, events, sizeof(events) / sizeof(events[0]), timeout);
+        if (nevents < 0 && errno != EINTR) {
+            fatal("Unable to epoll_wait: %s", strerror(errno));
+        }
+
+        for (int e = 0; e < nevents; e++) {
+            Connection *c = events[e].data.ptr;
+            bool ok = true;
+
+            if (c->state == CONN_CONNECTING && (events[e].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                if (error) {
+                    connection_close(efd, c);
+                    while (c->inflight) {
+                        connection_complete(c, false);
+                    }
+                    continue;
+                }
+                c->state = CONN_CONNECTED;
+            }
+
+            if (events[e].events & EPOLLOUT) {
+                ok = connection_flush(c);
+            }
+            if (ok && (events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                ok = connection_read(c);
+            }
+
+            if (!ok) {
+                /* Requests the server never answered are retried on a new
+                 * socket, unless the server dropped us without serving any. */
+                bool served = c->served > 0;
+                connection_close(efd, c);
+                if (!served) {
+                    while (c->inflight) {
+                        connection_complete(c, false);
+                    }
+                }
+            }
+        }
+
+        /* Deadline reached: stop waiting on requests still in flight */
+        if (now_ns() >= deadline) {
+            for (size_t i = 0; i < Hammers; i++) {
+                connection_close(efd, &connections[i]);
+                while (connections[i].inflight) {
+                    connections[i].head = (connections[i].head + 1) % MAX_DEPTH;
+                    connections[i].inflight--;
+                    Issued--;
+                }
+            }
+            BacklogSize = 0;
+            break;
+        }
+    }
+
+    double elapsed = (double)(now_ns() - start) / NSEC_PER_SEC;
+
+    /* Closed loop has no schedule, so correct with the mean service time as
+     * the expected interval between requests on each connection */
+    Histogram *corrected = &Corrected;
+    if (!interval && Uncorrected.total) {
+        corrected = calloc(1, sizeof(Histogram));
+        if (!corrected) {
+            fatal("Unable to allocate histogram: %s", strerror(errno));
+        }
+        histogram_correct(corrected, &Uncorrected, (uint64_t)(Uncorrected.sum / Uncorrected.total));
+    }
+
+    if (Json) {
+        printf("{\"url\": \"http://%s:%s%s\", \"loop\": \"%s\", \"rate\": %.2f, \"hammers\": %zu, "
+               "\"depth\": %zu, \"keepalive\": %s, \"requests\": %lu, \"errors\": %lu, \"non2xx\": %lu, "
+               "\"connections\": %lu, \"bytes\": %lu, \"elapsed\": %.6f, \"requests_per_sec\": %.2f, "
+               "\"bytes_per_sec\": %.2f, \"latency_usec\": {",
+            Host, Service, Path, interval ? "open" : "closed", Rate, Hammers, depth, KeepAlive ? "true" : "false",
+            (unsigned long)Completed, (unsigned long)Errors, (unsigned long)Non2xx, (unsigned long)Reconnects,
+            (unsigned long)BytesRead, elapsed, (Completed - Errors) / elapsed, BytesRead / elapsed);
+        histogram_print_json("uncorrected", &Uncorrected);
+        printf(", ");
+        histogram_print_json("corrected", corrected);
+        printf("}}\n");
+        goto done;
+    }
+
+    printf("%s %s://%s:%s%s\n", interval ? "Open loop" : "Closed loop", "http", Host, Service, Path);
+    printf("    %zu hammers, pipeline depth %zu, %s\n", Hammers, depth, KeepAlive ? "keep-alive" : "connection per request");
+    printf("    %lu requests in %.2fs, %lu errors, %lu non-2xx, %lu connections, %.2f MB read\n",
+        (unsigned long)Completed, elapsed, (unsigned long)Errors, (unsigned long)Non2xx,
+        (unsigned long)Reconnects, BytesRead / 1048576.0);
+    printf("    Throughput: %.2f requests/s, %.2f MB/s\n",
+        (Completed - Errors) / elapsed, BytesRead / 1048576.0 / elapsed);
+    histogram_print("Latency (uncorrected)", &Uncorrected);
+    histogram_print("Latency (corrected for coordinated omission)", corrected);
+    histogram_print_spectrum(corrected);
+
+done:
+    freeaddrinfo(Address);
+    free(RequestText);
+    free(connections);
+    return Errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
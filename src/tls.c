@@ -0,0 +1,267 @@
+/* tls.c: TLS Termination */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/* Constants */
+
+#define TLS_RECORD_SIZE     16384       /**< Largest TLS record payload */
+
+/* Global Variables */
+
+static SSL_CTX *TlsContext = NULL;
+
+/**
+ * Log the most recent OpenSSL error.
+ **/
+static void tls_log_error(const char *what) {
+    char buffer[256];
+    ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+    log("%s: %s", what, buffer);
+}
+
+/**
+ * Pick the application protocol offered by the client (ALPN).
+ *
+ * HTTP/2 is preferred; its connections start with the same preface as
+ * prior-knowledge h2c, so handle_request routes them without extra state.
+ **/
+static int tls_select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                           const unsigned char *in, unsigned int inlen, void *arg) {
+    static const unsigned char Protocols[] = "\x02h2\x08http/1.1";
+
+    if (SSL_select_next_proto((unsigned char **)out, outlen, Protocols, sizeof(Protocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Create the server TLS context.
+ *
+ * @param   certificate Path to PEM certificate chain.
+ * @param   key         Path to PEM private key.
+ * @return  0 on success, -1 on error.
+ *
+ * Must be called before the server forks: the session ticket keys are
+ * generated here, so every child can resume sessions issued by any other.
+ **/
+int tls_init(const char *certificate, const char *key) {
+    TlsContext = SSL_CTX_new(TLS_server_method());
+    if (!TlsContext) {
+        tls_log_error("Unable to create TLS context");
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(TlsContext, TLS1_2_VERSION);
+
+    /* Hand record encryption to the kernel when it supports it, so sendfile
+     * keeps working on TLS connections */
+    SSL_CTX_set_options(TlsContext, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    if (SSL_CTX_use_certificate_chain_file(TlsContext, certificate) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(TlsContext, key, SSL_FILETYPE_PEM) <= 0 ||
+        !SSL_CTX_check_private_key(TlsContext)) {
+        tls_log_error("Unable to load certificate or key");
+        SSL_CTX_free(TlsContext);
+        TlsContext = NULL;
+        return -1;
+    }
+
+    /* Session resumption: stateless tickets work across forked children,
+     * the in-process cache serves TLS 1.2 session IDs in single mode */
+    SSL_CTX_set_session_cache_mode(TlsContext, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(TlsContext, (const unsigned char *)"spidey", 6);
+    SSL_CTX_set_num_tickets(TlsContext, 1);
+
+    SSL_CTX_set_alpn_select_cb(TlsContext, tls_select_alpn, NULL);
+    return 0;
+}
+
+/**
+ * fopencookie write function for TLS connections without kTLS.
+ **/
+static ssize_t tls_stream_write(void *cookie, const char *buffer, size_t size) {
+    return tls_write(cookie, buffer, size) < 0 ? 0 : (ssize_t)size;
+}
+
+/**
+ * fopencookie close function: the TLS session is shut down separately, so
+ * only the socket is left to close.
+ **/
+static int tls_stream_close(void *cookie) {
+    Request *r = cookie;
+    return close(r->fd);
+}
+
+/**
+ * Wait for the socket when OpenSSL needs it to become readable or writable
+ * (only non-blocking sockets, in coroutines, ever ask).
+ *
+ * @param   r           Request structure.
+ * @param   error       Result of SSL_get_error for the failed call.
+ * @return  true if the call should be retried.
+ **/
+static bool tls_block(Request *r, int error) {
+    switch (error) {
+        case SSL_ERROR_WANT_READ:
+            return coroutine_wait(r->fd, POLLIN, -1) > 0;
+        case SSL_ERROR_WANT_WRITE:
+            return coroutine_wait(r->fd, POLLOUT, -1) > 0;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Perform the server side of the TLS handshake for a request.
+ *
+ * @param   r           Request accepted on a TLS listener.
+ * @return  0 on success, -1 on error.
+ *
+ * On success, r->stream writes through TLS: directly to the socket when the
+ * kernel took over record encryption (kTLS), via SSL_write otherwise.
+ **/
+int tls_accept(Request *r) {
+    if (!TlsContext || !(r->ssl = SSL_new(TlsContext)) || !SSL_set_fd(r->ssl, r->fd)) {
+        tls_log_error("Unable to create TLS session");
+        return -1;
+    }
+
+    int n;
+    while ((n = SSL_accept(r->ssl)) <= 0) {
+        if (!tls_block(r, SSL_get_error(r->ssl, n))) {
+            tls_log_error("TLS handshake failed");
+            return -1;
+        }
+    }
+
+    r->ktls = BIO_get_ktls_send(SSL_get_wbio(r->ssl));
+    if (r->ktls) {
+        r->stream = request_stream(r);
+    } else {
+        cookie_io_functions_t functions = {
+            .write = tls_stream_write,
+            .close = tls_stream_close,
+        };
+        r->stream = fopencookie(r, "w", functions);
+    }
+    if (!r->stream) {
+        debug("Unable to open TLS stream: %s", strerror(errno));
+        return -1;
+    }
+
+    log("TLS %s %s%s%s", SSL_get_version(r->ssl), SSL_get_cipher_name(r->ssl),
+        SSL_session_reused(r->ssl) ? " resumed" : "", r->ktls ? " kTLS" : "");
+    return 0;
+}
+
+/**
+ * Read decrypted bytes from a TLS connection.
+ *
+ * @return  Number of bytes read, 0 at end of stream, or -1 on error.
+ **/
+ssize_t tls_read(Request *r, void *data, size_t length) {
+    while (true) {
+        int n = SSL_read(r->ssl, data, length);
+        if (n > 0) {
+            return n;
+        }
+
+        int error = SSL_get_error(r->ssl, n);
+        if (error == SSL_ERROR_ZERO_RETURN) {
+            return 0;
+        }
+        if (!tls_block(r, error)) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Write bytes to a TLS connection.
+ *
+ * @return  Number of bytes written or -1 on error.
+ **/
+ssize_t tls_write(Request *r, const void *data, size_t length) {
+    size_t nwritten = 0;
+
+    while (nwritten < length) {
+        int n = SSL_write(r->ssl, (const char *)data + nwritten, length - nwritten);
+        if (n <= 0) {
+            if (tls_block(r, SSL_get_error(r->ssl, n))) {
+                continue;
+            }
+            return -1;
+        }
+        nwritten += n;
+    }
+
+    return nwritten;
+}
+
+/**
+ * Write vector of buffers to a TLS connection.
+ *
+ * @return  Number of bytes written or -1 on error.
+ *
+ * Small buffers (e.g. cached headers followed by a small file) are gathered
+ * so they leave in a single record instead of one record each.
+ **/
+ssize_t tls_writev(Request *r, const struct iovec *iov, int iovcnt) {
+    char   buffer[TLS_RECORD_SIZE];
+    size_t buffered = 0;
+    size_t nwritten = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (buffered + iov[i].iov_len > sizeof(buffer)) {
+            if (buffered && tls_write(r, buffer, buffered) < 0) {
+                return -1;
+            }
+            buffered = 0;
+        }
+
+        if (iov[i].iov_len > sizeof(buffer)) {
+            if (tls_write(r, iov[i].iov_base, iov[i].iov_len) < 0) {
+                return -1;
+            }
+        } else {
+            memcpy(buffer + buffered, iov[i].iov_base, iov[i].iov_len);
+            buffered += iov[i].iov_len;
+        }
+        nwritten += iov[i].iov_len;
+    }
+
+    if (buffered && tls_write(r, buffer, buffered) < 0) {
+        return -1;
+    }
+    return nwritten;
+}
+
+/**
+ * Determine whether decrypted bytes are waiting inside the TLS session.
+ **/
+bool tls_pending(Request *r) {
+    return r->ssl && SSL_pending(r->ssl) > 0;
+}
+
+/**
+ * Send close_notify (after a completed handshake) and free the session.
+ **/
+void tls_shutdown(Request *r) {
+    if (SSL_is_init_finished(r->ssl)) {
+        SSL_shutdown(r->ssl);
+    }
+    SSL_free(r->ssl);
+    r->ssl = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,234 @@
+/* trace.c: Per-Request Phase Tracing */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* USDT probe spidey:span(phase, request, start, duration) where available */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(phase, request, start, duration) DTRACE_PROBE4(spidey, span, phase, request, start, duration)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(phase, request, start, duration)
+#endif
+
+/* Constants */
+
+#define TRACE_SPANS     8192            /**< Spans kept per worker (power of two) */
+
+/* Structures */
+
+typedef struct {
+    uint64_t    start;                  /**< CLOCK_MONOTONIC nanoseconds */
+    uint64_t    duration;               /**< Nanoseconds */
+    uint32_t    request;                /**< Trace ID of request */
+    uint32_t    pid;                    /**< Process that recorded span */
+    uint32_t    phase;                  /**< TracePhase */
+    uint32_t    sequence;               /**< Low bits of index + 1 once written (0 = being written) */
+} TraceSpan;
+
+typedef struct {
+    uint64_t    next;                   /**< Index of next span */
+    uint64_t    requests;               /**< Requests traced by worker */
+    char        padding[CACHE_LINE - 2 * sizeof(uint64_t)];
+    TraceSpan   spans[TRACE_SPANS];
+} TraceRing;
+
+/* Global Variables */
+
+static const char *Phases[TRACE_PHASES] = {
+    [TRACE_REQUEST]     = "handle_request",
+    [TRACE_ACCEPT]      = "accept",
+    [TRACE_LOOKUP]      = "getnameinfo",
+    [TRACE_HANDSHAKE]   = "tls_accept",
+    [TRACE_PARSE]       = "parse_request",
+    [TRACE_CONTENT]     = "content_serve",
+    [TRACE_FILTER]      = "filter_missing",
+    [TRACE_PATH]        = "determine_request_path",
+    [TRACE_RESOURCE]    = "resource_lookup",
+    [TRACE_SEND]        = "send",
+    [TRACE_FILE]        = "handle_file_request",
+    [TRACE_BROWSE]      = "handle_browse_request",
+    [TRACE_CGI]         = "handle_cgi_request",
+    [TRACE_POPEN]       = "popen",
+    [TRACE_PROXY]       = "handle_proxy_request",
+    [TRACE_MODULE]      = "handle_module_request",
+    [TRACE_ARCHIVE]     = "handle_archive_request",
+    [TRACE_HTTP2]       = "handle_http2",
+};
+
+static TraceRing  *Rings = NULL;        /**< Ring per worker, shared by all server processes */
+static const char *TracePath = NULL;    /**< Where trace_dump writes */
+static pid_t       TraceOwner = 0;      /**< Process that dumps (the one started) */
+static pid_t       TracePid = 0;        /**< This process (getpid is a system call) */
+static volatile sig_atomic_t TraceRequested = 0;
+
+/**
+ * Record a dump request (SIGUSR1); trace_poll acts on it.
+ **/
+static void trace_signal(int signum) {
+    TraceRequested = 1;
+}
+
+/**
+ * Note the pid of a newly forked process.
+ **/
+static void trace_fork(void) {
+    TracePid = getpid();
+}
+
+/**
+ * Map a span ring per worker and have SIGUSR1 dump them.
+ *
+ * @param   path        Chrome trace JSON file written by trace_dump.
+ * @return  0 on success, -1 on error.
+ *
+ * Must be called once the number of workers is known and before the server
+ * forks, so every process records into the same rings.
+ **/
+int trace_init(const char *path) {
+    Rings = mmap(NULL, Workers * sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Rings == MAP_FAILED) {
+        fprintf(stderr, "Unable to map trace rings: %s\n", strerror(errno));
+        Rings = NULL;
+        return -1;
+    }
+
+    struct sigaction action = {.sa_handler = trace_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    pthread_atfork(NULL, NULL, trace_fork);
+
+    TracePath  = path;
+    TraceOwner = TracePid = getpid();
+    log("Tracing the last %d spans per worker to %s (on SIGUSR1 and exit)", TRACE_SPANS, path);
+    return 0;
+}
+
+/**
+ * Assign a request its trace ID.
+ *
+ * @return  Trace ID, unique across workers (0 if tracing is disabled).
+ **/
+uint32_t trace_request(void) {
+    if (!Rings) {
+        return 0;
+    }
+    uint64_t count = __atomic_add_fetch(&Rings[WorkerId].requests, 1, __ATOMIC_RELAXED);
+    return count * MAX_WORKERS + WorkerId;
+}
+
+/**
+ * Start timing a phase.
+ *
+ * @return  Current time (0 if tracing is disabled).
+ **/
+uint64_t trace_begin(void) {
+    if (!Rings) {
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Record a phase of a request that started at start (from trace_begin).
+ **/
+void trace_end(uint32_t request, TracePhase phase, uint64_t start) {
+    if (!start) {
+        return;
+    }
+
+    uint64_t duration = trace_begin() - start;
+    TRACE_PROBE(Phases[phase], request, start, duration);
+
+    /* Readers skip spans whose sequence is 0 or changes while they copy */
+    TraceRing *ring  = &Rings[WorkerId];
+    uint64_t   index = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+    TraceSpan *span  = &ring->spans[index & (TRACE_SPANS - 1)];
+
+    __atomic_store_n(&span->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    span->start    = start;
+    span->duration = duration;
+    span->request  = request;
+    span->pid      = TracePid;
+    span->phase    = phase;
+    __atomic_store_n(&span->sequence, (uint32_t)index + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write the spans of every worker as Chrome trace JSON (chrome://tracing,
+ * Perfetto): a process per server process, a thread per request.
+ *
+ * @return  Number of spans written, or -1 on error.
+ **/
+int trace_dump(void) {
+    if (!Rings) {
+        return 0;
+    }
+
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d", TracePath, getpid());
+    FILE *stream = fopen(temporary, "w");
+    if (!stream) {
+        log("Unable to write trace %s: %s", temporary, strerror(errno));
+        return -1;
+    }
+
+    int spans = 0;
+    fprintf(stream, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (size_t w = 0; w < Workers; w++) {
+        for (size_t i = 0; i < TRACE_SPANS; i++) {
+            TraceSpan *slot     = &Rings[w].spans[i];
+            uint32_t   sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+            TraceSpan  span     = *slot;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (!sequence || sequence != __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) || span.phase >= TRACE_PHASES) {
+                continue;
+            }
+
+            fprintf(stream, "%s\n{\"name\":\"%s\",\"cat\":\"spidey\",\"ph\":\"X\",\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,\"pid\":%u,\"tid\":%u}",
+                    spans++ ? "," : "", Phases[span.phase],
+                    (unsigned long)(span.start / 1000), (unsigned long)(span.start % 1000),
+                    (unsigned long)(span.duration / 1000), (unsigned long)(span.duration % 1000),
+                    span.pid, span.request);
+        }
+    }
+    fprintf(stream, "\n]}\n");
+
+    if (fclose(stream) != 0 || rename(temporary, TracePath) < 0) {
+        log("Unable to write trace %s: %s", TracePath, strerror(errno));
+        unlink(temporary);
+        return -1;
+    }
+
+    log("Wrote %d trace spans to %s", spans, TracePath);
+    return spans;
+}
+
+/**
+ * Dump the trace if SIGUSR1 asked for it (in the process that started
+ * tracing; workers leave it to that one).
+ **/
+void trace_poll(void) {
+    if (TraceRequested && TracePid == TraceOwner) {
+        TraceRequested = 0;
+        trace_dump();
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,330 @@
+/* upgrade.c: Graceful Binary Upgrade */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define UPGRADE_ENVIRONMENT "SPIDEY_UPGRADE_FD"
+#define UPGRADE_TIMEOUT     30000       /**< Milliseconds the new binary has to get ready */
+#define UPGRADE_READY       'R'
+
+/* Structures */
+
+/**
+ * Message describing one set of listening sockets; the descriptors travel
+ * alongside as SCM_RIGHTS ancillary data.
+ **/
+typedef struct {
+    uint32_t    index;                  /**< Worker the set belongs to */
+    uint32_t    count;                  /**< Number of descriptors */
+    bool        secure[MAX_LISTENERS];  /**< Whether connections speak TLS */
+} UpgradeSet;
+
+/* Global Variables */
+
+volatile sig_atomic_t Draining = 0;
+volatile sig_atomic_t Terminating = 0;
+
+static volatile sig_atomic_t UpgradeRequested = 0;
+static char     **Arguments = NULL;     /**< Command line to exec */
+static const char *Manifest = NULL;     /**< Hot-file manifest to hand over */
+static int        UpgradeFd = -1;       /**< Connection to the old process */
+static pid_t      ServerPid = 0;        /**< Process that installed the handlers */
+static Listeners  Inherited[MAX_WORKERS];
+static size_t     InheritedCount = 0;
+
+/**
+ * Record upgrade (SIGUSR2), graceful stop (SIGQUIT) and termination
+ * (SIGTERM, SIGINT) requests; server loops act on them once their blocking
+ * call returns EINTR.  Processes forked off the server terminate as they
+ * would have without the handler.
+ **/
+static void upgrade_signal(int signum) {
+    if (signum == SIGUSR2) {
+        UpgradeRequested = 1;
+    } else if (signum == SIGQUIT) {
+        Draining = 1;
+    } else if (getpid() == ServerPid) {
+        Terminating = 1;
+        Draining    = 1;
+    } else {
+        signal(signum, SIG_DFL);
+        raise(signum);
+    }
+}
+
+/**
+ * Install upgrade, graceful stop and termination signal handlers.
+ *
+ * @param   argv        Command line the new binary is started with.
+ * @param   manifest    Hot-file manifest to save before upgrading (or NULL).
+ *
+ * The handlers are installed without SA_RESTART so accept, poll and wait
+ * return to the server loop as soon as a signal arrives.  Terminating
+ * returns from the server too (instead of dying on the default action), so
+ * main still writes the trace and removes the CGI cache.
+ **/
+void upgrade_init(char *argv[], const char *manifest) {
+    struct sigaction action = {.sa_handler = upgrade_signal};
+
+    Arguments = argv;
+    Manifest  = manifest;
+    ServerPid = getpid();
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+    sigaction(SIGQUIT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+}
+
+/**
+ * Receive listening sockets from the process being upgraded.
+ *
+ * @param   listeners   Set of listening sockets to fill (worker 0's).
+ * @return  1 if sockets were inherited, 0 if this is not an upgrade, or -1
+ *          on error.
+ *
+ * Sets for other prefork workers are kept for upgrade_listeners, so each
+ * worker keeps its place in the SO_REUSEPORT groups; sets beyond the
+ * current number of workers are closed.
+ **/
+int upgrade_inherit(Listeners *listeners) {
+    const char *fd = getenv(UPGRADE_ENVIRONMENT);
+    if (!fd) {
+        return 0;
+    }
+    UpgradeFd = atoi(fd);
+    unsetenv(UPGRADE_ENVIRONMENT);
+    fcntl(UpgradeFd, F_SETFD, FD_CLOEXEC);
+
+    while (true) {
+        UpgradeSet set;
+        char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+        struct iovec  iov = {.iov_base = &set, .iov_len = sizeof(set)};
+        struct msghdr message = {
+            .msg_iov        = &iov,
+            .msg_iovlen     = 1,
+            .msg_control    = control,
+            .msg_controllen = sizeof(control),
+        };
+
+        ssize_t n = recvmsg(UpgradeFd, &message, MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+            fprintf(stderr, "Unable to receive listening sockets: %s\n", strerror(errno));
+            return -1;
+        }
+        if (n != sizeof(set) || set.count == 0) {
+            break;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || set.count > MAX_LISTENERS) {
+            fprintf(stderr, "Malformed listening socket handover\n");
+            return -1;
+        }
+
+        Listeners received = {.count = set.count};
+        memcpy(received.fds, CMSG_DATA(cmsg), set.count * sizeof(int));
+        memcpy(received.secure, set.secure, sizeof(received.secure));
+
+        if (set.index < Workers && set.index < MAX_WORKERS) {
+            Inherited[set.index] = received;
+            InheritedCount = set.index + 1 > InheritedCount ? set.index + 1 : InheritedCount;
+        } else {
+            socket_close(&received);
+        }
+    }
+
+    if (!InheritedCount || !Inherited[0].count) {
+        fprintf(stderr, "No listening sockets were handed over\n");
+        return -1;
+    }
+
+    *listeners = Inherited[0];
+    log("Inherited %zu listening sockets from the old process", listeners->count);
+    return 1;
+}
+
+/**
+ * Fetch the listening sockets a prefork worker had in the old process.
+ *
+ * @param   worker      Index of worker.
+ * @param   listeners   Set of listening sockets to fill.
+ * @return  true if the old process handed over a set for worker.
+ **/
+bool upgrade_listeners(size_t worker, Listeners *listeners) {
+    if (worker >= InheritedCount || !Inherited[worker].count) {
+        return false;
+    }
+    *listeners = Inherited[worker];
+    return true;
+}
+
+/**
+ * Tell the old process this one is ready to accept connections.
+ **/
+void upgrade_ready(void) {
+    if (UpgradeFd >= 0) {
+        char ready = UPGRADE_READY;
+        if (write(UpgradeFd, &ready, 1) != 1) {
+            log("Unable to signal readiness: %s", strerror(errno));
+        }
+        close(UpgradeFd);
+        UpgradeFd = -1;
+    }
+}
+
+/**
+ * Start the new binary and hand it the listening sockets.
+ *
+ * @param   sets        Listening sockets of each worker.
+ * @param   count       Number of sets.
+ * @return  true once the new binary is ready, false if it failed to start.
+ *
+ * Runs in the helper process forked by upgrade_start, so waiting up to
+ * UPGRADE_TIMEOUT for the new binary never stalls the server.
+ **/
+static bool upgrade_spawn(Listeners *sets, size_t count) {
+    int pair[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) {
+        log("Unable to create upgrade socket: %s", strerror(errno));
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unable to fork new binary: %s", strerror(errno));
+        close(pair[0]);
+        close(pair[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        char fd[16];
+        snprintf(fd, sizeof(fd), "%d", pair[1]);
+        fcntl(pair[1], F_SETFD, 0);
+        setenv(UPGRADE_ENVIRONMENT, fd, 1);
+        signal(SIGCHLD, SIG_DFL);
+        execvp(Arguments[0], Arguments);
+        fprintf(stderr, "Unable to exec %s: %s\n", Arguments[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    close(pair[1]);
+
+    /* Send each set of listening sockets, then an empty set to finish */
+    bool ready = true;
+    for (size_t i = 0; i <= count && ready; i++) {
+        UpgradeSet set = {.index = i, .count = i < count ? sets[i].count : 0};
+        char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)] = {0};
+        struct iovec  iov = {.iov_base = &set, .iov_len = sizeof(set)};
+        struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1};
+
+        if (set.count) {
+            memcpy(set.secure, sets[i].secure, sizeof(set.secure));
+            message.msg_control    = control;
+            message.msg_controllen = CMSG_SPACE(sizeof(int) * set.count);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type  = SCM_RIGHTS;
+            cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * set.count);
+            memcpy(CMSG_DATA(cmsg), sets[i].fds, sizeof(int) * set.count);
+        }
+
+        ready = sendmsg(pair[0], &message, MSG_NOSIGNAL) == sizeof(set);
+    }
+
+    /* Wait for the new binary to say it is ready */
+    struct pollfd pfd = {.fd = pair[0], .events = POLLIN};
+    char answer = 0;
+    int  polled;
+    while ((polled = poll(&pfd, 1, UPGRADE_TIMEOUT)) < 0 && errno == EINTR);
+    ready = ready && polled > 0 && read(pair[0], &answer, 1) == 1 && answer == UPGRADE_READY;
+    close(pair[0]);
+
+    if (!ready) {
+        log("New binary (process %d) did not start, continuing", pid);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+
+    log("New binary (process %d) is ready", pid);
+    return true;
+}
+
+/**
+ * Start an upgrade without waiting for it.
+ *
+ * @param   sets        Listening sockets of each worker.
+ * @param   count       Number of sets.
+ *
+ * A helper process starts the new binary and waits for it while this one
+ * keeps serving.  Once the new binary is ready the helper sends SIGQUIT,
+ * which drains this process as a graceful stop does.  The helper exits
+ * either way, so the new binary outlives it as an orphan.
+ **/
+static void upgrade_start(Listeners *sets, size_t count) {
+    pid_t server = getpid();
+    pid_t helper = fork();
+
+    if (helper < 0) {
+        log("Unable to fork upgrade helper: %s", strerror(errno));
+    } else if (helper == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGUSR2, SIG_IGN);
+        if (upgrade_spawn(sets, count)) {
+            log("Draining process %d", server);
+            kill(server, SIGQUIT);
+            _exit(EXIT_SUCCESS);
+        }
+        _exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Act on pending upgrade and graceful stop requests.
+ *
+ * @param   sets        Listening sockets of each worker.
+ * @param   count       Number of sets.
+ * @return  true if the server should stop accepting and drain.
+ *
+ * On SIGUSR2 the hot-file manifest is saved and the new binary started with
+ * the listening sockets (see upgrade_start); once it is ready this process
+ * drains.  Listening sockets stay open in both processes throughout, so no
+ * connection is refused while the two overlap.
+ *
+ * Server loops call this whenever a signal interrupts them, so it also
+ * writes the trace SIGUSR1 asks for.
+ **/
+bool upgrade_poll(Listeners *sets, size_t count) {
+    trace_poll();
+    if (UpgradeRequested && !Draining) {
+        UpgradeRequested = 0;
+        if (Manifest) {
+            int saved = resource_save(Manifest);
+            if (saved >= 0) {
+                log("Saved %d hot files to %s", saved, Manifest);
+            }
+        }
+        upgrade_start(sets, count);
+    }
+    return Draining;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
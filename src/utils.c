@@ -2,8 +2,8 @@
 
 #include "spidey.h"
 
-#include <ctype.h>
 #include <errno.h>
+#include <sched.h>
 #include <string.h>
 
 #include <sys/stat.h>
@@ -51,7 +51,7 @@ char * determine_mimetype(const char *path) {
     fs = fopen(MimeTypesPath, "r");
     if (!fs) {
         debug("Couldn't open file to parse extensions");
-        return DefaultMimeType;
+        return strdup(DefaultMimeType);
     }
 
     /* Scan file for matching file extensions */
@@ -60,21 +60,15 @@ char * determine_mimetype(const char *path) {
 
         while((token = strtok(NULL, WHITESPACE))) {
             if(streq(token, ext)) {
-                mimetype = strdup(mimetype);
-                return mimetype;
+                fclose(fs);
+                return strdup(mimetype);
             }
         }
     }
 
-    mimetype = strdup(DefaultMimeType);
-
     fclose(fs);
 
-    if (mimetype == NULL) {
-        return DefaultMimeType;
-    }
-
-    return mimetype;
+    return strdup(DefaultMimeType);
 }
 
 /**
@@ -108,6 +102,33 @@ char * determine_request_path(const char *uri) {
     return strdup(resolved_path);
 }
 
+/**
+ * Return the current time formatted as an HTTP date.
+ *
+ * @param   now         If not NULL, set to the current time in seconds.
+ * @return  Static string of the form "Sun, 06 Nov 1994 08:49:37 GMT".
+ *
+ * The string is only reformatted when the second changes, so this is cheap
+ * enough to call on every response.
+ **/
+const char * http_date(time_t *now) {
+    static char   date[32];
+    static time_t stamp = 0;
+    time_t        current = time(NULL);
+
+    if (current != stamp) {
+        struct tm tm;
+        gmtime_r(&current, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        stamp = current;
+    }
+
+    if (now) {
+        *now = current;
+    }
+    return date;
+}
+
 /**
  * Return static string corresponding to HTTP Status code.
  *
@@ -122,6 +143,7 @@ const char * http_status_string(Status status) {
         "400 Bad Request",
         "404 Not Found",
         "500 Internal Server Error",
+        "502 Bad Gateway",
         "418 I'm A Teapot",
     };
 
@@ -141,13 +163,7 @@ const char * http_status_string(Status status) {
  * @return  Point to first whitespace character in s.
  **/
 char * skip_nonwhitespace(char *s) {
-    char *p = s;
-
-    while(*p && !isspace(*p)) {
-        p++;
-    }
-
-    return p;
+    return s + scan_until(s, strlen(s), SCAN_WHITESPACE);
 }
 
 /**
@@ -157,13 +173,48 @@ char * skip_nonwhitespace(char *s) {
  * @return  Point to first non-whitespace character in s.
  **/
 char * skip_whitespace(char *s) {
-    char *p = s;
+    return s + scan_span(s, strlen(s), SCAN_WHITESPACE);
+}
+
+/**
+ * Extend an FNV-1a hash with bytes.
+ *
+ * @param   hash        Hash so far (FNV1A_BASIS to start).
+ * @param   data        Bytes to add.
+ * @param   length      Number of bytes.
+ * @return  Hash including data.
+ **/
+uint64_t fnv1a(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-    while(*p && isspace(*p)) {
-        p++;
+/**
+ * Take a lock in shared memory by making it odd.
+ *
+ * @param   lock        Lock word (also usable as a seqlock's sequence:
+ *                      readers retry if it was odd or changed meanwhile).
+ * @return  false if another process held it throughout SPIN_LIMIT attempts
+ *          (e.g. one that died holding it; callers then skip the work).
+ **/
+bool spin_lock(uint32_t *lock) {
+    for (int i = 0; i < SPIN_LIMIT; i++) {
+        uint32_t value = __atomic_load_n(lock, __ATOMIC_RELAXED);
+        if (!(value & 1) && __atomic_compare_exchange_n(lock, &value, value + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return true;
+        }
+        if (i % 100 == 99) {
+            sched_yield();
+        }
     }
+    return false;
+}
 
-    return p;
+void spin_unlock(uint32_t *lock) {
+    __atomic_add_fetch(lock, 1, __ATOMIC_RELEASE);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,20 +1,6 @@
 #!/bin/sh
 
-URL=student11.cse.nd.edu
-PORT=9876
-THOR=bin/thor.py
-SMALL=1kb.bin
-MED=1mb.bin
-LARGE=1g.bin
+# Throughput - static files of increasing size, served on loopback by each
+# concurrency mode (fixtures are generated by bin/bench_spidey.sh)
 
-# Test 1 small file (1KB)
-echo "Test 1 - small file (1KB)"
-./$THOR -t 10 http://$URL:$PORT/$SMALL
-
-# Test 2 medium file (1MB)
-echo "Test 2 - medium file (1MB)"
-./$THOR -t 10 http://$URL:$PORT/$MED
-
-# Test 3 large file (1GB)
-echo "Test 3 - large file (1GB)"
-./$THOR -t 10 http://$URL:$PORT/$LARGE
+exec bin/bench_spidey.sh -s "1K 1M 64M" -t '^file-' "$@"